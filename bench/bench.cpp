@@ -0,0 +1,483 @@
+// Micro and macro benchmarks of the renderer, results as JSON.
+//   make bench && bench/bench [--reps N] [--filter substring] [--out file.json] [--obj-dir obj]
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "tgaimage.h"
+#include "model.h"
+#include "our_gl.h"
+#include "shaders.h"
+#include "shadowmap.h"
+#include "lights.h"
+#include "renderer.h"
+#include "rendertarget.h"
+#include "bvh.h"
+#include "timer.h"
+#include "framebuffer.h"
+#include "postfx.h"
+
+struct Result {
+    Result() : name(), unit(), items(0.), ms() {}
+    std::string name;
+    std::string unit;    // what one item is ("pixels", "calls", ...), empty when only time matters
+    double items;        // items processed by one repetition
+    std::vector<double> ms;
+};
+
+// times body() once for warm up, then reps times
+template <typename F> Result measure(const std::string &name, int reps, F &body, const std::string &unit="", double items=0.) {
+    Result r;
+    r.name = name;
+    r.unit = unit;
+    r.items = items;
+    body();
+    for (int i=0; i<reps; i++) {
+        double t0 = wall_time();
+        body();
+        r.ms.push_back((wall_time()-t0)*1000.);
+    }
+    return r;
+}
+
+static void write_json(std::ostream &out, const std::vector<Result> &results, int reps) {
+    out << "{\n  \"reps\": " << reps << ",\n  \"compiler\": \"" << __VERSION__ << "\",\n  \"benchmarks\": [\n";
+    for (size_t i=0; i<results.size(); i++) {
+        std::vector<double> ms = results[i].ms;
+        std::sort(ms.begin(), ms.end());
+        double mean = 0., var = 0.;
+        for (size_t k=0; k<ms.size(); k++) mean += ms[k];
+        mean /= ms.size();
+        for (size_t k=0; k<ms.size(); k++) var += (ms[k]-mean)*(ms[k]-mean);
+        double stddev = ms.size()>1 ? std::sqrt(var/(ms.size()-1)) : 0.;
+        double median = ms.size()%2 ? ms[ms.size()/2] : .5*(ms[ms.size()/2-1]+ms[ms.size()/2]);
+        out << "    {\"name\": \"" << results[i].name << "\", \"mean_ms\": " << mean << ", \"median_ms\": " << median
+            << ", \"min_ms\": " << ms.front() << ", \"max_ms\": " << ms.back() << ", \"stddev_ms\": " << stddev;
+        if (!results[i].unit.empty())
+            out << ", \"" << results[i].unit << "_per_second\": " << results[i].items/(median*1e-3);
+        out << "}" << (i+1<results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+
+struct BarycentricBench {
+    double sum;
+    BarycentricBench() : sum(0.) {}
+    void operator()() {
+        const Vec2f A(10, 10), B(700, 60), C(300, 650);
+        double s = 0.;
+        for (int y=0; y<1000; y++)
+            for (int x=0; x<1000; x++) {
+                Vec3f c = barycentric(A, B, C, Vec2f(x*.8f, y*.8f));
+                s += c.x;
+            }
+        sum += s;
+    }
+};
+
+static Vec4f point(float x, float y, float z) {
+    return Vec4f(x, y, z, 1.f);
+}
+
+// 4x4 float matrix kernels: vertex transforms, products and inverses
+struct MatrixBench {
+    enum Op { TRANSFORM, MULTIPLY, INVERT };
+    MatrixBench(Op o) : op(o), m(Matrix::identity()), sum(0.f) {
+        m[0][1] = .5f; m[1][2] = -.25f; m[2][3] = 2.f; m[3][2] = -.1f;
+    }
+    void operator()() {
+        Vec4f acc;
+        Matrix p = m;
+        for (int i=0; i<1000000; i++) {
+            if (op==TRANSFORM) acc = acc + m*Vec4f(i*1e-6f, 1.f, -1.f, 1.f);
+            else if (op==MULTIPLY) p = p*m, p[3][3] = 1.f;
+            else if (i%10==0) p = (m*p).invert();
+        }
+        sum += acc[0] + p[0][0];
+    }
+    Op op;
+    Matrix m;
+    float sum;
+};
+
+struct FlatShader : public IShader {
+    FlatShader() {}
+    virtual Vec4f vertex(int, int) { return Vec4f(); }
+    virtual bool fragment(Vec3f, TGAColor &color) {
+        color = TGAColor(255, 255, 255);
+        return false;
+    }
+};
+
+// clearing an 800x800 color+depth target: everything, the way a fresh frame used to start, or only the
+// tiles under a box covering the central third of the screen, about what a model leaves dirty
+struct ClearBench {
+    ClearBench(bool full_clear) : target(800, 800), full(full_clear) {}
+    void operator()() {
+        for (int i=0; i<10; i++) {
+            if (full) {
+                target.tiles().touch_all();
+            } else {
+                Vec4f a[3] = {point(260, 260, 0), point(540, 260, 0), point(260, 540, 0)};
+                Vec4f b[3] = {point(540, 540, 0), point(540, 260, 0), point(260, 540, 0)};
+                target.tiles().touch(a);
+                target.tiles().touch(b);
+            }
+            target.clear();
+        }
+    }
+    RenderTarget target;
+    bool full;
+};
+
+// many right triangles with legs of the given size scattered over the framebuffer, through triangle() or triangle_fast()
+struct FillBench {
+    FillBench(int size, int count, bool fast_path) : tris(), image(800, 800, TGAImage::RGB), zbuffer(800*800), shader(), pixels(0.), fast(fast_path) {
+        unsigned int seed = 1;
+        for (int i=0; i<count; i++) {
+            seed = seed*1103515245u + 12345u;
+            float x = (seed>>8)%(800-size), y = (seed>>20)%(800-size);
+            float z = (seed>>4)%1000;
+            tris.push_back(point(x, y, z));
+            tris.push_back(point(x+size, y, z));
+            tris.push_back(point(x, y+size, z));
+        }
+        pixels = count*(size+1.)*(size+2.)/2.;
+    }
+    void operator()() {
+        std::fill(zbuffer.begin(), zbuffer.end(), -std::numeric_limits<float>::max());
+        for (size_t i=0; i<tris.size(); i+=3) {
+            if (fast)
+                triangle_fast(&tris[i], shader, image, &zbuffer[0]);
+            else
+                triangle(&tris[i], shader, image, &zbuffer[0]);
+        }
+    }
+    std::vector<Vec4f> tris;
+    TGAImage image;
+    std::vector<float> zbuffer;
+    FlatShader shader;
+    double pixels;
+    bool fast;
+};
+
+// one main pass of a scene shader over a model, with the camera of frame 0
+struct ShaderBench {
+    ShaderBench(Model *m, const std::string &name) : model(m), shader_name(name), ctx(), shadow_cache(800, 800), lights(), grid(),
+        image(800, 800, TGAImage::RGB), zbuffer(800*800) {
+        ctx.light_dir = Vec3f(-1, 1, 1).normalize();
+        Light sun;
+        sun.type = Light::DIRECTIONAL;
+        sun.direction = ctx.light_dir;
+        lights.push_back(sun);
+        std::vector<Light> rig = make_light_rig(64);
+        lights.insert(lights.end(), rig.begin(), rig.end());
+        lookat(ctx, ctx.eye, ctx.center, ctx.up);
+        viewport(ctx, 100, 100, 600, 600);
+        projection(ctx, -1.f/(ctx.eye-ctx.center).norm());
+        grid.build(lights, ctx.Viewport*ctx.Projection*ctx.ModelView, 800, 800);
+    }
+    void operator()() {
+        std::vector<Model *> scene(1, model);
+        ShadowMap &shadow = shadow_cache.get(ctx.light_dir, ctx.center, ctx.up, scene);
+        ShaderParams params;
+        params.shadow = &shadow;
+        params.lights = &lights;
+        params.light_grid = &grid;
+        SceneShader *shader = make_shader(shader_name, ctx, params);
+        shader->prepare();
+        shader->model = model;
+        std::fill(zbuffer.begin(), zbuffer.end(), -std::numeric_limits<float>::max());
+        Vec4f pts[3];
+        for (int i=0; i<model->nfaces(); i++) {
+            for (int j=0; j<3; j++) pts[j] = shader->vertex(i, j);
+            triangle(pts, *shader, image, &zbuffer[0]);
+        }
+        delete shader;
+    }
+    Model *model;
+    std::string shader_name;
+    RenderContext ctx;
+    ShadowMapCache shadow_cache;
+    std::vector<Light> lights;
+    LightGrid grid;
+    TGAImage image;
+    std::vector<float> zbuffer;
+private:
+    ShaderBench(const ShaderBench &);
+    ShaderBench &operator=(const ShaderBench &);
+};
+
+// shadows of the head for the camera of frame 0, at 800x800: rendering the shadow map (the light alternates between
+// two directions so that the cache never hits), or a camera depth prepass and one shadow ray per covered pixel
+struct ShadowBench {
+    ShadowBench(Model *m, bool ray_traced) : scene(1, m), rays(ray_traced), bvh(scene), cache(800, 800, 0.f, 1), ctx(), zbuffer(800, 800),
+        mask(), k(0), cast(0.) {
+        ctx.light_dir = Vec3f(-1, 1, 1).normalize();
+        lookat(ctx, ctx.eye, ctx.center, ctx.up);
+        viewport(ctx, 100, 100, 600, 600);
+        projection(ctx, -1.f/(ctx.eye-ctx.center).norm());
+    }
+    void operator()() {
+        if (!rays) {
+            cache.get(Vec3f(k++%2 ? -1.f : -.9f, 1, 1).normalize(), ctx.center, ctx.up, scene);
+            return;
+        }
+        Matrix M = ctx.Viewport*ctx.Projection*ctx.ModelView;
+        zbuffer.tiles().touch_all();
+        zbuffer.clear();
+        Vec4f pts[3];
+        for (int i=0; i<scene[0]->nfaces(); i++) {
+            for (int j=0; j<3; j++) pts[j] = M*embed<4>(scene[0]->vert(i, j));
+            triangle_depth(pts, zbuffer.data(), 800, 800);
+        }
+        cast = trace_shadow_mask(bvh, zbuffer.data(), 800, 800, M.invert(), ctx.light_dir, ShadowRayParams(), mask);
+    }
+    std::vector<Model *> scene;
+    bool rays;
+    BVH bvh;
+    ShadowMapCache cache;
+    RenderContext ctx;
+    DepthBuffer zbuffer;
+    std::vector<float> mask;
+    int k;
+    double cast;
+private:
+    ShadowBench(const ShadowBench &);
+    ShadowBench &operator=(const ShadowBench &);
+};
+
+struct BVHBuildBench {
+    BVHBuildBench(Model *m) : scene(1, m) {}
+    void operator()() {
+        BVH bvh(scene);
+    }
+    std::vector<Model *> scene;
+};
+
+struct LoadBench {
+    LoadBench(const std::string &f) : file(f) {}
+    void operator()() {
+        Model m(file.c_str());
+    }
+    std::string file;
+};
+
+struct TGAReadBench {
+    TGAReadBench(const std::string &f) : file(f) {}
+    void operator()() {
+        TGAImage img;
+        img.read_tga_file(file.c_str());
+    }
+    std::string file;
+};
+
+struct TGAWriteBench {
+    TGAWriteBench(TGAImage &img, bool compress) : image(img), rle(compress) {}
+    void operator()() {
+        image.write_tga_file("bench_tmp.tga", rle);
+    }
+    TGAImage &image;
+    bool rle;
+};
+
+struct FrameBench {
+    FrameBench(Renderer &r) : renderer(r), k(0) {}
+    void operator()() {
+        Frame f = renderer.render(k++%50);
+        delete f.image;
+        delete f.shadow_depth;
+    }
+    Renderer &renderer;
+    int k;
+};
+
+/////////////////////////////////////////////////////////////////////////////////
+// Correctness checks, selected like the benchmarks but not timed: a failure is printed and makes the exit
+// status 1. "make check" runs only these.
+
+// non-finite and huge values through every tone curve and the 8-bit encode (SSE and scalar paths): NaN is
+// black, everything above white is white, and no value may index outside the encode table
+static bool check_hdr_nonfinite() {
+    const float inf = std::numeric_limits<float>::infinity();
+    const float values[] = {std::numeric_limits<float>::quiet_NaN(), inf, -inf, 1e30f, 1.f, 0.f, -1.f};
+    const int expected[] = {0, 255, 0, 255, 255, 0, 0}; // with an exposure of 1e20
+    const int n = sizeof(values)/sizeof(values[0]);
+    const Tonemap ops[] = {TONEMAP_NONE, TONEMAP_REINHARD, TONEMAP_ACES};
+    const float gammas[] = {2.2f, 1.8f};
+    bool ok = true;
+    for (int o=0; o<3; o++) {
+        for (int g=0; g<2; g++) {
+            FloatImage img(n, 1);
+            for (int x=0; x<n; x++) img.set(x, 0, Vec4f(values[x], values[x], values[x], values[x]));
+            TonemapPass(ops[o], 1e20f).apply(img);
+            TGAImage out(n, 1, TGAImage::RGBA);
+            img.to_tga(out, gammas[g]);
+            for (int x=0; x<n; x++) {
+                TGAColor c = out.get(x, 0);
+                if (c[0]==expected[x]) continue;
+                std::cerr << "check_hdr_nonfinite: tonemap " << o << ", gamma " << gammas[g] << ": " << values[x]
+                          << " encoded as " << (int)c[0] << ", expected " << expected[x] << std::endl;
+                ok = false;
+            }
+        }
+    }
+    return ok;
+}
+
+// spec_pow against a double precision pow over every exponent of an 8-bit specular map and x in [0,1]: the
+// relative error stays below e*2^-24 (so below 1.6e-5) wherever the result is a normal float; below that,
+// in the denormal range, it is only required to be that small in absolute terms
+static bool check_spec_pow() {
+    const int steps = 8192;
+    double worst = 0.;
+    bool ok = true;
+    for (int e=0; e<=255; e++) {
+        for (int i=0; i<=steps; i++) {
+            const float x = i/(float)steps;
+            const double ref = std::pow((double)x, e), r = spec_pow(x, e);
+            const double bound = std::max(1, e)*std::ldexp(1., -24);
+            const double err = ref>=std::numeric_limits<float>::min() ? std::abs(r-ref)/ref
+                                                                       : std::abs(r-ref)/std::numeric_limits<float>::min();
+            worst = std::max(worst, ref>=std::numeric_limits<float>::min() ? err : 0.);
+            if (err<=bound && err<1.6e-5) continue;
+            if (ok)
+                std::cerr << "check_spec_pow: spec_pow(" << x << ", " << e << ") = " << r << ", pow = " << ref
+                          << " (error " << err << ", bound " << bound << ")" << std::endl;
+            ok = false;
+        }
+    }
+    std::cerr << "check_spec_pow: largest relative error " << worst << std::endl;
+    return ok;
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+
+static bool selected(const std::string &name, const std::string &filter) {
+    return filter.empty() || name.find(filter)!=std::string::npos;
+}
+
+int main(int argc, char **argv) {
+    int reps = 5;
+    std::string filter, out_file, obj_dir = "obj";
+    for (int i=1; i<argc; i++) {
+        if (!strcmp(argv[i], "--reps") && i+1<argc) reps = std::max(1, atoi(argv[++i]));
+        else if (!strcmp(argv[i], "--filter") && i+1<argc) filter = argv[++i];
+        else if (!strcmp(argv[i], "--out") && i+1<argc) out_file = argv[++i];
+        else if (!strcmp(argv[i], "--obj-dir") && i+1<argc) obj_dir = argv[++i];
+        else {
+            std::cerr << "usage: " << argv[0] << " [--reps N] [--filter substring] [--out file.json] [--obj-dir dir]" << std::endl;
+            return 1;
+        }
+    }
+    const std::string head = obj_dir + "/african_head.obj", diablo = obj_dir + "/diablo3_pose.obj";
+    std::vector<Result> results;
+    int failed = 0;
+
+    if (selected("check_hdr_nonfinite", filter) && !check_hdr_nonfinite()) failed++;
+    if (selected("check_spec_pow", filter) && !check_spec_pow()) failed++;
+
+    if (selected("barycentric", filter)) {
+        BarycentricBench b;
+        results.push_back(measure("barycentric", reps, b, "calls", 1e6));
+    }
+    const char *clear_names[] = {"target_clear_full", "target_clear_tiles"};
+    for (int i=0; i<2; i++) {
+        if (!selected(clear_names[i], filter)) continue;
+        ClearBench b(i==0);
+        results.push_back(measure(clear_names[i], reps, b, "clears", 10));
+    }
+    const char *matrix_names[] = {"mat4_transform", "mat4_multiply", "mat4_invert"};
+    const double matrix_items[] = {1e6, 1e6, 1e5};
+    for (int i=0; i<3; i++) {
+        if (!selected(matrix_names[i], filter)) continue;
+        MatrixBench b((MatrixBench::Op)i);
+        results.push_back(measure(matrix_names[i], reps, b, "ops", matrix_items[i]));
+    }
+    const int sizes[] = {4, 16, 64, 256};
+    for (int fast=0; fast<2; fast++) {
+        for (int i=0; i<4; i++) {
+            char name[40];
+            sprintf(name, fast ? "triangle_fill_fast_%dpx" : "triangle_fill_%dpx", sizes[i]);
+            if (!selected(name, filter)) continue;
+            FillBench b(sizes[i], std::max(4, 400000/(sizes[i]*sizes[i])), fast);
+            results.push_back(measure(name, reps, b, "pixels", b.pixels));
+        }
+    }
+    bool any_shader = false;
+    for (int i=0; i<nshaders; i++) any_shader = any_shader || selected(std::string("shader_")+shader_names[i], filter);
+    if (any_shader) {
+        Model model(head.c_str());
+        for (int i=0; i<nshaders; i++) {
+            std::string name = std::string("shader_") + shader_names[i];
+            if (!selected(name, filter)) continue;
+            ShaderBench b(&model, shader_names[i]);
+            results.push_back(measure(name, reps, b, "triangles", model.nfaces()));
+        }
+    }
+    if (selected("shadow_", filter) || selected("bvh_build", filter)) {
+        Model model(head.c_str());
+        if (selected("bvh_build", filter)) {
+            BVHBuildBench b(&model);
+            results.push_back(measure("bvh_build_african_head", reps, b, "triangles", model.nfaces()));
+        }
+        if (selected("shadow_map_raster", filter)) {
+            ShadowBench b(&model, false);
+            results.push_back(measure("shadow_map_raster", reps, b));
+        }
+        if (selected("shadow_rays", filter)) {
+            ShadowBench b(&model, true);
+            b();
+            results.push_back(measure("shadow_rays", reps, b, "rays", b.cast));
+        }
+    }
+    if (selected("model_load_african_head", filter)) {
+        LoadBench b(head);
+        results.push_back(measure("model_load_african_head", reps, b));
+    }
+    const std::string texture = obj_dir + "/african_head_diffuse.tga";
+    if (selected("tga_read", filter)) {
+        TGAReadBench b(texture);
+        results.push_back(measure("tga_read_diffuse", reps, b));
+    }
+    if (selected("tga_write", filter)) {
+        TGAImage img;
+        img.read_tga_file(texture.c_str());
+        TGAWriteBench raw(img, false), rle(img, true);
+        results.push_back(measure("tga_write_raw", reps, raw));
+        results.push_back(measure("tga_write_rle", reps, rle));
+        std::remove("bench_tmp.tga");
+    }
+    const std::string scenes[2] = {head, diablo};
+    const char *scene_names[2] = {"frame_african_head", "frame_diablo3_pose"};
+    for (int i=0; i<2; i++) {
+        if (!selected(scene_names[i], filter)) continue;
+        RenderSettings settings;
+        std::vector<const char *> models(1, scenes[i].c_str());
+        Renderer renderer(settings, models);
+        FrameBench b(renderer);
+        results.push_back(measure(scene_names[i], reps, b));
+    }
+
+    if (out_file.empty()) {
+        write_json(std::cout, results, reps);
+    } else {
+        std::ofstream out(out_file.c_str());
+        write_json(out, results, reps);
+        if (!out) {
+            std::cerr << "can't write " << out_file << std::endl;
+            return 1;
+        }
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,356 @@
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "bvh.h"
+#include "timer.h"
+
+static const int nbins = 16;
+static const int max_leaf = 16;  // the SAH may keep up to that many triangles in a leaf when splitting does not pay
+static const int max_depth = 60; // traversal stacks hold 64 entries
+
+struct BVHBuildRef {
+    float bmin[3], bmax[3], c[3];
+    int tri;
+};
+
+struct Bounds {
+    Bounds() : lo(), hi() {
+        for (int k=0; k<3; k++) {
+            lo[k] = std::numeric_limits<float>::max();
+            hi[k] = -std::numeric_limits<float>::max();
+        }
+    }
+    void grow(const float *bmin, const float *bmax) {
+        for (int k=0; k<3; k++) {
+            lo[k] = std::min(lo[k], bmin[k]);
+            hi[k] = std::max(hi[k], bmax[k]);
+        }
+    }
+    float area() const {
+        if (lo[0]>hi[0]) return 0.f;
+        const float dx = hi[0]-lo[0], dy = hi[1]-lo[1], dz = hi[2]-lo[2];
+        return 2.f*(dx*dy + dy*dz + dz*dx);
+    }
+    float lo[3], hi[3];
+};
+
+// centroid bin of a reference along the split axis
+struct InLeftBins {
+    InLeftBins(int a, float l, float s, int b) : axis(a), lo(l), scale(s), split(b) {}
+    bool operator()(const BVHBuildRef &r) const {
+        return std::min(nbins-1, (int)((r.c[axis]-lo)*scale)) < split;
+    }
+    int axis;
+    float lo, scale;
+    int split;
+};
+
+struct CentroidLess {
+    CentroidLess(int a) : axis(a) {}
+    bool operator()(const BVHBuildRef &a, const BVHBuildRef &b) const {
+        return a.c[axis] < b.c[axis];
+    }
+    int axis;
+};
+
+BVH::BVH(const std::vector<Model *> &scene, int leaf_size) : leaf_size_(std::max(1, leaf_size)), nodes_(), tris_(), depth_(0), build_ms_(0.) {
+    const double t0 = wall_time();
+    std::vector<BVHBuildRef> refs;
+    std::vector<Triangle> tris;
+    for (size_t m=0; m<scene.size(); m++) {
+        for (int i=0; i<scene[m]->nfaces(); i++) {
+            Vec3f v[3];
+            for (int j=0; j<3; j++) v[j] = scene[m]->vert(i, j);
+            Triangle t;
+            BVHBuildRef r;
+            for (int k=0; k<3; k++) {
+                t.v0[k] = v[0][k];
+                t.e1[k] = v[1][k]-v[0][k];
+                t.e2[k] = v[2][k]-v[0][k];
+                r.bmin[k] = std::min(v[0][k], std::min(v[1][k], v[2][k]));
+                r.bmax[k] = std::max(v[0][k], std::max(v[1][k], v[2][k]));
+                r.c[k] = .5f*(r.bmin[k]+r.bmax[k]);
+            }
+            r.tri = tris.size();
+            tris.push_back(t);
+            refs.push_back(r);
+        }
+    }
+    nodes_.reserve(2*refs.size()+1);
+    nodes_.push_back(Node());
+    build(refs, 0, 0, refs.size(), 1);
+    // leaves index the triangles in the order the build left the references in
+    tris_.resize(refs.size());
+    for (size_t i=0; i<refs.size(); i++) tris_[i] = tris[refs[i].tri];
+    build_ms_ = (wall_time()-t0)*1000.;
+}
+
+void BVH::build(std::vector<BVHBuildRef> &refs, int n, int begin, int end, int level) {
+    depth_ = std::max(depth_, level);
+    Bounds box, centroids;
+    for (int i=begin; i<end; i++) {
+        box.grow(refs[i].bmin, refs[i].bmax);
+        centroids.grow(refs[i].c, refs[i].c);
+    }
+    Node &node = nodes_[n];
+    for (int k=0; k<3; k++) {
+        node.bmin[k] = box.lo[k];
+        node.bmax[k] = box.hi[k];
+    }
+    node.start = begin;
+    node.count = end-begin;
+    const int count = end-begin;
+    if (count<=leaf_size_ || level>=max_depth) return;
+
+    // binned SAH: the centroids are dropped into nbins slots along each axis, and every boundary between
+    // slots is a candidate split, costed as (left count * left area + right count * right area) / area
+    int best_axis = -1, best_split = 0;
+    float best_cost = std::numeric_limits<float>::max();
+    for (int axis=0; axis<3; axis++) {
+        const float extent = centroids.hi[axis]-centroids.lo[axis];
+        if (extent<=1e-9f) continue;
+        const float scale = nbins/extent;
+        Bounds bins[nbins];
+        int counts[nbins] = {0};
+        for (int i=begin; i<end; i++) {
+            const int b = std::min(nbins-1, (int)((refs[i].c[axis]-centroids.lo[axis])*scale));
+            counts[b]++;
+            bins[b].grow(refs[i].bmin, refs[i].bmax);
+        }
+        float right_area[nbins];
+        int right_count[nbins];
+        Bounds acc;
+        int nacc = 0;
+        for (int b=nbins-1; b>0; b--) {
+            acc.grow(bins[b].lo, bins[b].hi);
+            nacc += counts[b];
+            right_area[b] = acc.area();
+            right_count[b] = nacc;
+        }
+        acc = Bounds();
+        nacc = 0;
+        for (int b=1; b<nbins; b++) {
+            acc.grow(bins[b-1].lo, bins[b-1].hi);
+            nacc += counts[b-1];
+            const float cost = nacc*acc.area() + right_count[b]*right_area[b];
+            if (nacc && right_count[b] && cost<best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = b;
+            }
+        }
+    }
+    int mid;
+    if (best_axis<0) { // all centroids in one spot: halve the list
+        mid = begin+count/2;
+        std::nth_element(refs.begin()+begin, refs.begin()+mid, refs.begin()+end, CentroidLess(0));
+    } else {
+        // traversal costs about one triangle test: split only when it saves more than that
+        if (1.f + best_cost/box.area() >= count && count<=max_leaf) return;
+        const float scale = nbins/(centroids.hi[best_axis]-centroids.lo[best_axis]);
+        mid = std::partition(refs.begin()+begin, refs.begin()+end, InLeftBins(best_axis, centroids.lo[best_axis], scale, best_split)) - refs.begin();
+    }
+    const int left = nodes_.size();
+    nodes_.push_back(Node());
+    nodes_.push_back(Node());
+    nodes_[n].start = left; // node may dangle after the push_backs
+    nodes_[n].count = 0;
+    build(refs, left, begin, mid, level+1);
+    build(refs, left+1, mid, end, level+1);
+}
+
+// a zero direction component would turn the slab test into inf*0
+static float safe_inverse(float d) {
+    const float eps = 1e-8f;
+    if (std::abs(d)<eps) d = d<0.f ? -eps : eps;
+    return 1.f/d;
+}
+
+bool BVH::occluded(const Vec3f &o, const Vec3f &d, float tmin, float tmax) const {
+    if (nodes_.empty() || tris_.empty()) return false;
+    const float inv[3] = {safe_inverse(d.x), safe_inverse(d.y), safe_inverse(d.z)};
+    const float org[3] = {o.x, o.y, o.z}, dir[3] = {d.x, d.y, d.z};
+    int stack[64], sp = 0;
+    stack[sp++] = 0;
+    while (sp) {
+        const Node &node = nodes_[stack[--sp]];
+        float t0 = tmin, t1 = tmax;
+        for (int k=0; k<3; k++) {
+            float a = (node.bmin[k]-org[k])*inv[k], b = (node.bmax[k]-org[k])*inv[k];
+            if (a>b) std::swap(a, b);
+            t0 = std::max(t0, a);
+            t1 = std::min(t1, b);
+        }
+        if (t0>t1) continue;
+        if (node.count) {
+            for (int i=node.start; i<node.start+node.count; i++) {
+                const Triangle &tri = tris_[i];
+                const float p[3] = {dir[1]*tri.e2[2]-dir[2]*tri.e2[1], dir[2]*tri.e2[0]-dir[0]*tri.e2[2], dir[0]*tri.e2[1]-dir[1]*tri.e2[0]};
+                const float det = tri.e1[0]*p[0] + tri.e1[1]*p[1] + tri.e1[2]*p[2];
+                if (std::abs(det)<1e-12f) continue;
+                const float inv_det = 1.f/det;
+                const float s[3] = {org[0]-tri.v0[0], org[1]-tri.v0[1], org[2]-tri.v0[2]};
+                const float u = (s[0]*p[0] + s[1]*p[1] + s[2]*p[2])*inv_det;
+                if (u<0.f || u>1.f) continue;
+                const float q[3] = {s[1]*tri.e1[2]-s[2]*tri.e1[1], s[2]*tri.e1[0]-s[0]*tri.e1[2], s[0]*tri.e1[1]-s[1]*tri.e1[0]};
+                const float v = (dir[0]*q[0] + dir[1]*q[1] + dir[2]*q[2])*inv_det;
+                if (v<0.f || u+v>1.f) continue;
+                const float t = (tri.e2[0]*q[0] + tri.e2[1]*q[1] + tri.e2[2]*q[2])*inv_det;
+                if (t>tmin && t<tmax) return true;
+            }
+        } else {
+            stack[sp++] = node.start;
+            stack[sp++] = node.start+1;
+        }
+    }
+    return false;
+}
+
+int BVH::occluded4(const Vec3f *o, const Vec3f *d, float tmin, float tmax, int active) const {
+    if (nodes_.empty() || tris_.empty() || !active) return 0;
+#ifdef __SSE2__
+    const __m128 ox = _mm_setr_ps(o[0].x, o[1].x, o[2].x, o[3].x);
+    const __m128 oy = _mm_setr_ps(o[0].y, o[1].y, o[2].y, o[3].y);
+    const __m128 oz = _mm_setr_ps(o[0].z, o[1].z, o[2].z, o[3].z);
+    const __m128 dx = _mm_setr_ps(d[0].x, d[1].x, d[2].x, d[3].x);
+    const __m128 dy = _mm_setr_ps(d[0].y, d[1].y, d[2].y, d[3].y);
+    const __m128 dz = _mm_setr_ps(d[0].z, d[1].z, d[2].z, d[3].z);
+    const __m128 ix = _mm_setr_ps(safe_inverse(d[0].x), safe_inverse(d[1].x), safe_inverse(d[2].x), safe_inverse(d[3].x));
+    const __m128 iy = _mm_setr_ps(safe_inverse(d[0].y), safe_inverse(d[1].y), safe_inverse(d[2].y), safe_inverse(d[3].y));
+    const __m128 iz = _mm_setr_ps(safe_inverse(d[0].z), safe_inverse(d[1].z), safe_inverse(d[2].z), safe_inverse(d[3].z));
+    const __m128 tmin4 = _mm_set1_ps(tmin), tmax4 = _mm_set1_ps(tmax);
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.f), eps = _mm_set1_ps(1e-12f);
+    const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    int alive = active & 15, hit = 0;
+    int stack[64], sp = 0;
+    stack[sp++] = 0;
+    while (sp) {
+        const Node &node = nodes_[stack[--sp]];
+        // slab test of the node box against the 4 rays
+        __m128 a = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bmin[0]), ox), ix), b = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bmax[0]), ox), ix);
+        __m128 t0 = _mm_max_ps(tmin4, _mm_min_ps(a, b)), t1 = _mm_min_ps(tmax4, _mm_max_ps(a, b));
+        a = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bmin[1]), oy), iy);
+        b = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bmax[1]), oy), iy);
+        t0 = _mm_max_ps(t0, _mm_min_ps(a, b));
+        t1 = _mm_min_ps(t1, _mm_max_ps(a, b));
+        a = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bmin[2]), oz), iz);
+        b = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bmax[2]), oz), iz);
+        t0 = _mm_max_ps(t0, _mm_min_ps(a, b));
+        t1 = _mm_min_ps(t1, _mm_max_ps(a, b));
+        if (!(_mm_movemask_ps(_mm_cmple_ps(t0, t1)) & alive)) continue;
+        if (!node.count) {
+            stack[sp++] = node.start;
+            stack[sp++] = node.start+1;
+            continue;
+        }
+        for (int i=node.start; i<node.start+node.count; i++) {
+            // Moller-Trumbore, one triangle against the 4 rays
+            const Triangle &tri = tris_[i];
+            const __m128 e1x = _mm_set1_ps(tri.e1[0]), e1y = _mm_set1_ps(tri.e1[1]), e1z = _mm_set1_ps(tri.e1[2]);
+            const __m128 e2x = _mm_set1_ps(tri.e2[0]), e2y = _mm_set1_ps(tri.e2[1]), e2z = _mm_set1_ps(tri.e2[2]);
+            const __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+            const __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+            const __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+            const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+            const __m128 inv_det = _mm_div_ps(one, det);
+            const __m128 sx = _mm_sub_ps(ox, _mm_set1_ps(tri.v0[0]));
+            const __m128 sy = _mm_sub_ps(oy, _mm_set1_ps(tri.v0[1]));
+            const __m128 sz = _mm_sub_ps(oz, _mm_set1_ps(tri.v0[2]));
+            const __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inv_det);
+            const __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+            const __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+            const __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+            const __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv_det);
+            const __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv_det);
+            __m128 m = _mm_cmpgt_ps(_mm_and_ps(det, abs_mask), eps);
+            m = _mm_and_ps(m, _mm_cmpge_ps(u, zero));
+            m = _mm_and_ps(m, _mm_cmpge_ps(v, zero));
+            m = _mm_and_ps(m, _mm_cmple_ps(_mm_add_ps(u, v), one));
+            m = _mm_and_ps(m, _mm_cmpgt_ps(t, tmin4));
+            m = _mm_and_ps(m, _mm_cmplt_ps(t, tmax4));
+            const int h = _mm_movemask_ps(m) & alive;
+            if (!h) continue;
+            hit |= h;
+            alive &= ~h;
+            if (!alive) return hit;
+        }
+    }
+    return hit;
+#else
+    int hit = 0;
+    for (int i=0; i<4; i++)
+        if ((active>>i & 1) && occluded(o[i], d[i], tmin, tmax)) hit |= 1<<i;
+    return hit;
+#endif
+}
+
+int BVH::nodes() const {
+    return nodes_.size();
+}
+
+int BVH::triangles() const {
+    return tris_.size();
+}
+
+int BVH::depth() const {
+    return depth_;
+}
+
+double BVH::build_ms() const {
+    return build_ms_;
+}
+
+ShadowRayParams::ShadowRayParams() : samples(1), light_size(0.f), bias(.02f) {}
+
+unsigned long trace_shadow_mask(const BVH &bvh, const float *zbuffer, int width, int height, const Matrix &screen_to_world,
+                                Vec3f light_dir, const ShadowRayParams &params, std::vector<float> &mask) {
+    mask.assign((size_t)width*height, 1.f);
+    const int samples = std::max(1, params.samples);
+    light_dir.normalize();
+    // orthonormal frame around the light direction, to spread the samples over the cone
+    Vec3f u = cross(light_dir, std::abs(light_dir.x)<.9f ? Vec3f(1, 0, 0) : Vec3f(0, 1, 0)).normalize();
+    Vec3f v = cross(light_dir, u);
+    const float spread = std::tan(params.light_size);
+    const float empty = -std::numeric_limits<float>::max();
+    unsigned long rays = 0;
+#pragma omp parallel for schedule(dynamic, 4) reduction(+:rays)
+    for (int y=0; y<height; y++) {
+        // packets of 4 neighbouring pixels along the row
+        for (int x=0; x<width; x+=4) {
+            Vec3f o[4];
+            int active = 0;
+            for (int i=0; i<4 && x+i<width; i++) {
+                const float z = zbuffer[x+i+(size_t)y*width];
+                if (z==empty) continue;
+                // the zbuffer holds the truncated depth of the fragment rasterized at integer pixel coordinates
+                Vec4f p = screen_to_world*Vec4f(x+i, y, z+.5f, 1.f);
+                o[i] = Vec3f(p[0]/p[3], p[1]/p[3], p[2]/p[3]);
+                active |= 1<<i;
+            }
+            if (!active) continue;
+            float visible[4] = {1.f, 1.f, 1.f, 1.f};
+            for (int s=0; s<samples; s++) {
+                Vec3f d[4];
+                for (int i=0; i<4; i++) {
+                    d[i] = light_dir;
+                    if (samples==1) continue;
+                    // stratified over the disk (golden angle spiral), rotated per pixel so the pattern does not band
+                    const unsigned h = (unsigned)(x+i)*73856093u ^ (unsigned)y*19349663u;
+                    const float r = spread*std::sqrt((s+.5f)/samples);
+                    const float phi = s*2.39996323f + (h&1023)*(6.2831853f/1024.f);
+                    d[i] = (light_dir + u*(r*std::cos(phi)) + v*(r*std::sin(phi))).normalize();
+                }
+                const int hit = bvh.occluded4(o, d, params.bias, std::numeric_limits<float>::max(), active);
+                for (int i=0; i<4; i++)
+                    if (hit>>i & 1) visible[i] -= 1.f/samples;
+                rays += (active&1) + (active>>1&1) + (active>>2&1) + (active>>3&1);
+            }
+            for (int i=0; i<4; i++)
+                if (active>>i & 1) mask[x+i+(size_t)y*width] = std::max(0.f, visible[i]);
+        }
+    }
+    return rays;
+}
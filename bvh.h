@@ -0,0 +1,58 @@
+#ifndef __BVH_H__
+#define __BVH_H__
+#include <vector>
+#include "geometry.h"
+#include "model.h"
+
+struct BVHBuildRef;
+
+// Bounding volume hierarchy over the triangles of a scene, in world space (the space of the .obj files).
+// Built once with the surface area heuristic; answers occlusion queries only (any hit, not the closest one),
+// which is all shadow rays need. Queries are const and may run from several threads at once.
+class BVH {
+public:
+    BVH(const std::vector<Model *> &scene, int leaf_size=4);
+    // whether anything lies on the segment o + t*d, tmin < t < tmax
+    bool occluded(const Vec3f &o, const Vec3f &d, float tmin, float tmax) const;
+    // 4 rays at once, traversed together (SSE): bit i of the result is set when ray i is occluded, and
+    // rays whose bit is clear in active are not traced. Coherent rays (neighbouring pixels, same light)
+    // share most of their nodes, so a box test is paid once for the whole packet.
+    int occluded4(const Vec3f *o, const Vec3f *d, float tmin, float tmax, int active=15) const;
+    int nodes() const;
+    int triangles() const;
+    int depth() const;
+    double build_ms() const;
+private:
+    struct Node {
+        float bmin[3], bmax[3];
+        int start; // leaf: first triangle; interior: left child, the right one follows it
+        int count; // triangles of a leaf, 0 for an interior node
+    };
+    struct Triangle {
+        float v0[3], e1[3], e2[3]; // the Moller-Trumbore form: a vertex and the two edges leaving it
+    };
+    // fills node n with the triangles refs[begin, end), splitting it where the SAH cost is lowest
+    void build(std::vector<BVHBuildRef> &refs, int n, int begin, int end, int level);
+
+    int leaf_size_;
+    std::vector<Node> nodes_;
+    std::vector<Triangle> tris_;
+    int depth_;
+    double build_ms_;
+};
+
+// Shadow ray tracing from a camera depth buffer: each covered pixel is brought back to world space with
+// screen_to_world (the inverse of Viewport*Projection*ModelView) and tested against the light. One ray per
+// pixel gives hard shadows; with samples > 1 the directions spread over a cone of half angle light_size
+// (radians) and the mask holds the visible fraction. Rays start bias world units off the surface.
+// The mask is width*height, 1 for uncovered pixels; the result is the number of rays cast.
+struct ShadowRayParams {
+    ShadowRayParams();
+    int samples;
+    float light_size;
+    float bias;
+};
+unsigned long trace_shadow_mask(const BVH &bvh, const float *zbuffer, int width, int height, const Matrix &screen_to_world,
+                                Vec3f light_dir, const ShadowRayParams &params, std::vector<float> &mask);
+
+#endif //__BVH_H__
@@ -0,0 +1,130 @@
+#include <cmath>
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "framebuffer.h"
+
+GammaTable::GammaTable(float gamma) : gamma_(gamma), linear_() {
+    for (int i=0; i<256; i++) linear_[i] = std::pow(i/255.f, gamma);
+}
+
+float GammaTable::gamma() const {
+    return gamma_;
+}
+
+float GammaTable::decode(unsigned char v) const {
+    return linear_[v];
+}
+
+FloatImage::FloatImage(int w, int h) : width_(0), height_(0), stride_(0), data_() {
+    resize(w, h);
+}
+
+void FloatImage::resize(int w, int h) {
+    width_ = w;
+    height_ = h;
+    stride_ = (w+3)&~3;
+    data_.assign((size_t)stride_*height_*4, 0.f);
+}
+
+void FloatImage::clear() {
+    std::fill(data_.begin(), data_.end(), 0.f);
+}
+
+int FloatImage::width() const {
+    return width_;
+}
+
+int FloatImage::height() const {
+    return height_;
+}
+
+int FloatImage::stride() const {
+    return stride_;
+}
+
+float *FloatImage::row(int channel, int y) {
+    return &data_[((size_t)channel*height_ + y)*stride_];
+}
+
+const float *FloatImage::row(int channel, int y) const {
+    return &data_[((size_t)channel*height_ + y)*stride_];
+}
+
+void FloatImage::set(int x, int y, const Vec4f &c) {
+    if (x<0 || y<0 || x>=width_ || y>=height_) return;
+    const size_t plane = (size_t)stride_*height_, i = (size_t)y*stride_ + x;
+    for (int k=0; k<4; k++) data_[k*plane + i] = c[k];
+}
+
+void FloatImage::from_tga(TGAImage &img, const GammaTable &gamma) {
+    if (img.get_width()!=width_ || img.get_height()!=height_) // every pixel is written below, no need to clear
+        resize(img.get_width(), img.get_height());
+    const int bpp = img.get_bytespp();
+    const unsigned char *data = img.buffer();
+    if (!data) return;
+    float lut[256];
+    for (int i=0; i<256; i++) lut[i] = gamma.decode(i);
+#pragma omp parallel for
+    for (int y=0; y<height_; y++) {
+        float *r = row(R, y), *g = row(G, y), *b = row(B, y), *a = row(A, y);
+        const unsigned char *p = data + (size_t)y*width_*bpp;
+        for (int x=0; x<width_; x++, p+=bpp) {
+            if (bpp<3) {
+                r[x] = g[x] = b[x] = lut[p[0]];
+            } else { // BGR(A) order
+                b[x] = lut[p[0]];
+                g[x] = lut[p[1]];
+                r[x] = lut[p[2]];
+            }
+            a[x] = bpp==4 ? p[3]/255.f : 1.f;
+        }
+    }
+}
+
+// the encode table is indexed by sqrt(x), which spends its resolution near black where x^(1/gamma) is steep
+static const int encode_bins = 4096;
+
+void FloatImage::to_tga(TGAImage &img, float gamma) const {
+    if (img.get_width()!=width_ || img.get_height()!=height_ || img.get_bytespp()<3)
+        img = TGAImage(width_, height_, TGAImage::RGB);
+    unsigned char encode[encode_bins+1];
+    for (int i=0; i<=encode_bins; i++) {
+        float s = i/(float)encode_bins;
+        encode[i] = (unsigned char)(std::pow(s*s, 1.f/gamma)*255.f + .5f);
+    }
+    const int bpp = img.get_bytespp();
+    unsigned char *data = img.buffer();
+#pragma omp parallel for
+    for (int y=0; y<height_; y++) {
+        const float *src[4] = {row(B, y), row(G, y), row(R, y), row(A, y)};
+        unsigned char *p = data + (size_t)y*width_*bpp;
+        // encode a whole row per channel first, then interleave
+        std::vector<unsigned char> q(stride_*4);
+        for (int c=0; c<bpp; c++) {
+            unsigned char *dst = &q[c*stride_];
+            const bool linear = c==3; // alpha is stored linearly
+            int x = 0;
+#ifdef __SSE2__
+            const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.f), half = _mm_set1_ps(.5f);
+            const __m128 scale = _mm_set1_ps(linear ? 255.f : (float)encode_bins);
+            for (; x+4<=stride_; x+=4) {
+                // maxps returns its second operand when either one is NaN: NaN goes to 0 like in the scalar path
+                __m128 f = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(src[c]+x), zero), one);
+                if (!linear) f = _mm_sqrt_ps(f);
+                int idx[4];
+                _mm_storeu_si128((__m128i *)idx, _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(f, scale), half)));
+                for (int k=0; k<4; k++)
+                    dst[x+k] = linear ? (unsigned char)idx[k] : encode[idx[k]];
+            }
+#endif
+            for (; x<width_; x++) {
+                float f = std::min(1.f, std::max(0.f, src[c][x]));
+                dst[x] = linear ? (unsigned char)(f*255.f + .5f) : encode[(int)(std::sqrt(f)*encode_bins + .5f)];
+            }
+        }
+        for (int x=0; x<width_; x++, p+=bpp)
+            for (int c=0; c<bpp; c++) p[c] = q[c*stride_+x];
+    }
+}
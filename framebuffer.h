@@ -0,0 +1,46 @@
+#ifndef __FRAMEBUFFER_H__
+#define __FRAMEBUFFER_H__
+#include <vector>
+#include "tgaimage.h"
+#include "geometry.h"
+
+// 8-bit gamma encoded values to linear, through a lookup table. The inverse of FloatImage::to_tga with the
+// same gamma: everything that enters the float framebuffer from an 8-bit color (textures, shader output,
+// translucent fragments) is decoded with the gamma the frame is encoded with in the end.
+class GammaTable {
+public:
+    explicit GammaTable(float gamma=2.2f);
+    float gamma() const;
+    float decode(unsigned char v) const;
+private:
+    float gamma_;
+    float linear_[256];
+};
+
+// Linear floating point RGBA image, values are not clamped (HDR). Each channel is a separate plane and rows
+// are padded to a multiple of 4 floats, so that filters process 4 pixels per SSE instruction without a scalar tail.
+class FloatImage {
+public:
+    enum Channel {
+        R, G, B, A
+    };
+
+    FloatImage(int w=0, int h=0);
+    void resize(int w, int h); // contents are cleared to zero
+    void clear();
+    int width() const;
+    int height() const;
+    int stride() const;
+    float *row(int channel, int y);
+    const float *row(int channel, int y) const;
+    void set(int x, int y, const Vec4f &c);
+    // 8-bit gamma encoded pixels to linear values
+    void from_tga(TGAImage &img, const GammaTable &gamma);
+    // the single encode step of a frame: clamps to [0,1], applies x^(1/gamma) and quantizes to 8 bits
+    void to_tga(TGAImage &img, float gamma=2.2f) const;
+private:
+    int width_, height_, stride_;
+    std::vector<float> data_;
+};
+
+#endif //__FRAMEBUFFER_H__
@@ -0,0 +1,68 @@
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <algorithm>
+#include "framediff.h"
+
+DiffTolerance::DiffTolerance() : color(2), depth(1.f), max_bad_percent(.1f) {
+}
+
+DiffResult::DiffResult() : pixels(0), color_differ(0), color_over(0), depth_over(0), coverage_differ(0), max_color(0),
+    mean_color(0.), max_depth(0.f), psnr(std::numeric_limits<double>::infinity()) {
+}
+
+bool DiffResult::passed(const DiffTolerance &tol) const {
+    const long bad = color_over + depth_over + coverage_differ;
+    return pixels && bad*100. <= tol.max_bad_percent*pixels;
+}
+
+void DiffResult::report(std::ostream &out, const DiffTolerance &tol) const {
+    out << (passed(tol) ? "PASS" : "FAIL") << ": " << color_differ << " pixels differ (max " << max_color << ", mean " << mean_color
+        << ", psnr " << psnr << " dB), " << color_over << " over color tolerance " << tol.color << ", " << depth_over
+        << " over depth tolerance " << tol.depth << " (max " << max_depth << "), " << coverage_differ << " coverage mismatches";
+}
+
+DiffResult compare_frames(TGAImage &ref, const float *ref_depth, TGAImage &test, const float *test_depth,
+                          const DiffTolerance &tol, TGAImage *diff) {
+    DiffResult r;
+    const int w = ref.get_width(), h = ref.get_height();
+    if (w!=test.get_width() || h!=test.get_height()) return r;
+    const float empty = -std::numeric_limits<float>::max();
+    double sum = 0., sum_sq = 0.;
+    for (int y=0; y<h; y++) {
+        for (int x=0; x<w; x++) {
+            const TGAColor a = ref.get(x, y), b = test.get(x, y);
+            const float za = ref_depth[x+y*w], zb = test_depth[x+y*w];
+            int d = 0;
+            for (int c=0; c<3; c++) {
+                const int dc = std::abs(a.bgra[c]-b.bgra[c]);
+                d = std::max(d, dc);
+                sum += dc;
+                sum_sq += dc*dc;
+            }
+            const bool coverage = (za==empty)!=(zb==empty);
+            const float dz = coverage || za==empty ? 0.f : std::abs(za-zb);
+            r.max_color = std::max(r.max_color, d);
+            r.max_depth = std::max(r.max_depth, dz);
+            if (d) r.color_differ++;
+            if (coverage) r.coverage_differ++;
+            else if (d>tol.color) r.color_over++;
+            else if (dz>tol.depth) r.depth_over++;
+            if (!diff) continue;
+            const unsigned char grey = (a.bgra[0]+a.bgra[1]+a.bgra[2])/12;
+            TGAColor out(grey, grey, grey);
+            if (coverage) out = TGAColor(255, 0, 255);
+            else if (d>tol.color) out = TGAColor(255, 0, 0);
+            else if (dz>tol.depth) out = TGAColor(0, 64, 255);
+            else if (d) {
+                const unsigned char v = 128 + 127*d/std::max(1, tol.color);
+                out = TGAColor(v, v, 0);
+            }
+            diff->set(x, y, out);
+        }
+    }
+    r.pixels = (long)w*h;
+    r.mean_color = sum/(3.*r.pixels);
+    if (sum_sq>0.) r.psnr = 10.*std::log10(255.*255./(sum_sq/(3.*r.pixels)));
+    return r;
+}
@@ -0,0 +1,37 @@
+#ifndef __FRAMEDIFF_H__
+#define __FRAMEDIFF_H__
+#include <ostream>
+#include "tgaimage.h"
+
+// how far a fast path may drift from the reference before a frame fails
+struct DiffTolerance {
+    DiffTolerance();
+    int color;             // largest accepted per-channel difference (0..255)
+    float depth;           // largest accepted depth difference, in depth buffer units
+    float max_bad_percent; // share of the pixels allowed outside the tolerances (edge pixels flip coverage on rounding)
+};
+
+struct DiffResult {
+    DiffResult();
+    bool passed(const DiffTolerance &tol) const;
+    void report(std::ostream &out, const DiffTolerance &tol) const;
+
+    long pixels;
+    long color_differ;     // any channel differs at all
+    long color_over;       // some channel differs by more than the tolerance
+    long depth_over;       // both covered, depth differs by more than the tolerance
+    long coverage_differ;  // covered in one buffer only
+    int max_color;
+    double mean_color;     // mean absolute channel difference over all pixels
+    float max_depth;
+    double psnr;           // dB, infinite for identical images
+};
+
+// Compares a test framebuffer and depth buffer against the reference ones (same size, depth cleared to
+// -FLT_MAX). When diff is not NULL it receives a visualization: the reference dimmed to grey, differences
+// within tolerance in yellow (brighter when larger), color failures in red, depth failures in blue and
+// coverage mismatches in magenta.
+DiffResult compare_frames(TGAImage &ref, const float *ref_depth, TGAImage &test, const float *test_depth,
+                          const DiffTolerance &tol, TGAImage *diff);
+
+#endif //__FRAMEDIFF_H__
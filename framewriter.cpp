@@ -0,0 +1,119 @@
+#include <iostream>
+#include "framewriter.h"
+#include "timer.h"
+#include "stats.h"
+
+FrameWriter::FrameWriter(int nthreads, int capacity) : queue_(), threads_(), mutex_(), not_empty_(), not_full_(),
+    capacity_(capacity>0 ? capacity : 1), done_(false), failures_(0), stalls_(0), stall_time_(0) {
+    pthread_mutex_init(&mutex_, NULL);
+    pthread_cond_init(&not_empty_, NULL);
+    pthread_cond_init(&not_full_, NULL);
+    for (int i=0; i<(nthreads>0 ? nthreads : 1); i++) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, run, this)) {
+            std::cerr << "can't start frame writer thread\n";
+            break;
+        }
+        threads_.push_back(t);
+    }
+}
+
+FrameWriter::~FrameWriter() {
+    finish();
+    pthread_cond_destroy(&not_full_);
+    pthread_cond_destroy(&not_empty_);
+    pthread_mutex_destroy(&mutex_);
+}
+
+FrameWriter::Job::Job(TGAImage *img, const std::string &name, TGAImage::FileFormat f, VideoStream *s, bool flip) : image(img),
+    filename(name), fmt(f), stream(s), vflip(flip) {}
+
+FrameWriter::Job::Job(const Job &other) : image(other.image), filename(other.filename), fmt(other.fmt), stream(other.stream),
+    vflip(other.vflip) {}
+
+FrameWriter::Job &FrameWriter::Job::operator=(const Job &other) {
+    image = other.image;
+    filename = other.filename;
+    fmt = other.fmt;
+    stream = other.stream;
+    vflip = other.vflip;
+    return *this;
+}
+
+bool FrameWriter::Job::write() {
+    double t0 = wall_time();
+    bool ok = stream ? stream->write_frame(*image, vflip) : image->write_file(filename.c_str(), fmt, vflip);
+    pass_timer_record("write", -1, t0, wall_time());
+    delete image;
+    return ok;
+}
+
+void FrameWriter::submit(TGAImage *image, const std::string &filename, TGAImage::FileFormat fmt, bool vflip) {
+    push(Job(image, filename, fmt, NULL, vflip));
+}
+
+void FrameWriter::submit(TGAImage *image, VideoStream *stream, bool vflip) {
+    push(Job(image, std::string(), TGAImage::TGA, stream, vflip));
+}
+
+void FrameWriter::push(const Job &job) {
+    if (threads_.empty()) { // no worker could be started, write synchronously
+        Job j = job;
+        if (!j.write()) failures_++;
+        return;
+    }
+    pthread_mutex_lock(&mutex_);
+    if (queue_.size()>=capacity_) {
+        double t0 = wall_time();
+        stalls_++;
+        while (queue_.size()>=capacity_)
+            pthread_cond_wait(&not_full_, &mutex_);
+        stall_time_ += wall_time()-t0;
+    }
+    queue_.push_back(job);
+    pthread_cond_signal(&not_empty_);
+    pthread_mutex_unlock(&mutex_);
+}
+
+void *FrameWriter::run(void *arg) {
+    FrameWriter *w = (FrameWriter *)arg;
+    for (;;) {
+        pthread_mutex_lock(&w->mutex_);
+        while (w->queue_.empty() && !w->done_)
+            pthread_cond_wait(&w->not_empty_, &w->mutex_);
+        if (w->queue_.empty()) { // done_ and drained
+            pthread_mutex_unlock(&w->mutex_);
+            return NULL;
+        }
+        Job job = w->queue_.front();
+        w->queue_.pop_front();
+        pthread_cond_signal(&w->not_full_);
+        pthread_mutex_unlock(&w->mutex_);
+
+        if (!job.write()) {
+            pthread_mutex_lock(&w->mutex_);
+            w->failures_++;
+            pthread_mutex_unlock(&w->mutex_);
+        }
+    }
+}
+
+void FrameWriter::finish() {
+    if (threads_.empty()) return;
+    pthread_mutex_lock(&mutex_);
+    done_ = true;
+    pthread_cond_broadcast(&not_empty_);
+    pthread_mutex_unlock(&mutex_);
+    for (size_t i=0; i<threads_.size(); i++)
+        pthread_join(threads_[i], NULL);
+    threads_.clear();
+    if (stalls_)
+        std::cerr << "frame writer: renderer blocked " << stalls_ << " times, " << stall_time_*1000. << " ms total" << std::endl;
+}
+
+int FrameWriter::failures() {
+    pthread_mutex_lock(&mutex_);
+    int n = failures_;
+    pthread_mutex_unlock(&mutex_);
+    return n;
+}
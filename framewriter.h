@@ -0,0 +1,57 @@
+#ifndef __FRAMEWRITER_H__
+#define __FRAMEWRITER_H__
+#include <deque>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include "tgaimage.h"
+#include "videostream.h"
+
+// Encodes and writes finished frames on background threads so that the renderer can start
+// the next frame right away. The queue is bounded: submit() blocks while it is full, which
+// keeps memory in check when the disk cannot keep up with the renderer.
+class FrameWriter {
+public:
+    FrameWriter(int nthreads=2, int capacity=4);
+    ~FrameWriter();
+    // takes ownership of the image, it is deleted once written
+    void submit(TGAImage *image, const std::string &filename, TGAImage::FileFormat fmt, bool vflip=false);
+    // appends the frame to a video stream; frames reach the stream in submission order only with a single thread
+    void submit(TGAImage *image, VideoStream *stream, bool vflip=false);
+    // waits until every submitted frame is on disk
+    void finish();
+    int failures();
+private:
+    FrameWriter(const FrameWriter &);
+    FrameWriter &operator=(const FrameWriter &);
+
+    // A queued write. Copies share the pointers: the image belongs to the job, and write() deletes it
+    // on the writer thread that takes the job off the queue; the stream is only borrowed.
+    struct Job {
+        Job(TGAImage *img, const std::string &name, TGAImage::FileFormat f, VideoStream *s, bool flip);
+        Job(const Job &other);
+        Job &operator=(const Job &other);
+        bool write();
+        TGAImage *image;
+        std::string filename;
+        TGAImage::FileFormat fmt;
+        VideoStream *stream;
+        bool vflip;
+    };
+
+    void push(const Job &job);
+    static void *run(void *arg);
+
+    std::deque<Job> queue_;
+    std::vector<pthread_t> threads_;
+    pthread_mutex_t mutex_;
+    pthread_cond_t not_empty_;
+    pthread_cond_t not_full_;
+    size_t capacity_;
+    bool done_;
+    int failures_;
+    int stalls_;       // number of submit() calls that had to wait for a free slot
+    double stall_time_; // seconds the renderer spent blocked in submit()
+};
+
+#endif //__FRAMEWRITER_H__
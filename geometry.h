@@ -4,6 +4,9 @@
 #include <vector>
 #include <cassert>
 #include <iostream>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 template<size_t DimCols,size_t DimRows,typename T> class mat;
 
@@ -43,6 +46,33 @@ template <typename T> struct vec<3,T> {
 
 /////////////////////////////////////////////////////////////////////////////////
 
+// Same interface as the generic vec, kept in one 16-byte aligned SSE register so that the
+// operators and the 4x4 matrix kernels below load and store it directly.
+template <> struct vec<4,float> {
+#ifdef __SSE2__
+    vec() : m_(_mm_setzero_ps()) {}
+    vec(float X, float Y, float Z, float W) : m_(_mm_setr_ps(X, Y, Z, W)) {}
+    explicit vec(__m128 m) : m_(m) {}
+    __m128 m128() const { return m_; }
+#else
+    vec() : data_() {}
+    vec(float X, float Y, float Z, float W) : data_() { data_[0] = X; data_[1] = Y; data_[2] = Z; data_[3] = W; }
+#endif
+          float& operator[](const size_t i)       { assert(i<4); return data_[i]; }
+    const float& operator[](const size_t i) const { assert(i<4); return data_[i]; }
+private:
+#ifdef __SSE2__
+    union {
+        __m128 m_;
+        float data_[4];
+    };
+#else
+    float data_[4];
+#endif
+};
+
+/////////////////////////////////////////////////////////////////////////////////
+
 template<size_t DIM,typename T> T operator*(const vec<DIM,T>& lhs, const vec<DIM,T>& rhs) {
     T ret = T();
     for (size_t i=DIM; i--; ret+=lhs[i]*rhs[i]);
@@ -95,6 +125,39 @@ template <size_t DIM, typename T> std::ostream& operator<<(std::ostream& out, ve
 
 /////////////////////////////////////////////////////////////////////////////////
 
+// Float overloads, picked over the templates above. They perform the very same operations in the very
+// same order as the generic loops (dot products accumulate from the last component down), so results
+// are bit-identical; they only drop the loops, the branchy operator[] of vec<3> and, for vec<4>, the
+// scalar code. Scalars of other types (double, int) still go through the templates.
+
+inline float operator*(const vec<3,float>& lhs, const vec<3,float>& rhs) {
+    return lhs.z*rhs.z + lhs.y*rhs.y + lhs.x*rhs.x;
+}
+
+inline float operator*(const vec<4,float>& lhs, const vec<4,float>& rhs) {
+    return lhs[3]*rhs[3] + lhs[2]*rhs[2] + lhs[1]*rhs[1] + lhs[0]*rhs[0];
+}
+
+#ifdef __SSE2__
+inline vec<4,float> operator+(vec<4,float> lhs, const vec<4,float>& rhs) {
+    return vec<4,float>(_mm_add_ps(lhs.m128(), rhs.m128()));
+}
+
+inline vec<4,float> operator-(vec<4,float> lhs, const vec<4,float>& rhs) {
+    return vec<4,float>(_mm_sub_ps(lhs.m128(), rhs.m128()));
+}
+
+inline vec<4,float> operator*(vec<4,float> lhs, const float& rhs) {
+    return vec<4,float>(_mm_mul_ps(lhs.m128(), _mm_set1_ps(rhs)));
+}
+
+inline vec<4,float> operator/(vec<4,float> lhs, const float& rhs) {
+    return vec<4,float>(_mm_div_ps(lhs.m128(), _mm_set1_ps(rhs)));
+}
+#endif
+
+/////////////////////////////////////////////////////////////////////////////////
+
 template<size_t DIM,typename T> struct dt {
     static T det(const mat<DIM,DIM,T>& src) {
         T ret=0;
@@ -211,6 +274,119 @@ template <size_t DimRows,size_t DimCols,class T> std::ostream& operator<<(std::o
 
 /////////////////////////////////////////////////////////////////////////////////
 
+// Closed forms of the 3x3 and 4x4 float cofactor expansions. dt<> and cofactor() recurse through
+// temporary minors; these flatten the expansion but keep its products and sums in the same order,
+// so inverses and determinants match the generic ones bit for bit.
+
+// | a b |
+// | c d |
+inline float det2(float a, float b, float c, float d) {
+    return a*d - b*c;
+}
+
+// Every 3x3 minor expands along its first row onto 2x2 determinants of its two other rows. Those are
+// always rows (2,3), (1,3) or (1,2) of the 4x4 matrix, so the 6 column pairs of these 3 row pairs cover
+// all 16 cofactors: 18 determinants instead of 48.
+struct Cofactors4 {
+    Cofactors4(const mat<4,4,float>& m) : m_(m) {
+        static const size_t r1[3] = {2, 1, 1}, r2[3] = {3, 3, 2};
+        static const size_t ca[6] = {0, 0, 0, 1, 1, 2}, cb[6] = {1, 2, 3, 2, 3, 3};
+        for (size_t p=0; p<3; p++)
+            for (size_t c=0; c<6; c++)
+                s_[p][c] = det2(m[r1[p]][ca[c]], m[r1[p]][cb[c]], m[r2[p]][ca[c]], m[r2[p]][cb[c]]);
+    }
+    // determinant of the minor without row i and column j, signed
+    float operator()(size_t i, size_t j) const {
+        static const size_t row_pair[4] = {0, 0, 1, 2}, first_row[4] = {1, 0, 0, 0};
+        static const size_t cols[4][3] = {{1, 2, 3}, {0, 2, 3}, {0, 1, 3}, {0, 1, 2}};
+        static const size_t pair[4][4] = {{0, 0, 1, 2}, {0, 0, 3, 4}, {1, 3, 0, 5}, {2, 4, 5, 0}};
+        const vec<4,float> &r0 = m_[first_row[i]];
+        const size_t *c = cols[j];
+        const float *s = s_[row_pair[i]];
+        const float d = (r0[c[2]]*s[pair[c[0]][c[1]]] - r0[c[1]]*s[pair[c[0]][c[2]]]) + r0[c[0]]*s[pair[c[1]][c[2]]];
+        return (i+j)%2 ? -d : d;
+    }
+private:
+    const mat<4,4,float>& m_;
+    float s_[3][6];
+};
+
+template<> inline mat<4,4,float> mat<4,4,float>::adjugate() const {
+    const Cofactors4 cof(*this);
+    mat<4,4,float> ret;
+    for (size_t i=4; i--; )
+        for (size_t j=4; j--; ret[i][j]=cof(i,j));
+    return ret;
+}
+
+template<> inline float mat<4,4,float>::det() const {
+    const Cofactors4 cof(*this);
+    return ((rows[0][3]*cof(0,3) + rows[0][2]*cof(0,2)) + rows[0][1]*cof(0,1)) + rows[0][0]*cof(0,0);
+}
+
+template<> inline mat<3,3,float> mat<3,3,float>::adjugate() const {
+    mat<3,3,float> ret;
+    for (size_t i=3; i--; )
+        for (size_t j=3; j--; ) {
+            const size_t r0 = i==0 ? 1 : 0, r1 = i==2 ? 1 : 2;
+            const size_t c0 = j==0 ? 1 : 0, c1 = j==2 ? 1 : 2;
+            const float d = det2(rows[r0][c0], rows[r0][c1], rows[r1][c0], rows[r1][c1]);
+            ret[i][j] = (i+j)%2 ? -d : d;
+        }
+    return ret;
+}
+
+template<> inline float mat<3,3,float>::det() const {
+    const vec<3,float> &r1 = rows[1], &r2 = rows[2];
+    return (rows[0].z*det2(r1.x, r1.y, r2.x, r2.y) - rows[0].y*det2(r1.x, r1.z, r2.x, r2.z)) + rows[0].x*det2(r1.y, r1.z, r2.y, r2.z);
+}
+
+inline vec<3,float> operator*(const mat<3,3,float>& lhs, const vec<3,float>& rhs) {
+    return vec<3,float>(lhs[0]*rhs, lhs[1]*rhs, lhs[2]*rhs);
+}
+
+#ifdef __SSE2__
+// 4x4 kernels: every output lane accumulates the same products in the same order as the generic dot
+// products (last component first), so they are bit-identical to the templates they replace.
+
+template<> inline mat<4,4,float> mat<4,4,float>::transpose() {
+    __m128 r0 = rows[0].m128(), r1 = rows[1].m128(), r2 = rows[2].m128(), r3 = rows[3].m128();
+    _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+    mat<4,4,float> ret;
+    ret[0] = vec<4,float>(r0);
+    ret[1] = vec<4,float>(r1);
+    ret[2] = vec<4,float>(r2);
+    ret[3] = vec<4,float>(r3);
+    return ret;
+}
+
+// the columns scaled by the vector components, summed
+inline vec<4,float> operator*(const mat<4,4,float>& lhs, const vec<4,float>& rhs) {
+    __m128 c0 = lhs[0].m128(), c1 = lhs[1].m128(), c2 = lhs[2].m128(), c3 = lhs[3].m128();
+    _MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+    __m128 acc = _mm_mul_ps(c3, _mm_set1_ps(rhs[3]));
+    acc = _mm_add_ps(acc, _mm_mul_ps(c2, _mm_set1_ps(rhs[2])));
+    acc = _mm_add_ps(acc, _mm_mul_ps(c1, _mm_set1_ps(rhs[1])));
+    acc = _mm_add_ps(acc, _mm_mul_ps(c0, _mm_set1_ps(rhs[0])));
+    return vec<4,float>(acc);
+}
+
+// each row of the result is the rows of rhs scaled by the entries of the row of lhs, summed
+inline mat<4,4,float> operator*(const mat<4,4,float>& lhs, const mat<4,4,float>& rhs) {
+    mat<4,4,float> result;
+    for (size_t i=4; i--; ) {
+        __m128 acc = _mm_mul_ps(_mm_set1_ps(lhs[i][3]), rhs[3].m128());
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(lhs[i][2]), rhs[2].m128()));
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(lhs[i][1]), rhs[1].m128()));
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(lhs[i][0]), rhs[0].m128()));
+        result[i] = vec<4,float>(acc);
+    }
+    return result;
+}
+#endif
+
+/////////////////////////////////////////////////////////////////////////////////
+
 typedef vec<2,  float> Vec2f;
 typedef vec<2,  int>   Vec2i;
 typedef vec<3,  float> Vec3f;
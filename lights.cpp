@@ -0,0 +1,114 @@
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+#include "lights.h"
+
+Vec3f Light::illuminate(Vec3f p, Vec3f n) const {
+    if (type==DIRECTIONAL)
+        return color*std::max(0.f, n*direction);
+    Vec3f l = position-p;
+    float d = l.norm();
+    if (d>=range || d<1e-6f) return Vec3f(0, 0, 0);
+    l = l/d;
+    float ndotl = n*l;
+    if (ndotl<=0.f) return Vec3f(0, 0, 0);
+    float x = d/range;
+    float window = (1.f-x*x)*(1.f-x*x); // goes smoothly to zero at the range, so that culling is exact
+    float atten = window/(1.f+4.f*x*x);
+    if (type==SPOT) {
+        float c = (l*-1.f)*direction;
+        if (c<=cos_outer) return Vec3f(0, 0, 0);
+        atten *= std::min(1.f, (c-cos_outer)/(cos_inner-cos_outer));
+    }
+    return color*(ndotl*atten);
+}
+
+std::vector<Light> make_light_rig(int n, float radius) {
+    std::vector<Light> lights;
+    unsigned int seed = 12345;
+    for (int i=0; i<n; i++) {
+        float r[6];
+        for (int k=0; k<6; k++) {
+            seed = seed*1103515245u + 12345u;
+            r[k] = ((seed>>8)&0xffff)/65535.f;
+        }
+        Light light;
+        // Fibonacci sphere for an even spread, randomized radius and color
+        float y = 1.f-2.f*(i+.5f)/n;
+        float ring = std::sqrt(std::max(0.f, 1.f-y*y));
+        float phi = i*2.39996323f;
+        light.position = Vec3f(ring*std::cos(phi), y, ring*std::sin(phi))*(radius*(.9f+.2f*r[0]));
+        light.color = Vec3f(.3f+.7f*r[1], .3f+.7f*r[2], .3f+.7f*r[3])*(1.5f+r[4]);
+        light.range = .3f+.3f*r[5];
+        if (i%4==3) {
+            light.type = Light::SPOT;
+            light.direction = (light.position*-1.f).normalize();
+            light.range *= 1.5f;
+        }
+        lights.push_back(light);
+    }
+    return lights;
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+
+LightGrid::LightGrid(int tile_size) : tile_size_(tile_size), ntx_(0), nty_(0), offsets_(), indices_() {}
+
+int LightGrid::tile_size() {
+    return tile_size_;
+}
+
+void LightGrid::build(const std::vector<Light> &lights, const Matrix &M, int width, int height) {
+    ntx_ = (width+tile_size_-1)/tile_size_;
+    nty_ = (height+tile_size_-1)/tile_size_;
+    std::vector<std::vector<int> > bins(ntx_*nty_);
+    for (int i=0; i<(int)lights.size(); i++) {
+        const Light &L = lights[i];
+        int x0 = 0, y0 = 0, x1 = ntx_-1, y1 = nty_-1;
+        if (L.type!=Light::DIRECTIONAL) {
+            // screen bounding box of the corners of the box around the sphere of influence
+            float xmin = 1e30f, ymin = 1e30f, xmax = -1e30f, ymax = -1e30f;
+            bool behind = false;
+            for (int c=0; c<8; c++) {
+                Vec3f corner = L.position + Vec3f(c&1 ? L.range : -L.range, c&2 ? L.range : -L.range, c&4 ? L.range : -L.range);
+                Vec4f s = M*embed<4>(corner);
+                if (s[3]<=1e-6f) { behind = true; break; }
+                xmin = std::min(xmin, s[0]/s[3]); xmax = std::max(xmax, s[0]/s[3]);
+                ymin = std::min(ymin, s[1]/s[3]); ymax = std::max(ymax, s[1]/s[3]);
+            }
+            if (!behind) {
+                if (xmax<0 || ymax<0 || xmin>=width || ymin>=height) continue;
+                x0 = std::max(0, (int)xmin/tile_size_); x1 = std::min(ntx_-1, (int)xmax/tile_size_);
+                y0 = std::max(0, (int)ymin/tile_size_); y1 = std::min(nty_-1, (int)ymax/tile_size_);
+            }
+        }
+        for (int ty=y0; ty<=y1; ty++)
+            for (int tx=x0; tx<=x1; tx++)
+                bins[tx+ty*ntx_].push_back(i);
+    }
+    // flatten the bins so that a lookup touches one contiguous range
+    offsets_.assign(ntx_*nty_+1, 0);
+    indices_.clear();
+    for (int t=0; t<ntx_*nty_; t++) {
+        indices_.insert(indices_.end(), bins[t].begin(), bins[t].end());
+        offsets_[t+1] = (int)indices_.size();
+    }
+}
+
+const int *LightGrid::lights_at(int x, int y, int &count) const {
+    int tx = std::max(0, std::min(ntx_-1, x/tile_size_));
+    int ty = std::max(0, std::min(nty_-1, y/tile_size_));
+    int t = tx+ty*ntx_;
+    count = offsets_[t+1]-offsets_[t];
+    return count ? &indices_[offsets_[t]] : NULL;
+}
+
+float LightGrid::average_per_tile() {
+    return ntx_*nty_ > 0 ? indices_.size()/(float)(ntx_*nty_) : 0.f;
+}
+
+int LightGrid::max_per_tile() {
+    int m = 0;
+    for (int t=0; t+1<(int)offsets_.size(); t++) m = std::max(m, offsets_[t+1]-offsets_[t]);
+    return m;
+}
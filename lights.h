@@ -0,0 +1,47 @@
+#ifndef __LIGHTS_H__
+#define __LIGHTS_H__
+#include <vector>
+#include "geometry.h"
+
+struct Light {
+    enum Type {
+        DIRECTIONAL, POINT, SPOT
+    };
+
+    Light() : type(POINT), position(), direction(0, 0, -1), color(1, 1, 1), range(1.f), cos_inner(.9f), cos_outer(.8f) {}
+
+    Type type;
+    Vec3f position;  // point and spot lights
+    Vec3f direction; // directional: towards the light; spot: the axis the cone points along
+    Vec3f color;     // linear intensity per channel
+    float range;     // point and spot lights have no influence beyond this distance
+    float cos_inner; // spot cone: full intensity inside the inner angle,
+    float cos_outer; //            fading to zero at the outer one
+
+    // irradiance reaching surface point p with unit normal n, in world space
+    Vec3f illuminate(Vec3f p, Vec3f n) const;
+};
+
+// a deterministic set of n colored point and spot lights scattered around the origin, for stress tests
+std::vector<Light> make_light_rig(int n, float radius=1.1f);
+
+// Screen split in square tiles, each with the list of lights whose volume of influence overlaps it,
+// so that a fragment only loops over the lights of its own tile.
+class LightGrid {
+public:
+    LightGrid(int tile_size=16);
+    // M maps world space to screen space (Viewport*Projection*ModelView)
+    void build(const std::vector<Light> &lights, const Matrix &M, int width, int height);
+    // lights of the tile containing pixel (x,y)
+    const int *lights_at(int x, int y, int &count) const;
+    int tile_size();
+    float average_per_tile();
+    int max_per_tile();
+private:
+    int tile_size_;
+    int ntx_, nty_;
+    std::vector<int> offsets_; // ntx*nty+1 offsets into indices_
+    std::vector<int> indices_;
+};
+
+#endif //__LIGHTS_H__
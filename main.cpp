@@ -1,420 +1,283 @@
 #include <vector>
 #include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <algorithm>
+#include <map>
+#include <pthread.h>
 
 #include "tgaimage.h"
-#include "model.h"
-#include "geometry.h"
-#include "our_gl.h"
-
-Model *model = NULL;
-float *shadowbuffer = NULL;
-
-const int width = 800;
-const int height = 800;
-
-Vec3f light_dir(1, 1, 1);
-Vec3f eye(1, 1, 4);
-Vec3f center(0, 0, 0);
-Vec3f up(0, 1, 0);
-
-struct GouraudShader : public IShader
+#include "timer.h"
+#include "stats.h"
+#include "framewriter.h"
+#include "videostream.h"
+#include "renderer.h"
+#include "server.h"
+
+// 对比各输出格式的编码耗时与文件大小（以write_tga_file为基准）
+void benchmark_formats(TGAImage &image)
 {
-    mat<3, 3, float> varying_tri; // 变换后的顶点坐标
-    Vec3f varying_intensity;      // 顶点着色器写入，片段着色器读取
-
-    // iface为面的序号，nthvert为顶点序号
-    virtual Vec4f vertex(int iface, int nthvert)
-    {
-        // 从.obj文件读取顶点坐标，并转换到裁剪空间
-        Vec4f gl_Vertex = embed<4>(model->vert(iface, nthvert));
-        gl_Vertex = Viewport * Projection * ModelView * gl_Vertex;
-        varying_tri.set_col(nthvert, proj<3>(gl_Vertex / gl_Vertex[3]));
-        // 计算光照强度
-        varying_intensity[nthvert] = std::max(0.f, model->normal(iface, nthvert) * light_dir);
-        return gl_Vertex;
-    }
-
-    // bar为三角形重心坐标
-    virtual bool fragment(Vec3f bar, TGAColor &color)
+    const int reps = 10;
+    const TGAImage::FileFormat formats[] = {TGAImage::TGA, TGAImage::QOI, TGAImage::PPM, TGAImage::PAM};
+    for (int f = 0; f < 4; f++)
     {
-        // 为当前像素计算强度插值，并着色
-        float intensity = varying_intensity * bar;
-        color = TGAColor(255, 255, 255) * intensity;
-        return false;
+        char filename[40];
+        sprintf(filename, "bench.%s", TGAImage::extension(formats[f]));
+        double t0 = wall_time();
+        for (int r = 0; r < reps; r++)
+            image.write_file(filename, formats[f], true);
+        double ms = (wall_time() - t0) * 1000. / reps;
+        std::ifstream in(filename, std::ios::binary | std::ios::ate);
+        long size = in.is_open() ? (long)in.tellg() : -1;
+        in.close();
+        std::remove(filename);
+        std::cerr << "format " << TGAImage::extension(formats[f]) << ": " << ms << " ms/frame, " << size << " bytes" << std::endl;
     }
-};
+}
 
-struct StylizedGouraudShader : public IShader
+int main(int argc, char **argv)
 {
-    mat<3, 3, float> varying_tri; // 变换后的顶点坐标
-    Vec3f varying_intensity;      // 顶点着色器写入，片段着色器读取
-
-    // iface为面的序号，nthvert为顶点序号
-    virtual Vec4f vertex(int iface, int nthvert)
-    {
-        // 从.obj文件读取顶点坐标，并转换到裁剪空间
-        Vec4f gl_Vertex = embed<4>(model->vert(iface, nthvert));
-        gl_Vertex = Viewport * Projection * ModelView * gl_Vertex;
-        varying_tri.set_col(nthvert, proj<3>(gl_Vertex / gl_Vertex[3]));
-        // 计算光照强度
-        varying_intensity[nthvert] = std::max(0.f, model->normal(iface, nthvert) * light_dir);
-        return gl_Vertex;
-    }
-
-    // bar为三角形重心坐标
-    virtual bool fragment(Vec3f bar, TGAColor &color)
+    TGAImage::FileFormat format = TGAImage::TGA;
+    int nframes = 50;
+    int parallel_frames = 1;
+    bool bench_formats = false;
+    int writer_threads = 2;
+    int writer_queue = 4;
+    const char *video_path = NULL;
+    VideoStream::Format video_format = VideoStream::Y4M420;
+    int fps = 25;
+    const char *trace_path = NULL;
+    const char *serve_path = NULL;
+    ServerSettings server_settings;
+    RenderSettings settings;
+    std::vector<const char *> models;
+    for (int i = 1; i < argc; i++)
     {
-        // 为当前像素计算强度插值，并着色
-        float intensity = varying_intensity * bar;
-        if (intensity > .85)
-            intensity = 1;
-        else if (intensity > .60)
-            intensity = .80;
-        else if (intensity > .45)
-            intensity = .60;
-        else if (intensity > .30)
-            intensity = .45;
-        else if (intensity > .15)
-            intensity = .30;
+        bool ok = true;
+        if (parse_render_option(settings, argc, argv, i, ok))
+        {
+            if (!ok)
+                return 1;
+        }
+        else if (!strcmp(argv[i], "--format") && i + 1 < argc)
+        {
+            if (!TGAImage::parse_format(argv[++i], format))
+            {
+                std::cerr << "unknown output format " << argv[i] << " (expected tga, qoi, ppm or pam)" << std::endl;
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "--frames") && i + 1 < argc)
+            nframes = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--parallel-frames") && i + 1 < argc)
+            parallel_frames = std::max(1, atoi(argv[++i]));
+        else if (!strcmp(argv[i], "--writer-threads") && i + 1 < argc)
+            writer_threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--writer-queue") && i + 1 < argc)
+            writer_queue = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--video") && i + 1 < argc)
+            video_path = argv[++i];
+        else if (!strcmp(argv[i], "--video-format") && i + 1 < argc)
+        {
+            if (!VideoStream::parse_format(argv[++i], video_format))
+            {
+                std::cerr << "unknown video format " << argv[i] << " (expected y4m, y4m420, y4m444 or rgb)" << std::endl;
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "--fps") && i + 1 < argc)
+            fps = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--trace") && i + 1 < argc)
+            trace_path = argv[++i];
+        else if (!strcmp(argv[i], "--bench-formats"))
+            bench_formats = true;
+        else if (!strcmp(argv[i], "--serve") && i + 1 < argc)
+            serve_path = argv[++i];
+        else if (!strcmp(argv[i], "--serve-threads") && i + 1 < argc)
+            server_settings.threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--serve-queue") && i + 1 < argc)
+            server_settings.queue = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--serve-renderers") && i + 1 < argc)
+            server_settings.renderers = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--serve-models") && i + 1 < argc)
+            server_settings.models = atoi(argv[++i]);
         else
-            intensity = 0;
-        color = TGAColor(255, 155, 0) * intensity;
-        return false;
-    }
-};
-
-struct TextureGouraudShader : public IShader
-{
-    mat<3, 3, float> varying_tri; // 变换后的顶点坐标
-    Vec3f varying_intensity;      // 顶点着色器写入，片段着色器读取
-    mat<2, 3, float> varying_uv;  // uv坐标，对应三个顶点
-
-    virtual Vec4f vertex(int iface, int nthvert)
-    {
-        // 从.obj文件读取顶点坐标，并转换到裁剪空间
-        Vec4f gl_Vertex = embed<4>(model->vert(iface, nthvert));
-        gl_Vertex = Viewport * Projection * ModelView * gl_Vertex;
-        varying_tri.set_col(nthvert, proj<3>(gl_Vertex / gl_Vertex[3]));
-        // 从obj文件读取uv坐标
-        varying_uv.set_col(nthvert, model->uv(iface, nthvert));
-        // 计算光照强度
-        varying_intensity[nthvert] = std::max(0.f, model->normal(iface, nthvert) * light_dir);
-        return gl_Vertex;
-    }
-
-    virtual bool fragment(Vec3f bar, TGAColor &color)
-    {
-        // 为当前像素计算强度插值，采样纹理，并着色
-        float intensity = varying_intensity * bar;
-        Vec2f uv = varying_uv * bar;
-        color = model->diffuse(uv) * intensity;
-        return false;
-    }
-};
-
-struct NormalMapShader : public IShader
-{
-    mat<3, 3, float> varying_tri; // 变换后的顶点坐标
-    mat<2, 3, float> varying_uv;  // uv坐标，对应三个顶点
-    mat<4, 4, float> uniform_M;   //  Projection*ModelView
-    mat<4, 4, float> uniform_MIT; // (Projection*ModelView).invert_transpose()
-
-    virtual Vec4f vertex(int iface, int nthvert)
-    {
-        // 从.obj文件读取顶点坐标，并转换到裁剪空间
-        Vec4f gl_Vertex = embed<4>(model->vert(iface, nthvert));
-        gl_Vertex = Viewport * Projection * ModelView * gl_Vertex;
-        varying_tri.set_col(nthvert, proj<3>(gl_Vertex / gl_Vertex[3]));
-        // 从obj文件读取uv坐标
-        varying_uv.set_col(nthvert, model->uv(iface, nthvert));
-        return gl_Vertex;
-    }
-
-    virtual bool fragment(Vec3f bar, TGAColor &color)
-    {
-        // 为当前像素计算uv坐标插值
-        Vec2f uv = varying_uv * bar;
-        // 将法线转换到投影空间
-        Vec3f n = proj<3>(uniform_MIT * embed<4>(model->normal(uv))).normalize();
-        // 将光源方向转换到投影空间
-        Vec3f l = proj<3>(uniform_M * embed<4>(light_dir)).normalize();
-        // 着色
-        float intensity = std::max(0.f, n * l);
-        color = model->diffuse(uv) * intensity;
-        return false;
-    }
-};
-
-struct PhongShader : public IShader
-{
-    mat<3, 3, float> varying_tri; // 变换后的顶点坐标
-    mat<2, 3, float> varying_uv;  // uv坐标，对应三个顶点
-    mat<4, 4, float> uniform_M;   //  Projection*ModelView
-    mat<4, 4, float> uniform_MIT; // (Projection*ModelView).invert_transpose()
-
-    virtual Vec4f vertex(int iface, int nthvert)
-    {
-        // 从.obj文件读取顶点坐标，并转换到裁剪空间
-        Vec4f gl_Vertex = embed<4>(model->vert(iface, nthvert));
-        gl_Vertex = Viewport * Projection * ModelView * gl_Vertex;
-        varying_tri.set_col(nthvert, proj<3>(gl_Vertex / gl_Vertex[3]));
-        // 从obj文件读取uv坐标
-        varying_uv.set_col(nthvert, model->uv(iface, nthvert));
-        return gl_Vertex;
-    }
-
-    virtual bool fragment(Vec3f bar, TGAColor &color)
-    {
-        // 为当前像素计算uv坐标插值
-        Vec2f uv = varying_uv * bar;
-        // 将法线转换到投影空间
-        Vec3f n = proj<3>(uniform_MIT * embed<4>(model->normal(uv))).normalize();
-        // 将光源方向转换到投影空间
-        Vec3f l = proj<3>(uniform_M * embed<4>(light_dir)).normalize();
-        // 计算反射光线
-        Vec3f r = (n * (n * l * 2.f) - l).normalize();
-        // 计算高光强度系数
-        float spec = pow(std::max(r.z, 0.0f), model->specular(uv));
-        // 计算漫反射强度系数
-        float diff = std::max(0.f, n * l);
-        // 读取漫反射纹理颜色
-        TGAColor c = model->diffuse(uv);
-        // 着色
-        color = c;
-        for (int i = 0; i < 3; i++)
-            color[i] = std::min<float>(5 + c[i] * (diff + .6 * spec), 255);
-        return false;
-    }
-};
-
-struct TangentNormalMapShader : public IShader
-{
-    mat<2, 3, float> varying_uv;  // uv坐标，对应三个顶点
-    mat<3, 3, float> varying_tri; // 变换后的顶点坐标
-    mat<3, 3, float> varying_nrm; // 变换后的顶点法线
-    mat<3, 3, float> ndc_tri;     // triangle in normalized device coordinates
-    mat<4, 4, float> uniform_M;   //  Projection*ModelView
-    mat<4, 4, float> uniform_MIT; // (Projection*ModelView).invert_transpose()
-
-    virtual Vec4f vertex(int iface, int nthvert)
-    {
-        // 从.obj文件读取顶点坐标，并转换到裁剪空间
-        Vec4f gl_Vertex = embed<4>(model->vert(iface, nthvert));
-        gl_Vertex = Viewport * Projection * ModelView * gl_Vertex;
-        varying_tri.set_col(nthvert, proj<3>(gl_Vertex / gl_Vertex[3]));
-        // 从obj文件读取uv坐标
-        varying_uv.set_col(nthvert, model->uv(iface, nthvert));
-        // 从.obj文件读取顶点法线，并转换到裁剪空间
-        varying_nrm.set_col(nthvert, proj<3>(uniform_MIT * embed<4>(model->normal(iface, nthvert), 0.f)));
-        ndc_tri.set_col(nthvert, proj<3>(gl_Vertex / gl_Vertex[3]));
-        return gl_Vertex;
-    }
-
-    virtual bool fragment(Vec3f bar, TGAColor &color)
-    {
-        // 为当前像素计算法线插值
-        Vec3f bn = (varying_nrm * bar).normalize();
-        // 为当前像素计算uv坐标插值
-        Vec2f uv = varying_uv * bar;
-
-        mat<3, 3, float> A;
-        A[0] = ndc_tri.col(1) - ndc_tri.col(0);
-        A[1] = ndc_tri.col(2) - ndc_tri.col(0);
-        A[2] = bn;
-
-        mat<3, 3, float> AI = A.invert();
-
-        Vec3f i = AI * Vec3f(varying_uv[0][1] - varying_uv[0][0], varying_uv[0][2] - varying_uv[0][0], 0);
-        Vec3f j = AI * Vec3f(varying_uv[1][1] - varying_uv[1][0], varying_uv[1][2] - varying_uv[1][0], 0);
-
-        mat<3, 3, float> B;
-        B.set_col(0, i.normalize());
-        B.set_col(1, j.normalize());
-        B.set_col(2, bn);
-
-        Vec3f n = (B * model->tangent_normal(uv)).normalize();
-
-        // 着色
-        float diff = std::max(0.f, n * light_dir);
-        color = model->diffuse(uv) * diff;
-
-        return false;
+            models.push_back(argv[i]);
     }
-};
-
-struct ShadowShader : public IShader
-{
-    mat<4, 4, float> uniform_M;       //  Projection*ModelView
-    mat<4, 4, float> uniform_MIT;     // (Projection*ModelView).invert_transpose()
-    mat<4, 4, float> uniform_Mshadow; // transform framebuffer screen coordinates to shadowbuffer screen coordinates
-    mat<2, 3, float> varying_uv;      // triangle uv coordinates, written by the vertex shader, read by the fragment shader
-    mat<3, 3, float> varying_tri;     // triangle coordinates before Viewport transform, written by VS, read by FS
-
-    ShadowShader(Matrix M, Matrix MIT, Matrix MS) : uniform_M(M), uniform_MIT(MIT), uniform_Mshadow(MS), varying_uv(), varying_tri() {}
-
-    virtual Vec4f vertex(int iface, int nthvert)
+    if (!check_render_settings(settings))
+        return 1;
+    // 常驻服务模式：命令行上的渲染选项与模型是各任务的默认值，任务从标准输入（"-"）或Unix域套接字读入
+    if (serve_path)
     {
-        varying_uv.set_col(nthvert, model->uv(iface, nthvert));
-        Vec4f gl_Vertex = Viewport * Projection * ModelView * embed<4>(model->vert(iface, nthvert));
-        varying_tri.set_col(nthvert, proj<3>(gl_Vertex / gl_Vertex[3]));
-        return gl_Vertex;
+        RenderServer server(server_settings, settings, models);
+        if (!(!strcmp(serve_path, "-") ? server.serve_stdio() : server.serve_socket(serve_path)))
+            return 1;
+        server.report(std::cerr);
+        std::cerr << std::endl;
+        return 0;
     }
-
-    virtual bool fragment(Vec3f bar, TGAColor &color)
+    if (models.empty())
     {
-        Vec4f sb_p = uniform_Mshadow * embed<4>(varying_tri * bar); // corresponding point in the shadow buffer
-        sb_p = sb_p / sb_p[3];
-        int idx = int(sb_p[0]) + int(sb_p[1]) * width;                // index in the shadowbuffer array
-        float shadow = .1 + .9 * (shadowbuffer[idx] < sb_p[2] + 50.); // magic coeff to avoid z-fighting
-        // 插值uv坐标
-        Vec2f uv = varying_uv * bar;
-        // 将法线转换到投影空间
-        Vec3f n = proj<3>(uniform_MIT * embed<4>(model->normal(uv))).normalize();
-        // 将光源方向转换到投影空间
-        Vec3f l = proj<3>(uniform_M * embed<4>(light_dir)).normalize();
-        // 计算反射光线
-        Vec3f r = (n * (n * l * 2.f) - l).normalize();
-        // 计算高光强度系数
-        float spec = pow(std::max(r.z, 0.0f), model->specular(uv));
-        // 计算漫反射强度系数
-        float diff = std::max(0.f, n * l);
-        // 读取漫反射纹理
-        TGAColor c = model->diffuse(uv);
-        // 着色
-        for (int i = 0; i < 3; i++)
-            color[i] = std::min<float>(20 + c[i] * shadow * (1.2 * diff + .6 * spec), 255);
-        return false;
+        return 0;
     }
-};
-
-struct DepthShader : public IShader
-{
-    mat<3, 3, float> varying_tri;
-
-    DepthShader() : varying_tri() {}
-
-    virtual Vec4f vertex(int iface, int nthvert)
+    // 分带渲染的各带按行顺序直接写入TGA文件
+    if (settings.band_height && (video_path || format != TGAImage::TGA || bench_formats))
     {
-        Vec4f gl_Vertex = embed<4>(model->vert(iface, nthvert));   // read the vertex from .obj file
-        gl_Vertex = Viewport * Projection * ModelView * gl_Vertex; // transform it to screen coordinates
-        varying_tri.set_col(nthvert, proj<3>(gl_Vertex / gl_Vertex[3]));
-        return gl_Vertex;
+        std::cerr << "--band-height streams TGA files only (no --video, --format or --bench-formats)" << std::endl;
+        return 1;
     }
+    // 各线程记录每个阶段（阴影、主渲染、后处理、写出）的耗时，结束时汇总并写出trace文件
+    if (trace_path)
+        pass_timers_enable();
 
-    virtual bool fragment(Vec3f bar, TGAColor &color)
+    Renderer renderer(settings, models);
     {
-        Vec3f p = varying_tri * bar;
-        color = TGAColor(255, 255, 255) * (p.z / depth);
-        return false;
+        const RenderSettings &s = renderer.settings();
+        std::cerr << "render target " << s.width * s.ssaa << "x" << s.height * s.ssaa;
+        if (s.msaa)
+            std::cerr << ", " << s.msaa << "x msaa";
+        if (s.ssaa > 1)
+            std::cerr << ", " << s.ssaa * s.ssaa << "x ssaa";
+        if (s.band_height)
+            std::cerr << " in bands of " << std::min(s.band_height, s.height) * s.ssaa << " rows";
+        std::cerr << ": " << renderer.target_bytes() / (1024. * 1024.) << " MB color+depth" << std::endl;
+        if (const BVH *bvh = renderer.bvh())
+            std::cerr << "shadow ray BVH: " << bvh->triangles() << " triangles, " << bvh->nodes() << " nodes, depth " << bvh->depth()
+                      << ", built in " << bvh->build_ms() << " ms" << std::endl;
     }
-};
 
-int main(int argc, char **argv)
-{
-    if (argc < 2)
+    // 视频流模式：所有帧写入同一个Y4M/RGB流（文件或标准输出），不再逐帧生成文件
+    VideoStream video;
+    if (video_path && !video.open(video_path, video_format, fps))
+        return 1;
+    // 编码与写盘在后台线程进行，与下一帧的渲染重叠；视频流需保持帧顺序，只用一个线程
+    FrameWriter writer(video_path ? 1 : writer_threads, writer_queue);
+
+    // 多帧并行：每帧有自己的RenderContext，帧之间只共享只读的模型与加锁的缓存。
+    // 动态调度让空闲线程领取下一帧；完成的帧先放入重排缓冲，按帧号顺序交给写出线程。
+    // writer.submit在写出队列满时会阻塞，所以在锁外调用：同一时刻只有一个线程负责提交（保证顺序），
+    // 其他线程放下完成的帧就去渲染下一帧。帧号最多领先下一个要提交的帧parallel_frames个，重排缓冲因此有界
+    double t_start = wall_time();
+    std::map<int, Frame> finished;
+    int next_frame = 0;      // 下一个要从重排缓冲取出的帧
+    bool submitting = false; // 有线程正在提交
+    pthread_mutex_t order_mutex;
+    pthread_cond_t order_advanced;
+    pthread_mutex_init(&order_mutex, NULL);
+    pthread_cond_init(&order_advanced, NULL);
+    int diff_failures = 0;
+    int stream_failures = 0;
+    // monotonic：帧号按顺序领取，等待窗口的线程之前的帧都已有线程在渲染，不会死锁
+#pragma omp parallel for schedule(monotonic : dynamic, 1) num_threads(parallel_frames) if (parallel_frames > 1)
+    for (int k = 0; k < nframes; k++)
     {
-        return 0;
-    }
-    for (int k = 0; k < 50; k++)
-    {
-        eye = Vec3f(1 - 0.05 * k, 1, 4);
-        light_dir = Vec3f(-1 + 0.05 * k, 1, 1 - 0.005 * k);
-
-        float *zbuffer = new float[width * height];
-        for (int i = width * height; i--;)
-        {
-            zbuffer[i] = -std::numeric_limits<float>::max();
-        }
-        shadowbuffer = new float[width * height];
-        for (int i = width * height; i--;)
-        {
-            shadowbuffer[i] = -std::numeric_limits<float>::max();
-        }
-
-        light_dir.normalize();
+        pthread_mutex_lock(&order_mutex);
+        while (k - next_frame >= parallel_frames)
+            pthread_cond_wait(&order_advanced, &order_mutex);
+        pthread_mutex_unlock(&order_mutex);
 
-        // 渲染阴影图
+        Frame frame;
+        if (settings.band_height)
         {
-            TGAImage depth(width, height, TGAImage::RGB);
-            lookat(light_dir, center, up);
-            viewport(width / 8, height / 8, width * 3 / 4, height * 3 / 4);
-            projection(0);
-
-            DepthShader depthshader;
-
-            for (int i = 1; i < argc; i++)
+            char filename[40];
+            sprintf(filename, "output%04d.tga", k);
+            TGAStreamWriter out;
+            if (out.open(filename, settings.width, settings.height, TGAImage::RGB, true, true)) // 与整幅写出一样，原点在左下角
             {
-                model = new Model(argv[i]);
-
-                Vec4f screen_coords[3];
-                for (int i = 0; i < model->nfaces(); i++)
+                frame = renderer.render(k, &out);
+                if (!out.close())
                 {
-                    for (int j = 0; j < 3; j++)
-                    {
-                        screen_coords[j] = depthshader.vertex(i, j);
-                    }
-                    triangle(screen_coords, depthshader, depth, shadowbuffer);
+#pragma omp atomic
+                    stream_failures++;
                 }
-                delete model;
             }
-            depth.flip_vertically(); // to place the origin in the bottom left corner of the image
-            depth.write_tga_file("depth.tga");
+            else
+            {
+#pragma omp atomic
+                stream_failures++;
+            }
         }
+        else
+            frame = renderer.render(k);
 
-        Matrix M = Viewport * Projection * ModelView;
-
-        // 渲染图像
+        pthread_mutex_lock(&order_mutex);
+        finished[k] = frame;
+        if (!submitting)
         {
-            TGAImage image(width, height, TGAImage::RGB);
-
-            lookat(eye, center, up);
-            viewport(width / 8, height / 8, width * 3 / 4, height * 3 / 4);
-            projection(-1.f / (eye - center).norm());
-
-            // GouraudShader shader;
-
-            // StylizedGouraudShader shader;
-
-            // TextureGouraudShader shader;
-
-            // NormalMapShader shader;
-            // shader.uniform_M   =  Projection*ModelView;
-            // shader.uniform_MIT = (Projection*ModelView).invert_transpose();
-
-            // PhongShader shader;
-            // shader.uniform_M = Projection * ModelView;
-            // shader.uniform_MIT = (Projection * ModelView).invert_transpose();
-
-            // TangentNormalMapShader shader;
-            // shader.uniform_M   =  Projection*ModelView;
-            // shader.uniform_MIT = (Projection*ModelView).invert_transpose();
-
-            ShadowShader shader(Projection * ModelView, (Projection * ModelView).invert_transpose(), M * (Viewport * Projection * ModelView).invert());
-
-            for (int i = 1; i < argc; i++)
+            submitting = true;
+            for (;;)
             {
-                model = new Model(argv[i]);
-
-                Vec4f screen_coords[3];
-                for (int i = 0; i < model->nfaces(); i++)
+                std::vector<Frame> ready;
+                for (std::map<int, Frame>::iterator it = finished.begin(); it != finished.end() && it->first == next_frame; it = finished.begin())
+                {
+                    ready.push_back(it->second);
+                    finished.erase(it);
+                    next_frame++;
+                }
+                if (ready.empty())
+                    break;
+                pthread_cond_broadcast(&order_advanced);
+                pthread_mutex_unlock(&order_mutex);
+                for (size_t i = 0; i < ready.size(); i++)
                 {
-                    for (int j = 0; j < 3; j++)
+                    Frame &f = ready[i];
+                    std::cerr << f.log;
+                    if (f.shadow_depth)
+                    {
+                        char filename[40];
+                        sprintf(filename, "depth%04d.tga", f.index);
+                        writer.submit(f.shadow_depth, filename, TGAImage::TGA, true); // bottom left origin
+                    }
+                    if (f.diff)
+                    {
+                        char filename[40];
+                        sprintf(filename, "diff%04d.tga", f.index);
+                        writer.submit(f.diff, filename, TGAImage::TGA, true);
+                    }
+                    if (f.diff_failed)
+                        diff_failures++;
+                    if (f.heatmap)
+                    {
+                        char filename[40];
+                        sprintf(filename, "%s%04d.tga", heatmap_name(settings.heatmap), f.index);
+                        writer.submit(f.heatmap, filename, TGAImage::TGA, true);
+                    }
+                    if (bench_formats && f.index == 0)
+                        benchmark_formats(*f.image);
+                    if (f.image && video_path)
                     {
-                        screen_coords[j] = shader.vertex(i, j);
+                        writer.submit(f.image, &video, true);
+                    }
+                    else if (f.image) // 分带渲染时图像已在渲染中写出
+                    {
+                        char filename[40];
+                        sprintf(filename, "output%04d.%s", f.index, TGAImage::extension(format));
+                        writer.submit(f.image, filename, format, true); // 写出时上下翻转，让原点在左下角
                     }
-                    triangle(screen_coords, shader, image, zbuffer);
                 }
-                delete model;
+                pthread_mutex_lock(&order_mutex); // 提交期间完成的帧由本线程接着提交
             }
-
-            image.flip_vertically(); // 上下翻转，让原点在左下角
-            char filename[40];
-            sprintf(filename, "output%04d.tga", k);
-            image.write_tga_file(filename);
+            submitting = false;
         }
-
-        delete[] zbuffer;
-        delete[] shadowbuffer;
+        pthread_mutex_unlock(&order_mutex);
+    }
+    pthread_cond_destroy(&order_advanced);
+    pthread_mutex_destroy(&order_mutex);
+    double t_render = wall_time() - t_start;
+    writer.finish();
+    video.close();
+    if (nframes > 1)
+        std::cerr << nframes << " frames in " << t_render << " s (" << nframes / t_render << " fps, "
+                  << parallel_frames << " frame" << (parallel_frames > 1 ? "s" : "") << " in flight)" << std::endl;
+    if (settings.diff)
+        std::cerr << "diff: " << diff_failures << " of " << nframes << " frames outside the tolerances" << std::endl;
+    if (trace_path)
+    {
+        pass_timers_report(std::cerr);
+        pass_timers_write_trace(trace_path);
     }
-    return 0;
+    return writer.failures() || diff_failures || stream_failures ? 1 : 0;
 }
@@ -1,9 +1,15 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <map>
+#include <cmath>
+#include <algorithm>
 #include "model.h"
 
-Model::Model(const char *filename) : verts_(), faces_(), norms_(), uv_(), diffusemap_(), normalmap_(), specularmap_()
+static unsigned long next_model_id = 0;
+
+Model::Model(const char *filename, TileCache *cache) : verts_(), faces_(), norms_(), uv_(), tangents_(), diffusemap_(), normalmap_(), tangentnormalmap_(), specularmap_(), glowmap_(),
+    cache_(cache), vdiffuse_(NULL), vnormal_(NULL), vtangentnormal_(NULL), vspecular_(NULL), vglow_(NULL), id_(__atomic_add_fetch(&next_model_id, 1, __ATOMIC_RELAXED))
 {
     std::ifstream in;
     in.open(filename, std::ifstream::in);
@@ -54,13 +60,107 @@ Model::Model(const char *filename) : verts_(), faces_(), norms_(), uv_(), diffus
         }
     }
     std::cerr << "# v# " << verts_.size() << " f# " << faces_.size() << " vt# " << uv_.size() << " vn# " << norms_.size() << std::endl;
+    compute_tangents();
+    if (cache_)
+    {
+        load_texture(filename, "_diffuse.tga", vdiffuse_);
+        load_texture(filename, "_nm.tga", vnormal_);
+        load_texture(filename, "_nm_tangent.tga", vtangentnormal_);
+        load_texture(filename, "_spec.tga", vspecular_);
+        load_texture(filename, "_glow.tga", vglow_);
+        return;
+    }
     load_texture(filename, "_diffuse.tga", diffusemap_);
     load_texture(filename, "_nm.tga", normalmap_);
     load_texture(filename, "_nm_tangent.tga", tangentnormalmap_);
     load_texture(filename, "_spec.tga", specularmap_);
+    load_texture(filename, "_glow.tga", glowmap_);
+}
+
+Model::~Model()
+{
+    delete vdiffuse_;
+    delete vnormal_;
+    delete vtangentnormal_;
+    delete vspecular_;
+    delete vglow_;
+}
+
+// Per-vertex tangent frames in the spirit of MikkTSpace: per-triangle uv gradients weighted by the corner
+// angle are accumulated over every corner sharing the same position/uv/normal triple, then orthogonalized
+// against the normal. The bitangent is not stored, only the sign that reconstructs it from normal x tangent.
+void Model::compute_tangents()
+{
+    std::map<std::vector<int>, int> corners; // v/uv/n triple -> accumulator index
+    std::vector<int> corner_index(faces_.size() * 3, -1);
+    std::vector<Vec3f> tsum, bsum;
+    for (int f = 0; f < (int)faces_.size(); f++)
+    {
+        if (faces_[f].size() < 3 || uv_.empty() || norms_.empty())
+            continue;
+        Vec3f p[3];
+        Vec2f t[3];
+        for (int j = 0; j < 3; j++)
+        {
+            p[j] = verts_[faces_[f][j][0]];
+            t[j] = uv_[faces_[f][j][1]];
+        }
+        Vec3f e1 = p[1] - p[0], e2 = p[2] - p[0];
+        Vec2f d1 = t[1] - t[0], d2 = t[2] - t[0];
+        float det = d1.x * d2.y - d2.x * d1.y;
+        float r = std::abs(det) > 1e-12f ? 1.f / det : 0.f;
+        Vec3f T = (e1 * d2.y - e2 * d1.y) * r;
+        Vec3f B = (e2 * d1.x - e1 * d2.x) * r;
+        for (int j = 0; j < 3; j++)
+        {
+            Vec3f a = p[(j + 1) % 3] - p[j], b = p[(j + 2) % 3] - p[j];
+            float la = a.norm(), lb = b.norm();
+            float angle = (la > 0 && lb > 0) ? std::acos(std::max(-1.f, std::min(1.f, a * b / (la * lb)))) : 0.f;
+            std::vector<int> key(3);
+            key[0] = faces_[f][j][0];
+            key[1] = faces_[f][j][1];
+            key[2] = faces_[f][j][2];
+            std::map<std::vector<int>, int>::iterator it = corners.find(key);
+            int idx;
+            if (it == corners.end())
+            {
+                idx = (int)tsum.size();
+                corners[key] = idx;
+                tsum.push_back(Vec3f());
+                bsum.push_back(Vec3f());
+            }
+            else
+                idx = it->second;
+            tsum[idx] = tsum[idx] + T * angle;
+            bsum[idx] = bsum[idx] + B * angle;
+            corner_index[f * 3 + j] = idx;
+        }
+    }
+    tangents_.assign(faces_.size() * 3, Vec4f());
+    for (int c = 0; c < (int)corner_index.size(); c++)
+    {
+        if (corner_index[c] < 0)
+            continue;
+        Vec3f n = normal(c / 3, c % 3);
+        Vec3f t = tsum[corner_index[c]];
+        t = t - n * (n * t); // Gram-Schmidt
+        if (t.norm() < 1e-12f) // degenerate uv mapping, any vector orthogonal to n will do
+            t = cross(std::abs(n.x) < .9f ? Vec3f(1, 0, 0) : Vec3f(0, 1, 0), n);
+        t.normalize();
+        float sign = cross(n, t) * bsum[corner_index[c]] < 0.f ? -1.f : 1.f;
+        tangents_[c] = embed<4>(t, sign);
+    }
+}
+
+Vec4f Model::tangent(int iface, int nthvert)
+{
+    return tangents_[iface * 3 + nthvert];
 }
 
-Model::~Model() {}
+unsigned long Model::id()
+{
+    return id_;
+}
 
 int Model::nverts()
 {
@@ -102,26 +202,59 @@ void Model::load_texture(std::string filename, const char *suffix, TGAImage &img
     }
 }
 
-TGAColor Model::diffuse(Vec2f uvf)
+void Model::load_texture(std::string filename, const char *suffix, VirtualTexture *&vt)
+{
+    size_t dot = filename.find_last_of(".");
+    if (dot == std::string::npos)
+        return;
+    vt = new VirtualTexture(filename.substr(0, dot) + std::string(suffix), cache_);
+    if (!vt->valid())
+    {
+        delete vt;
+        vt = NULL;
+    }
+}
+
+TGAColor Model::sample(TGAImage &img, VirtualTexture *vt, Vec2f uvf, float footprint)
+{
+    if (vt)
+        return vt->sample_footprint(uvf, footprint);
+    Vec2i uv(uvf[0] * img.get_width(), uvf[1] * img.get_height());
+    return img.get(uv[0], uv[1]);
+}
+
+void Model::texture_feedback(std::ostream &out)
+{
+    VirtualTexture *vts[5] = {vdiffuse_, vnormal_, vtangentnormal_, vspecular_, vglow_};
+    const char *names[5] = {"diffuse", "normal", "tangent normal", "specular", "glow"};
+    for (int i = 0; i < 5; i++)
+    {
+        if (!vts[i])
+            continue;
+        // 取走反馈与打印用同一次的计数，其他帧在此期间的采样留给下一次
+        const int touched = vts[i]->prefetch_feedback();
+        if (touched)
+            out << "  " << names[i] << ": " << touched << "/" << vts[i]->total_tiles() << " tiles sampled" << std::endl;
+    }
+}
+
+TGAColor Model::diffuse(Vec2f uvf, float footprint)
 {
-    Vec2i uv(uvf[0] * diffusemap_.get_width(), uvf[1] * diffusemap_.get_height());
-    return diffusemap_.get(uv[0], uv[1]);
+    return sample(diffusemap_, vdiffuse_, uvf, footprint);
 }
 
-Vec3f Model::normal(Vec2f uvf)
+Vec3f Model::normal(Vec2f uvf, float footprint)
 {
-    Vec2i uv(uvf[0] * normalmap_.get_width(), uvf[1] * normalmap_.get_height());
-    TGAColor c = normalmap_.get(uv[0], uv[1]);
+    TGAColor c = sample(normalmap_, vnormal_, uvf, footprint);
     Vec3f res;
     for (int i = 0; i < 3; i++)
         res[2 - i] = (float)c[i] / 255.f * 2.f - 1.f;
     return res;
 }
 
-Vec3f Model::tangent_normal(Vec2f uvf)
+Vec3f Model::tangent_normal(Vec2f uvf, float footprint)
 {
-    Vec2i uv(uvf[0] * tangentnormalmap_.get_width(), uvf[1] * tangentnormalmap_.get_height());
-    TGAColor c = tangentnormalmap_.get(uv[0], uv[1]);
+    TGAColor c = sample(tangentnormalmap_, vtangentnormal_, uvf, footprint);
     Vec3f res;
     for (int i = 0; i < 3; i++)
         res[2 - i] = (float)c[i] / 255.f * 2.f - 1.f;
@@ -133,14 +266,144 @@ Vec2f Model::uv(int iface, int nthvert)
     return uv_[faces_[iface][nthvert][1]];
 }
 
-float Model::specular(Vec2f uvf)
+float Model::specular(Vec2f uvf, float footprint)
 {
-    Vec2i uv(uvf[0] * specularmap_.get_width(), uvf[1] * specularmap_.get_height());
-    return specularmap_.get(uv[0], uv[1])[0] / 1.f;
+    return sample(specularmap_, vspecular_, uvf, footprint)[0] / 1.f;
 }
 
 Vec3f Model::normal(int iface, int nthvert)
 {
-    int idx = faces_[iface][nthvert][2];
-    return norms_[idx].normalize();
+    Vec3f n = norms_[faces_[iface][nthvert][2]];
+    return n.normalize();
+}
+
+bool Model::has_glow()
+{
+    return vglow_ || glowmap_.get_width() > 0;
+}
+
+TGAColor Model::glow(Vec2f uvf, float footprint)
+{
+    return sample(glowmap_, vglow_, uvf, footprint);
+}
+
+ModelCache::ModelCache(int capacity) : models_(), capacity_(capacity), clock_(0), loads_(0), hits_(0), evictions_(0), mutex_()
+{
+    pthread_mutex_init(&mutex_, NULL);
+}
+
+ModelCache::~ModelCache()
+{
+    for (std::map<std::string, Entry>::iterator it = models_.begin(); it != models_.end(); ++it)
+        delete it->second.model;
+    pthread_mutex_destroy(&mutex_);
+}
+
+// 加载时持有锁：同一文件只会被读一次，代价是首次加载期间其他模型的取用也要等待
+Model *ModelCache::find_or_load(const std::string &filename)
+{
+    std::map<std::string, Entry>::iterator it = models_.find(filename);
+    if (it != models_.end())
+    {
+        hits_++;
+        it->second.last_used = ++clock_;
+        return it->second.model;
+    }
+    Model *model = new Model(filename.c_str());
+    if (model->nfaces() == 0)
+    {
+        std::cerr << "can't open file " << filename << std::endl;
+        delete model;
+        return NULL;
+    }
+    Entry e = {model, 0, ++clock_};
+    models_[filename] = e;
+    loads_++;
+    return model;
+}
+
+// 超出容量时释放最久未用、没有Renderer持有的模型；都被持有时暂时超出
+void ModelCache::evict()
+{
+    while (capacity_ > 0 && (int)models_.size() > capacity_)
+    {
+        std::map<std::string, Entry>::iterator lru = models_.end();
+        for (std::map<std::string, Entry>::iterator it = models_.begin(); it != models_.end(); ++it)
+            if (!it->second.refs && (lru == models_.end() || it->second.last_used < lru->second.last_used))
+                lru = it;
+        if (lru == models_.end())
+            break;
+        delete lru->second.model;
+        models_.erase(lru);
+        evictions_++;
+    }
+}
+
+Model *ModelCache::acquire(const std::string &filename)
+{
+    pthread_mutex_lock(&mutex_);
+    Model *model = find_or_load(filename);
+    if (model)
+    {
+        models_[filename].refs++;
+        evict();
+    }
+    pthread_mutex_unlock(&mutex_);
+    return model;
+}
+
+void ModelCache::release(Model *model)
+{
+    pthread_mutex_lock(&mutex_);
+    for (std::map<std::string, Entry>::iterator it = models_.begin(); it != models_.end(); ++it)
+    {
+        if (it->second.model != model)
+            continue;
+        it->second.refs--;
+        it->second.last_used = ++clock_;
+        break;
+    }
+    evict();
+    pthread_mutex_unlock(&mutex_);
+}
+
+bool ModelCache::load(const std::string &filename)
+{
+    pthread_mutex_lock(&mutex_);
+    const bool ok = find_or_load(filename) != NULL;
+    evict();
+    pthread_mutex_unlock(&mutex_);
+    return ok;
+}
+
+int ModelCache::size()
+{
+    pthread_mutex_lock(&mutex_);
+    int n = models_.size();
+    pthread_mutex_unlock(&mutex_);
+    return n;
+}
+
+int ModelCache::loads()
+{
+    pthread_mutex_lock(&mutex_);
+    int n = loads_;
+    pthread_mutex_unlock(&mutex_);
+    return n;
+}
+
+int ModelCache::hits()
+{
+    pthread_mutex_lock(&mutex_);
+    int n = hits_;
+    pthread_mutex_unlock(&mutex_);
+    return n;
+}
+
+int ModelCache::evictions()
+{
+    pthread_mutex_lock(&mutex_);
+    int n = evictions_;
+    pthread_mutex_unlock(&mutex_);
+    return n;
 }
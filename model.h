@@ -2,8 +2,11 @@
 #define __MODEL_H__
 #include <vector>
 #include <string>
+#include <map>
+#include <pthread.h>
 #include "geometry.h"
 #include "tgaimage.h"
+#include "vtexture.h"
 
 class Model {
 private:
@@ -11,25 +14,91 @@ private:
     std::vector<std::vector<Vec3i> > faces_; // attention, this Vec3i means vertex/uv/normal
     std::vector<Vec3f> norms_;
     std::vector<Vec2f> uv_;
+    std::vector<Vec4f> tangents_; // per face corner: xyz tangent, w = bitangent sign (MikkTSpace convention)
     TGAImage diffusemap_;
     TGAImage normalmap_;
     TGAImage tangentnormalmap_;
     TGAImage specularmap_;
+    TGAImage glowmap_; // emissive map, optional (only some assets ship one)
+    // with a tile cache the maps above stay empty and textures are paged in on demand instead
+    TileCache *cache_;
+    VirtualTexture *vdiffuse_;
+    VirtualTexture *vnormal_;
+    VirtualTexture *vtangentnormal_;
+    VirtualTexture *vspecular_;
+    VirtualTexture *vglow_;
+    unsigned long id_;
     void load_texture(std::string filename, const char *suffix, TGAImage &img);
+    void compute_tangents();
+    void load_texture(std::string filename, const char *suffix, VirtualTexture *&vt);
+    TGAColor sample(TGAImage &img, VirtualTexture *vt, Vec2f uvf, float footprint);
+    Model(const Model &);
+    Model &operator=(const Model &);
 public:
-    Model(const char *filename);
+    Model(const char *filename, TileCache *cache=NULL);
     ~Model();
+    // unique for the life of the process: unlike the address of a freed model, it is never reused
+    unsigned long id();
     int nverts();
     int nfaces();
     Vec3f normal(int iface, int nthvert);
-    Vec3f normal(Vec2f uv);
-    Vec3f tangent_normal(Vec2f uv);
+    // unit tangent orthogonal to the vertex normal; bitangent = cross(normal, tangent) * w
+    Vec4f tangent(int iface, int nthvert);
+    // footprint: log2 of the uv distance covered by one pixel, picks the mip level of a virtual texture
+    // (plain textures have a single level); the default samples the full resolution
+    Vec3f normal(Vec2f uv, float footprint=-1e30f);
+    Vec3f tangent_normal(Vec2f uv, float footprint=-1e30f);
     Vec3f vert(int i);
     Vec3f vert(int iface, int nthvert);
     Vec2f uv(int iface, int nthvert);
-    TGAColor diffuse(Vec2f uv);
-    float specular(Vec2f uv);
+    TGAColor diffuse(Vec2f uv, float footprint=-1e30f);
+    float specular(Vec2f uv, float footprint=-1e30f);
+    bool has_glow();
+    TGAColor glow(Vec2f uv, float footprint=-1e30f);
     std::vector<int> face(int idx);
+    // virtual textures only: prints the tiles sampled since the last call and prefetches them
+    void texture_feedback(std::ostream &out);
 };
+
+// Models loaded once and shared by every renderer that asks for the same file, for a process that
+// renders many unrelated jobs. Models are read-only while rendering, so sharing them is safe. A model
+// is held from acquire() to the matching release(); beyond capacity, the least recently used models
+// nobody holds are freed. Plain textures only (a virtual texture's feedback is not meant to be driven
+// by several renderers at once).
+class ModelCache {
+public:
+    // capacity: models kept in memory, exceeded only while the held ones need it; 0 keeps every model
+    ModelCache(int capacity=0);
+    ~ModelCache();
+    // NULL when the file can't be read or has no faces
+    Model *acquire(const std::string &filename);
+    void release(Model *model);
+    // loads the file without holding the model; false when it can't be read
+    bool load(const std::string &filename);
+    int size();
+    int loads();
+    int hits();
+    int evictions();
+private:
+    ModelCache(const ModelCache &);
+    ModelCache &operator=(const ModelCache &);
+
+    struct Entry {
+        Model *model;
+        int refs;                 // acquire() calls not released yet
+        unsigned long last_used;
+    };
+    Model *find_or_load(const std::string &filename); // called with the lock held
+    void evict();                                       // called with the lock held
+
+    std::map<std::string, Entry> models_;
+    int capacity_;
+    unsigned long clock_;
+    int loads_;
+    int hits_;
+    int evictions_;
+    pthread_mutex_t mutex_;
+};
+
 #endif //__MODEL_H__
 
@@ -0,0 +1,155 @@
+#include <cstring>
+#include <algorithm>
+#include "oit.h"
+
+bool parse_oit_mode(const char *name, OITMode &mode) {
+    if (!strcmp(name, "lists")) mode = OIT_LISTS;
+    else if (!strcmp(name, "kbuffer")) mode = OIT_KBUFFER;
+    else return false;
+    return true;
+}
+
+OITBuffer::OITBuffer(int w, int h, OITMode mode, int k, size_t arena_bytes) : width_(w), height_(h), mode_(mode),
+    k_(std::max(1, std::min(k, 255))), heads_(), count_(), fragments_(), used_(0), stored_(0), overflow_(0), max_per_pixel_(0) {
+    if (mode_==OIT_LISTS) {
+        heads_.resize((size_t)w*h);
+        fragments_.resize(std::max((size_t)1, arena_bytes/sizeof(Fragment)));
+    } else {
+        count_.resize((size_t)w*h);
+        fragments_.resize((size_t)w*h*k_);
+    }
+    clear();
+}
+
+void OITBuffer::clear() {
+    if (mode_==OIT_LISTS)
+        memset(&heads_[0], 0xff, heads_.size()*sizeof(int)); // all -1
+    else
+        memset(&count_[0], 0, count_.size());
+    used_ = 0;
+    stored_ = 0;
+    overflow_ = 0;
+}
+
+void OITBuffer::insert(int x, int y, float depth, const TGAColor &color) {
+    if (x<0 || y<0 || x>=width_ || y>=height_) return;
+    const size_t i = x+(size_t)y*width_;
+    Fragment f;
+    f.depth = depth;
+    memcpy(f.bgra, color.bgra, 4);
+    if (mode_==OIT_LISTS) {
+        if (used_==fragments_.size()) {
+            overflow_++;
+            return;
+        }
+        f.next = heads_[i];
+        heads_[i] = used_;
+        fragments_[used_++] = f;
+        stored_++;
+        return;
+    }
+    Fragment *slots = &fragments_[i*k_];
+    if (count_[i]<k_) {
+        slots[count_[i]++] = f;
+        stored_++;
+        return;
+    }
+    // full: the farthest of the k+1 fragments is the one that matters least
+    overflow_++;
+    Fragment *farthest = slots;
+    for (int s=1; s<k_; s++)
+        if (slots[s].depth<farthest->depth) farthest = slots+s;
+    if (farthest->depth<depth) *farthest = f;
+}
+
+void OITBuffer::gather(size_t i, std::vector<Fragment> &out) const {
+    out.clear();
+    if (mode_==OIT_LISTS) {
+        for (int n=heads_[i]; n>=0; n=fragments_[n].next) out.push_back(fragments_[n]);
+    } else {
+        out.insert(out.end(), &fragments_[i*k_], &fragments_[i*k_]+count_[i]);
+    }
+    // larger depth values are closer to the camera: sort ascending to go back to front
+    for (size_t a=1; a<out.size(); a++) // few fragments per pixel, insertion sort
+        for (size_t b=a; b>0 && out[b].depth<out[b-1].depth; b--) std::swap(out[b], out[b-1]);
+}
+
+void OITBuffer::resolve(TGAImage &img) {
+    const int bpp = img.get_bytespp();
+    unsigned char *data = img.buffer();
+    if (!data || bpp<3) return;
+    int deepest = 0;
+#pragma omp parallel
+    {
+        std::vector<Fragment> frags;
+        int local_deepest = 0;
+#pragma omp for
+        for (int y=0; y<height_; y++) {
+            for (int x=0; x<width_; x++) {
+                gather(x+(size_t)y*width_, frags);
+                if (frags.empty()) continue;
+                local_deepest = std::max(local_deepest, (int)frags.size());
+                unsigned char *p = data + (x+(size_t)y*width_)*bpp;
+                float dst[3] = {(float)p[0], (float)p[1], (float)p[2]};
+                for (size_t f=0; f<frags.size(); f++) {
+                    const float a = frags[f].bgra[3]/255.f;
+                    for (int c=0; c<3; c++) dst[c] = frags[f].bgra[c]*a + dst[c]*(1.f-a);
+                }
+                for (int c=0; c<3; c++) p[c] = std::min(255.f, dst[c]+.5f);
+            }
+        }
+#pragma omp critical(oit_resolve)
+        deepest = std::max(deepest, local_deepest);
+    }
+    max_per_pixel_ = deepest;
+}
+
+void OITBuffer::resolve(FloatImage &img, const GammaTable &gamma) {
+    int deepest = 0;
+#pragma omp parallel
+    {
+        std::vector<Fragment> frags;
+        int local_deepest = 0;
+#pragma omp for
+        for (int y=0; y<height_; y++) {
+            float *rows[3] = {img.row(FloatImage::B, y), img.row(FloatImage::G, y), img.row(FloatImage::R, y)}; // bgra order
+            for (int x=0; x<width_; x++) {
+                gather(x+(size_t)y*width_, frags);
+                if (frags.empty()) continue;
+                local_deepest = std::max(local_deepest, (int)frags.size());
+                for (size_t f=0; f<frags.size(); f++) {
+                    const float a = frags[f].bgra[3]/255.f;
+                    for (int c=0; c<3; c++) rows[c][x] = gamma.decode(frags[f].bgra[c])*a + rows[c][x]*(1.f-a);
+                }
+            }
+        }
+#pragma omp critical(oit_resolve)
+        deepest = std::max(deepest, local_deepest);
+    }
+    max_per_pixel_ = deepest;
+}
+
+void OITBuffer::report(std::ostream &out) const {
+    out << stored_ << " translucent fragments (" << (mode_==OIT_LISTS ? "lists" : "k-buffer") << ", up to " << max_per_pixel_
+        << " per pixel, " << memory()/(1024.*1024.) << " MB), " << overflow_ << " dropped";
+}
+
+int OITBuffer::width() const {
+    return width_;
+}
+
+int OITBuffer::height() const {
+    return height_;
+}
+
+size_t OITBuffer::memory() const {
+    return heads_.size()*sizeof(int) + count_.size() + fragments_.size()*sizeof(Fragment);
+}
+
+size_t OITBuffer::fragment_bytes() {
+    return sizeof(Fragment);
+}
+
+long OITBuffer::overflow() const {
+    return overflow_;
+}
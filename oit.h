@@ -0,0 +1,55 @@
+#ifndef __OIT_H__
+#define __OIT_H__
+#include <vector>
+#include <ostream>
+#include "tgaimage.h"
+#include "framebuffer.h"
+
+enum OITMode {
+    OIT_LISTS,  // per-pixel linked lists of fragments taken from one fixed-size arena
+    OIT_KBUFFER // k fragment slots per pixel, keeping the k nearest ones
+};
+bool parse_oit_mode(const char *name, OITMode &mode);
+
+// Translucent fragments of a frame, sorted and blended back to front per pixel by resolve(), so the
+// result does not depend on the order the triangles came in. Memory is fixed at construction: once
+// the arena (lists) or the slots of a pixel (k-buffer) are full, fragments are dropped and counted.
+class OITBuffer {
+public:
+    OITBuffer(int w, int h, OITMode mode, int k=8, size_t arena_bytes=16<<20);
+    void clear();
+    // the alpha channel of color is the opacity of the fragment
+    void insert(int x, int y, float depth, const TGAColor &color);
+    // blends over an opaque 8-bit image, in its gamma encoded space (like fixed-function blending)
+    void resolve(TGAImage &img);
+    // blends over an opaque linear image, colors are decoded through gamma first
+    void resolve(FloatImage &img, const GammaTable &gamma);
+    void report(std::ostream &out) const;
+    int width() const;
+    int height() const;
+    size_t memory() const;
+    long overflow() const;
+    // bytes of one stored fragment (k-buffer slot or arena entry)
+    static size_t fragment_bytes();
+private:
+    struct Fragment {
+        float depth;
+        unsigned char bgra[4];
+        int next; // lists: next fragment of the pixel, -1 at the end
+    };
+    // the fragments of pixel i, back to front (farthest first)
+    void gather(size_t i, std::vector<Fragment> &out) const;
+
+    int width_, height_;
+    OITMode mode_;
+    int k_;
+    std::vector<int> heads_;           // lists: first fragment of each pixel, -1 when none
+    std::vector<unsigned char> count_; // k-buffer: used slots of each pixel
+    std::vector<Fragment> fragments_;  // lists: the arena; k-buffer: k slots per pixel
+    size_t used_;                      // lists: fragments taken from the arena
+    long stored_;
+    long overflow_;
+    int max_per_pixel_;                // deepest pixel at the last resolve
+};
+
+#endif //__OIT_H__
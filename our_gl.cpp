@@ -1,15 +1,35 @@
 #include <cmath>
 #include <limits>
 #include <cstdlib>
+#include <cstring>
+#include <algorithm>
 #include "our_gl.h"
+#include "stats.h"
+#include "oit.h"
 
-Matrix ModelView;
-Matrix Viewport;
-Matrix Projection;
+RenderContext::RenderContext() : ModelView(Matrix::identity()), Viewport(Matrix::identity()), Projection(Matrix::identity()),
+    eye(1, 1, 4), center(0, 0, 0), up(0, 1, 0), light_dir(1, 1, 1) {}
 
 IShader::~IShader() {}
 
-void viewport(int x, int y, int w, int h) {
+void IShader::prepare() {}
+
+bool IShader::fragment_hdr(Vec3f bar, const GammaTable &gamma, Vec4f &color) {
+    TGAColor c;
+    bool discard = fragment(bar, c);
+    if (c.bytespp<3) {
+        color[0] = color[1] = color[2] = gamma.decode(c[0]);
+    } else {
+        color[0] = gamma.decode(c[2]);
+        color[1] = gamma.decode(c[1]);
+        color[2] = gamma.decode(c[0]);
+    }
+    color[3] = c.bytespp==4 ? c[3]/255.f : 1.f;
+    return discard;
+}
+
+void viewport(RenderContext &ctx, int x, int y, int w, int h) {
+    Matrix &Viewport = ctx.Viewport;
     Viewport = Matrix::identity();
     Viewport[0][3] = x+w/2.f;
     Viewport[1][3] = y+h/2.f;
@@ -19,12 +39,13 @@ void viewport(int x, int y, int w, int h) {
     Viewport[2][2] = depth/2.f;
 }
 
-void projection(float coeff) {
-    Projection = Matrix::identity();
-    Projection[3][2] = coeff;
+void projection(RenderContext &ctx, float coeff) {
+    ctx.Projection = Matrix::identity();
+    ctx.Projection[3][2] = coeff;
 }
 
-void lookat(Vec3f eye, Vec3f center, Vec3f up) {
+void lookat(RenderContext &ctx, Vec3f eye, Vec3f center, Vec3f up) {
+    Matrix &ModelView = ctx.ModelView;
     Vec3f z = (eye-center).normalize();
     Vec3f x = cross(up,z).normalize();
     Vec3f y = cross(z,x).normalize();
@@ -50,13 +71,60 @@ Vec3f barycentric(Vec2f A, Vec2f B, Vec2f C, Vec2f P) {
     return Vec3f(-1,1,1); // in this case generate negative coordinates, it will be thrown away by the rasterizator
 }
 
-void triangle(Vec4f *pts, IShader &shader, TGAImage &image, float *zbuffer) {
-    Vec2f bboxmin( std::numeric_limits<float>::max(),  std::numeric_limits<float>::max());
-    Vec2f bboxmax(-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max());
+// counts a triangle entering the rasterizer: culled when it is degenerate (the test barycentric() applies) or entirely off-screen
+static void count_triangle(PipelineStats *stats, Vec4f *pts, int width, int height) {
+    Vec2f s[3];
+    for (int i=0; i<3; i++) s[i] = proj<2>(pts[i]/pts[i][3]);
+    const float uz = (s[2].x-s[0].x)*(s[1].y-s[0].y) - (s[1].x-s[0].x)*(s[2].y-s[0].y);
+    const float xmin = std::min(s[0].x, std::min(s[1].x, s[2].x)), xmax = std::max(s[0].x, std::max(s[1].x, s[2].x));
+    const float ymin = std::min(s[0].y, std::min(s[1].y, s[2].y)), ymax = std::max(s[0].y, std::max(s[1].y, s[2].y));
+    stats->triangles_submitted++;
+    if (std::abs(uz)<=1e-2 || xmax<0 || ymax<0 || xmin>width-1 || ymin>height-1)
+        stats->triangles_culled++;
+    else
+        stats->triangles_rasterized++;
+}
+
+static bool run_fragment(IShader &shader, Vec3f bar, TGAColor &color) {
+    return shader.fragment(bar, color);
+}
+
+// the output of a float framebuffer fragment, with the table its 8-bit colors are decoded through
+struct HDRFragment {
+    HDRFragment(const GammaTable &g) : gamma(g), color() {}
+    const GammaTable &gamma;
+    Vec4f color;
+};
+
+static bool run_fragment(IShader &shader, Vec3f bar, HDRFragment &out) {
+    return shader.fragment_hdr(bar, out.gamma, out.color);
+}
+
+// the fragment shader call of an instrumented rasterizer: timed, and charged to the pixel for the heatmaps
+template <typename Color> static bool counted_fragment(IShader &shader, Vec3f bar, Color &color, PipelineStats *stats, size_t pixel) {
+    const unsigned long t0 = cpu_ticks();
+    const bool discard = run_fragment(shader, bar, color);
+    const unsigned long ticks = cpu_ticks()-t0;
+    stats->pixels_shaded++;
+    stats->fragment_ticks += ticks;
+    if (discard) stats->discards++;
+    if (stats->heatmaps()) {
+        stats->overdraw[pixel]++;
+        stats->cost[pixel] += ticks;
+    }
+    return discard;
+}
+
+void triangle(Vec4f *pts, IShader &shader, TGAImage &image, float *zbuffer, PipelineStats *stats) {
+    const int width = image.get_width(), height = image.get_height();
+    if (stats) count_triangle(stats, pts, width, height);
+    // clipped to the target: triangles of a band or partly off-screen must not reach outside the zbuffer
+    Vec2f bboxmin(width-1, height-1);
+    Vec2f bboxmax(0, 0);
     for (int i=0; i<3; i++) {
         for (int j=0; j<2; j++) {
-            bboxmin[j] = std::min(bboxmin[j], pts[i][j]/pts[i][3]);
-            bboxmax[j] = std::max(bboxmax[j], pts[i][j]/pts[i][3]);
+            bboxmin[j] = std::max(0.f, std::min(bboxmin[j], pts[i][j]/pts[i][3]));
+            bboxmax[j] = std::min(j ? height-1.f : width-1.f, std::max(bboxmax[j], pts[i][j]/pts[i][3]));
         }
     }
     Vec2i P;
@@ -67,13 +135,282 @@ void triangle(Vec4f *pts, IShader &shader, TGAImage &image, float *zbuffer) {
             float z = pts[0][2]*c.x + pts[1][2]*c.y + pts[2][2]*c.z;
             float w = pts[0][3]*c.x + pts[1][3]*c.y + pts[2][3]*c.z;
             int frag_depth = z/w;
-            if (c.x<0 || c.y<0 || c.z<0 || zbuffer[P.x+P.y*image.get_width()]>frag_depth) continue;
-            bool discard = shader.fragment(c, color);
+            if (c.x<0 || c.y<0 || c.z<0) continue;
+            if (stats) stats->pixels_tested++;
+            if (zbuffer[P.x+P.y*width]>frag_depth) {
+                if (stats) stats->pixels_depth_rejected++;
+                continue;
+            }
+            bool discard = stats ? counted_fragment(shader, c, color, stats, P.x+P.y*width) : shader.fragment(c, color);
             if (!discard) {
-                zbuffer[P.x+P.y*image.get_width()] = frag_depth;
+                zbuffer[P.x+P.y*width] = frag_depth;
                 image.set(P.x, P.y, color);
             }
         }
     }
 }
 
+void triangle_hdr(Vec4f *pts, IShader &shader, FloatImage &image, float *zbuffer, const GammaTable &gamma, PipelineStats *stats) {
+    const int width = image.width(), height = image.height();
+    if (stats) count_triangle(stats, pts, width, height);
+    Vec2f s[3];
+    for (int i=0; i<3; i++) s[i] = proj<2>(pts[i]/pts[i][3]);
+    Vec2f bboxmin(width-1, height-1);
+    Vec2f bboxmax(0, 0);
+    for (int i=0; i<3; i++) {
+        for (int j=0; j<2; j++) {
+            bboxmin[j] = std::max(0.f, std::min(bboxmin[j], s[i][j]));
+            bboxmax[j] = std::min(j ? height-1.f : width-1.f, std::max(bboxmax[j], s[i][j]));
+        }
+    }
+    const Vec2f &A = s[0], &B = s[1], &C = s[2];
+    const float uz = (C.x-A.x)*(B.y-A.y) - (B.x-A.x)*(C.y-A.y);
+    if (std::abs(uz)<=1e-2) return;
+    Vec2i P;
+    HDRFragment frag(gamma);
+    for (P.x=bboxmin.x; P.x<=bboxmax.x; P.x++) {
+        for (P.y=bboxmin.y; P.y<=bboxmax.y; P.y++) {
+            const float ux = (B.x-A.x)*(A.y-P.y) - (A.x-P.x)*(B.y-A.y);
+            const float uy = (A.x-P.x)*(C.y-A.y) - (C.x-A.x)*(A.y-P.y);
+            Vec3f c(1.f-(ux+uy)/uz, uy/uz, ux/uz);
+            if (c.x<0 || c.y<0 || c.z<0) continue;
+            float z = pts[0][2]*c.x + pts[1][2]*c.y + pts[2][2]*c.z;
+            float w = pts[0][3]*c.x + pts[1][3]*c.y + pts[2][3]*c.z;
+            int frag_depth = z/w;
+            float &zb = zbuffer[P.x+P.y*width];
+            if (stats) stats->pixels_tested++;
+            if (zb>frag_depth) {
+                if (stats) stats->pixels_depth_rejected++;
+                continue;
+            }
+            if (!(stats ? counted_fragment(shader, c, frag, stats, P.x+P.y*width) : shader.fragment_hdr(c, gamma, frag.color))) {
+                zb = frag_depth;
+                image.set(P.x, P.y, frag.color);
+            }
+        }
+    }
+}
+
+void triangle_fast(Vec4f *pts, IShader &shader, TGAImage &image, float *zbuffer, PipelineStats *stats) {
+    const int width = image.get_width(), height = image.get_height();
+    if (stats) count_triangle(stats, pts, width, height);
+    Vec2f s[3];
+    for (int i=0; i<3; i++) s[i] = proj<2>(pts[i]/pts[i][3]);
+    Vec2f bboxmin(width-1, height-1);
+    Vec2f bboxmax(0, 0);
+    for (int i=0; i<3; i++) {
+        for (int j=0; j<2; j++) {
+            bboxmin[j] = std::max(0.f, std::min(bboxmin[j], s[i][j]));
+            bboxmax[j] = std::min(j ? height-1.f : width-1.f, std::max(bboxmax[j], s[i][j]));
+        }
+    }
+    const Vec2f &A = s[0], &B = s[1], &C = s[2];
+    const float uz = (C.x-A.x)*(B.y-A.y) - (B.x-A.x)*(C.y-A.y);
+    if (std::abs(uz)<=1e-2) return;
+    const float inv_uz = 1.f/uz;
+    const int x0 = bboxmin.x, x1 = bboxmax.x, y0 = bboxmin.y, y1 = bboxmax.y;
+    // both edge functions are affine in the pixel position: evaluate them once per row, then step along x
+    const float dux = B.y-A.y, duy = -(C.y-A.y);
+    TGAColor color;
+    for (int y=y0; y<=y1; y++) {
+        float ux = (B.x-A.x)*(A.y-y) - (A.x-x0)*(B.y-A.y);
+        float uy = (A.x-x0)*(C.y-A.y) - (C.x-A.x)*(A.y-y);
+        float *zrow = zbuffer + y*width;
+        for (int x=x0; x<=x1; x++, ux+=dux, uy+=duy) {
+            Vec3f c(1.f-(ux+uy)*inv_uz, uy*inv_uz, ux*inv_uz);
+            if (c.x<0 || c.y<0 || c.z<0) continue;
+            float z = pts[0][2]*c.x + pts[1][2]*c.y + pts[2][2]*c.z;
+            float w = pts[0][3]*c.x + pts[1][3]*c.y + pts[2][3]*c.z;
+            int frag_depth = z/w;
+            if (stats) stats->pixels_tested++;
+            if (zrow[x]>frag_depth) {
+                if (stats) stats->pixels_depth_rejected++;
+                continue;
+            }
+            if (!(stats ? counted_fragment(shader, c, color, stats, x+(size_t)y*width) : shader.fragment(c, color))) {
+                zrow[x] = frag_depth;
+                image.set(x, y, color);
+            }
+        }
+    }
+}
+
+// the coverage and edge stepping of triangle_fast(); fragments behind the opaque depth are rejected with the
+// same rule, the others go to the OIT buffer with their unrounded depth so that close layers still sort
+void triangle_oit(Vec4f *pts, IShader &shader, OITBuffer &oit, const float *zbuffer, PipelineStats *stats) {
+    const int width = oit.width(), height = oit.height();
+    if (stats) count_triangle(stats, pts, width, height);
+    Vec2f s[3];
+    for (int i=0; i<3; i++) s[i] = proj<2>(pts[i]/pts[i][3]);
+    Vec2f bboxmin(width-1, height-1);
+    Vec2f bboxmax(0, 0);
+    for (int i=0; i<3; i++) {
+        for (int j=0; j<2; j++) {
+            bboxmin[j] = std::max(0.f, std::min(bboxmin[j], s[i][j]));
+            bboxmax[j] = std::min(j ? height-1.f : width-1.f, std::max(bboxmax[j], s[i][j]));
+        }
+    }
+    const Vec2f &A = s[0], &B = s[1], &C = s[2];
+    const float uz = (C.x-A.x)*(B.y-A.y) - (B.x-A.x)*(C.y-A.y);
+    if (std::abs(uz)<=1e-2) return;
+    const float inv_uz = 1.f/uz;
+    const int x0 = bboxmin.x, x1 = bboxmax.x, y0 = bboxmin.y, y1 = bboxmax.y;
+    const float dux = B.y-A.y, duy = -(C.y-A.y);
+    TGAColor color;
+    for (int y=y0; y<=y1; y++) {
+        float ux = (B.x-A.x)*(A.y-y) - (A.x-x0)*(B.y-A.y);
+        float uy = (A.x-x0)*(C.y-A.y) - (C.x-A.x)*(A.y-y);
+        const float *zrow = zbuffer + y*width;
+        for (int x=x0; x<=x1; x++, ux+=dux, uy+=duy) {
+            Vec3f c(1.f-(ux+uy)*inv_uz, uy*inv_uz, ux*inv_uz);
+            if (c.x<0 || c.y<0 || c.z<0) continue;
+            float z = pts[0][2]*c.x + pts[1][2]*c.y + pts[2][2]*c.z;
+            float w = pts[0][3]*c.x + pts[1][3]*c.y + pts[2][3]*c.z;
+            if (stats) stats->pixels_tested++;
+            if (zrow[x]>(int)(z/w)) {
+                if (stats) stats->pixels_depth_rejected++;
+                continue;
+            }
+            color = TGAColor(0, 0, 0, 255);
+            if (stats ? counted_fragment(shader, c, color, stats, x+(size_t)y*width) : shader.fragment(c, color)) continue;
+            if (color.bgra[3]) oit.insert(x, y, z/w, color);
+        }
+    }
+}
+
+void triangle_depth(Vec4f *pts, float *zbuffer, int width, int height) {
+    Vec2f s[3];
+    for (int i=0; i<3; i++) s[i] = proj<2>(pts[i]/pts[i][3]);
+    Vec2f bboxmin(width-1, height-1);
+    Vec2f bboxmax(0, 0);
+    for (int i=0; i<3; i++) {
+        for (int j=0; j<2; j++) {
+            bboxmin[j] = std::max(0.f, std::min(bboxmin[j], s[i][j]));
+            bboxmax[j] = std::min(j ? height-1.f : width-1.f, std::max(bboxmax[j], s[i][j]));
+        }
+    }
+    // barycentric() with the per-triangle terms hoisted, the arithmetic is kept identical so that the
+    // depth values match what triangle() would have written
+    const Vec2f &A = s[0], &B = s[1], &C = s[2];
+    const float uz = (C.x-A.x)*(B.y-A.y) - (B.x-A.x)*(C.y-A.y);
+    if (std::abs(uz)<=1e-2) return;
+    Vec2i P;
+    for (P.x=bboxmin.x; P.x<=bboxmax.x; P.x++) {
+        for (P.y=bboxmin.y; P.y<=bboxmax.y; P.y++) {
+            const float ux = (B.x-A.x)*(A.y-P.y) - (A.x-P.x)*(B.y-A.y);
+            const float uy = (A.x-P.x)*(C.y-A.y) - (C.x-A.x)*(A.y-P.y);
+            Vec3f c(1.f-(ux+uy)/uz, uy/uz, ux/uz);
+            if (c.x<0 || c.y<0 || c.z<0) continue;
+            float z = pts[0][2]*c.x + pts[1][2]*c.y + pts[2][2]*c.z;
+            float w = pts[0][3]*c.x + pts[1][3]*c.y + pts[2][3]*c.z;
+            int frag_depth = z/w;
+            float &zb = zbuffer[P.x+P.y*width];
+            if (zb<=frag_depth) zb = frag_depth;
+        }
+    }
+}
+
+// sample positions within the pixel, in 1/16 units around the pixel sample point (the 4x and 8x D3D patterns)
+static const Vec2f msaa4[4] = {Vec2f(-2/16.f, -6/16.f), Vec2f(6/16.f, -2/16.f), Vec2f(-6/16.f, 2/16.f), Vec2f(2/16.f, 6/16.f)};
+static const Vec2f msaa8[8] = {Vec2f(1/16.f, -3/16.f), Vec2f(-1/16.f, 3/16.f), Vec2f(5/16.f, 1/16.f), Vec2f(-3/16.f, -5/16.f),
+                               Vec2f(-5/16.f, 5/16.f), Vec2f(-7/16.f, -1/16.f), Vec2f(3/16.f, 7/16.f), Vec2f(7/16.f, -7/16.f)};
+
+MSAATarget::MSAATarget(int w, int h, int nsamples) : width(w), height(h), samples(nsamples>4 ? 8 : 4), depth(), color() {
+    depth.resize((size_t)width*height*samples);
+    color.resize((size_t)width*height*samples*4);
+    clear();
+}
+
+void MSAATarget::clear() {
+    std::fill(depth.begin(), depth.end(), -std::numeric_limits<float>::max());
+    std::fill(color.begin(), color.end(), 0);
+}
+
+const Vec2f &MSAATarget::offset(int s) const {
+    return samples==8 ? msaa8[s] : msaa4[s];
+}
+
+size_t MSAATarget::memory() const {
+    return depth.size()*sizeof(float) + color.size();
+}
+
+void MSAATarget::resolve(TGAImage &image) const {
+    const int shift = samples==8 ? 3 : 2;
+#pragma omp parallel for
+    for (int y=0; y<height; y++) {
+        for (int x=0; x<width; x++) {
+            const unsigned char *p = &color[((size_t)x+y*width)*samples*4];
+            int sum[4] = {0, 0, 0, 0};
+            for (int s=0; s<samples; s++)
+                for (int c=0; c<4; c++) sum[c] += p[s*4+c];
+            const int round = 1<<(shift-1);
+            image.set(x, y, TGAColor((sum[2]+round)>>shift, (sum[1]+round)>>shift, (sum[0]+round)>>shift, (sum[3]+round)>>shift));
+        }
+    }
+}
+
+void MSAATarget::resolve_depth(float *zbuffer) const {
+    for (int i=0; i<width*height; i++)
+        zbuffer[i] = *std::max_element(&depth[(size_t)i*samples], &depth[(size_t)i*samples]+samples);
+}
+
+void triangle_msaa(Vec4f *pts, IShader &shader, MSAATarget &target, PipelineStats *stats) {
+    if (stats) count_triangle(stats, pts, target.width, target.height);
+    Vec2f s[3];
+    for (int i=0; i<3; i++) s[i] = proj<2>(pts[i]/pts[i][3]);
+    // the samples reach half a pixel away from the pixel sample point
+    Vec2f bboxmin(target.width-1, target.height-1);
+    Vec2f bboxmax(0, 0);
+    for (int i=0; i<3; i++) {
+        for (int j=0; j<2; j++) {
+            bboxmin[j] = std::max(0.f, std::min(bboxmin[j], s[i][j]-.5f));
+            bboxmax[j] = std::min(j ? target.height-1.f : target.width-1.f, std::max(bboxmax[j], s[i][j]+.5f));
+        }
+    }
+    const Vec2f &A = s[0], &B = s[1], &C = s[2];
+    const float uz = (C.x-A.x)*(B.y-A.y) - (B.x-A.x)*(C.y-A.y);
+    if (std::abs(uz)<=1e-2) return;
+    const int ns = target.samples;
+    TGAColor color;
+    for (int x=std::ceil(bboxmin.x); x<=bboxmax.x; x++) {
+        for (int y=std::ceil(bboxmin.y); y<=bboxmax.y; y++) {
+            // coverage and depth test of every sample
+            float *zb = &target.depth[((size_t)x+y*target.width)*ns];
+            float sample_depth[8];
+            Vec3f first;
+            int mask = 0;
+            bool covered = false;
+            for (int k=0; k<ns; k++) {
+                const float px = x+target.offset(k).x, py = y+target.offset(k).y;
+                const float ux = (B.x-A.x)*(A.y-py) - (A.x-px)*(B.y-A.y);
+                const float uy = (A.x-px)*(C.y-A.y) - (C.x-A.x)*(A.y-py);
+                Vec3f c(1.f-(ux+uy)/uz, uy/uz, ux/uz);
+                if (c.x<0 || c.y<0 || c.z<0) continue;
+                covered = true;
+                float z = pts[0][2]*c.x + pts[1][2]*c.y + pts[2][2]*c.z;
+                float w = pts[0][3]*c.x + pts[1][3]*c.y + pts[2][3]*c.z;
+                sample_depth[k] = z/w;
+                if (zb[k]>sample_depth[k]) continue;
+                if (!mask) first = c;
+                mask |= 1<<k;
+            }
+            if (stats && covered) {
+                stats->pixels_tested++;
+                if (!mask) stats->pixels_depth_rejected++;
+            }
+            if (!mask) continue;
+            // shade once, at the pixel sample point when it lies inside the triangle, at a covered sample otherwise
+            const float ux = (B.x-A.x)*(A.y-y) - (A.x-x)*(B.y-A.y);
+            const float uy = (A.x-x)*(C.y-A.y) - (C.x-A.x)*(A.y-y);
+            Vec3f c(1.f-(ux+uy)/uz, uy/uz, ux/uz);
+            if (c.x<0 || c.y<0 || c.z<0) c = first;
+            if (stats ? counted_fragment(shader, c, color, stats, x+(size_t)y*target.width) : shader.fragment(c, color)) continue;
+            unsigned char *p = &target.color[((size_t)x+y*target.width)*ns*4];
+            for (int k=0; k<ns; k++) {
+                if (!(mask&(1<<k))) continue;
+                zb[k] = sample_depth[k];
+                memcpy(p+k*4, color.bgra, 4);
+            }
+        }
+    }
+}
@@ -1,23 +1,88 @@
 #ifndef __OUR_GL_H__
 #define __OUR_GL_H__
+#include <vector>
 #include "tgaimage.h"
+#include "framebuffer.h"
 #include "geometry.h"
 
-extern Matrix ModelView;
-extern Matrix Viewport;
-extern Matrix Projection;
+struct PipelineStats;
+class OITBuffer;
+
 const float depth = 2000.f;
 
-void viewport(int x, int y, int w, int h);
-void projection(float coeff=0.f); // coeff = -1/c
-void lookat(Vec3f eye, Vec3f center, Vec3f up);
+// Transforms, camera and light of one frame. Each frame in flight owns its context, so that
+// several frames can render concurrently.
+struct RenderContext {
+    RenderContext();
+    Matrix ModelView;
+    Matrix Viewport;
+    Matrix Projection;
+    Vec3f eye;
+    Vec3f center;
+    Vec3f up;
+    Vec3f light_dir;
+};
+
+void viewport(RenderContext &ctx, int x, int y, int w, int h);
+void projection(RenderContext &ctx, float coeff=0.f); // coeff = -1/c
+void lookat(RenderContext &ctx, Vec3f eye, Vec3f center, Vec3f up);
+
+// x^e for the integer exponents 0..255 of 8-bit specular maps, by binary exponentiation: at most 8 squarings
+// and 8 multiplies instead of a log/exp pair. Relative error against std::pow stays below e*2^-24 (< 1.6e-5),
+// enforced by check_spec_pow in bench/bench.cpp ("make check").
+inline float spec_pow(float x, int e) {
+    float r = 1.f;
+    for (; e>0; e>>=1, x*=x)
+        if (e&1) r *= x;
+    return r;
+}
 
 struct IShader {
     virtual ~IShader();
+    // evaluates per-draw constants from the uniforms, call it after setting them and before the first vertex()
+    virtual void prepare();
     virtual Vec4f vertex(int iface, int nthvert) = 0;
     virtual bool fragment(Vec3f bar, TGAColor &color) = 0;
+    // linear, unclamped RGBA output for the float framebuffer; by default decodes what fragment() writes.
+    // gamma: the decode table of the gamma the frame is encoded with
+    virtual bool fragment_hdr(Vec3f bar, const GammaTable &gamma, Vec4f &color);
+};
+
+// barycentric coordinates of P in triangle ABC, negative ones when P is outside or ABC is degenerate
+Vec3f barycentric(Vec2f A, Vec2f B, Vec2f C, Vec2f P);
+// the color rasterizers update stats when it is not NULL (see stats.h); the counting stays out of the way otherwise
+void triangle(Vec4f *pts, IShader &shader, TGAImage &image, float *zbuffer, PipelineStats *stats=NULL);
+// same coverage and depth rule as triangle(), shading through fragment_hdr() into a float framebuffer
+void triangle_hdr(Vec4f *pts, IShader &shader, FloatImage &image, float *zbuffer, const GammaTable &gamma,
+                  PipelineStats *stats=NULL);
+// Optimized counterpart of triangle(): bounding box clipped to the target, edge functions stepped
+// incrementally along rows and a reciprocal instead of divisions. Rounding differs slightly from the
+// reference, so it is checked against triangle() with --diff before being relied upon.
+void triangle_fast(Vec4f *pts, IShader &shader, TGAImage &image, float *zbuffer, PipelineStats *stats=NULL);
+// translucent pass: depth-tested against the opaque zbuffer without writing it, fragments with a non-zero
+// alpha (color[3], the opacity) are stored in the OIT buffer, which has the size of the target
+void triangle_oit(Vec4f *pts, IShader &shader, OITBuffer &oit, const float *zbuffer, PipelineStats *stats=NULL);
+// depth-only rasterization (e.g. shadow maps): same coverage and depth rule as triangle(), but no color target and no fragment shader
+void triangle_depth(Vec4f *pts, float *zbuffer, int width, int height);
+
+// Multisampled color and depth target: every pixel keeps 4 or 8 samples (standard rotated-grid positions),
+// coverage and depth are tested per sample, while the fragment shader runs once per pixel per triangle.
+struct MSAATarget {
+    MSAATarget(int w, int h, int nsamples);
+    void clear();
+    // average of the samples of each pixel
+    void resolve(TGAImage &image) const;
+    // closest sample of each pixel, for passes working on the depth buffer (SSAO)
+    void resolve_depth(float *zbuffer) const;
+    const Vec2f &offset(int s) const;
+    size_t memory() const;
+
+    int width, height, samples;
+    std::vector<float> depth;          // samples per pixel, pixel-major
+    std::vector<unsigned char> color;  // BGRA per sample, same layout as depth
 };
 
-void triangle(Vec4f *pts, IShader &shader, TGAImage &image, float *zbuffer);
+// a pixel counts as tested when any of its samples is covered, and as depth-rejected when all covered ones fail
+void triangle_msaa(Vec4f *pts, IShader &shader, MSAATarget &target, PipelineStats *stats=NULL);
 #endif //__OUR_GL_H__
 
@@ -0,0 +1,211 @@
+#include <cmath>
+#include <algorithm>
+#include <cstring>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "postfx.h"
+#include "timer.h"
+
+// out[x..x+3] = sum_k w[k]*in[x+k..x+k+3]: the taps of the horizontal pass are unaligned loads of the padded row
+static void convolve_row(const float *in, const std::vector<float> &w, float *out, int n) {
+    const int taps = (int)w.size();
+    int x = 0;
+#ifdef __SSE2__
+    for (; x+4<=n; x+=4) {
+        __m128 acc = _mm_setzero_ps();
+        for (int k=0; k<taps; k++)
+            acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(w[k]), _mm_loadu_ps(in+x+k)));
+        _mm_storeu_ps(out+x, acc);
+    }
+#endif
+    for (; x<n; x++) {
+        float acc = 0.f;
+        for (int k=0; k<taps; k++) acc += w[k]*in[x+k];
+        out[x] = acc;
+    }
+}
+
+// out = sum_k w[k]*rows[k], 4 columns at a time
+static void combine_rows(const float *const *rows, const std::vector<float> &w, float *out, int n) {
+    const int taps = (int)w.size();
+    int x = 0;
+#ifdef __SSE2__
+    for (; x+4<=n; x+=4) {
+        __m128 acc = _mm_setzero_ps();
+        for (int k=0; k<taps; k++)
+            acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(w[k]), _mm_loadu_ps(rows[k]+x)));
+        _mm_storeu_ps(out+x, acc);
+    }
+#endif
+    for (; x<n; x++) {
+        float acc = 0.f;
+        for (int k=0; k<taps; k++) acc += w[k]*rows[k][x];
+        out[x] = acc;
+    }
+}
+
+void gaussian_blur(FloatImage &img, float sigma) {
+    if (sigma<=0.f || !img.width() || !img.height()) return;
+    const int r = (int)std::ceil(3.f*sigma);
+    std::vector<float> w(2*r+1);
+    float sum = 0.f;
+    for (int k=-r; k<=r; k++) sum += w[k+r] = std::exp(-k*k/(2.f*sigma*sigma));
+    for (int k=0; k<2*r+1; k++) w[k] /= sum;
+
+    const int width = img.width(), height = img.height(), stride = img.stride();
+    FloatImage tmp(width, height);
+    // horizontal pass: each row is copied with r clamped pixels on both sides
+#pragma omp parallel
+    {
+        std::vector<float> padded(stride+2*r+4);
+#pragma omp for
+        for (int i=0; i<3*height; i++) {
+            const float *src = img.row(i/height, i%height);
+            for (int x=-r; x<stride+r; x++)
+                padded[x+r] = src[std::max(0, std::min(width-1, x))];
+            convolve_row(&padded[0], w, tmp.row(i/height, i%height), stride);
+        }
+    }
+    // vertical pass: the taps are whole rows, clamped at the top and bottom
+#pragma omp parallel
+    {
+        std::vector<const float *> rows(2*r+1);
+#pragma omp for
+        for (int i=0; i<3*height; i++) {
+            const int c = i/height, y = i%height;
+            for (int k=-r; k<=r; k++)
+                rows[k+r] = tmp.row(c, std::max(0, std::min(height-1, y+k)));
+            combine_rows(&rows[0], w, img.row(c, y), stride);
+        }
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+
+PostPass::~PostPass() {}
+
+BloomPass::BloomPass(const FloatImage &emissive, float intensity, float sigma) : emissive_(emissive), intensity_(intensity), sigma_(sigma), half_() {}
+
+const char *BloomPass::name() const {
+    return "bloom";
+}
+
+void BloomPass::apply(FloatImage &img) {
+    const int w = emissive_.width(), h = emissive_.height();
+    if (w!=img.width() || h!=img.height()) return;
+    // 2x2 box downsample, blur, then bilinear upsample added onto the image together with the emissive term itself
+    const int hw = (w+1)/2, hh = (h+1)/2;
+    half_.resize(hw, hh);
+#pragma omp parallel for
+    for (int i=0; i<3*hh; i++) {
+        const int c = i/hh, y = i%hh;
+        const float *s0 = emissive_.row(c, 2*y), *s1 = emissive_.row(c, std::min(h-1, 2*y+1));
+        float *d = half_.row(c, y);
+        for (int x=0; x<hw; x++) {
+            const int x1 = std::min(w-1, 2*x+1);
+            d[x] = .25f*(s0[2*x]+s0[x1]+s1[2*x]+s1[x1]);
+        }
+    }
+    gaussian_blur(half_, sigma_*.5f);
+#pragma omp parallel for
+    for (int i=0; i<3*h; i++) {
+        const int c = i/h, y = i%h;
+        const float fy = std::max(0.f, (y+.5f)*.5f-.5f);
+        const int y0 = std::min(hh-1, (int)fy), y1 = std::min(hh-1, y0+1);
+        const float ty = fy-y0;
+        const float *r0 = half_.row(c, y0), *r1 = half_.row(c, y1);
+        const float *e = emissive_.row(c, y);
+        float *d = img.row(c, y);
+        for (int x=0; x<w; x++) {
+            const float fx = std::max(0.f, (x+.5f)*.5f-.5f);
+            const int x0 = std::min(hw-1, (int)fx), x1 = std::min(hw-1, x0+1);
+            const float tx = fx-x0;
+            const float top = r0[x0]+(r0[x1]-r0[x0])*tx, bottom = r1[x0]+(r1[x1]-r1[x0])*tx;
+            d[x] += e[x] + intensity_*(top+(bottom-top)*ty);
+        }
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+
+bool parse_tonemap(const char *name, Tonemap &op) {
+    if (!strcmp(name, "none"))     { op = TONEMAP_NONE;     return true; }
+    if (!strcmp(name, "reinhard")) { op = TONEMAP_REINHARD; return true; }
+    if (!strcmp(name, "aces"))     { op = TONEMAP_ACES;     return true; }
+    return false;
+}
+
+TonemapPass::TonemapPass(Tonemap op, float exposure) : op_(op), exposure_(exposure) {}
+
+const char *TonemapPass::name() const {
+    return "tonemap";
+}
+
+void TonemapPass::apply(FloatImage &img) {
+    const int n = img.stride();
+    const float white2 = 16.f; // extended Reinhard, a linear value of 4 maps to white
+    const float vmax = 1e4f;   // both curves are past white here; clamping keeps inf or a huge exposure from giving
+                               // inf/inf, and negative values from the ACES fit mapping them to white
+#pragma omp parallel for
+    for (int i=0; i<3*img.height(); i++) {
+        float *p = img.row(i/img.height(), i%img.height());
+        int x = 0;
+#ifdef __SSE2__
+        const __m128 e = _mm_set1_ps(exposure_), one = _mm_set1_ps(1.f), zero = _mm_setzero_ps(), top = _mm_set1_ps(vmax);
+        for (; x+4<=n; x+=4) {
+            __m128 v = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(p+x), e), zero), top); // NaN becomes 0
+            if (op_==TONEMAP_REINHARD) {
+                v = _mm_div_ps(_mm_mul_ps(v, _mm_add_ps(one, _mm_mul_ps(v, _mm_set1_ps(1.f/white2)))), _mm_add_ps(one, v));
+            } else if (op_==TONEMAP_ACES) { // Narkowicz's fit of the ACES filmic curve
+                __m128 num = _mm_mul_ps(v, _mm_add_ps(_mm_mul_ps(v, _mm_set1_ps(2.51f)), _mm_set1_ps(.03f)));
+                __m128 den = _mm_add_ps(_mm_mul_ps(v, _mm_add_ps(_mm_mul_ps(v, _mm_set1_ps(2.43f)), _mm_set1_ps(.59f))), _mm_set1_ps(.14f));
+                v = _mm_div_ps(num, den);
+            }
+            _mm_storeu_ps(p+x, v);
+        }
+#endif
+        for (; x<n; x++) {
+            float v = std::min(std::max(p[x]*exposure_, 0.f), vmax); // NaN stays NaN, to_tga makes it black
+            if (op_==TONEMAP_REINHARD)
+                v = v*(1.f+v/white2)/(1.f+v);
+            else if (op_==TONEMAP_ACES)
+                v = v*(2.51f*v+.03f)/(v*(2.43f*v+.59f)+.14f);
+            p[x] = v;
+        }
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+
+PostChain::PostChain() : passes_(), ms_() {}
+
+PostChain::~PostChain() {
+    for (size_t i=0; i<passes_.size(); i++) delete passes_[i];
+}
+
+void PostChain::add(PostPass *pass) {
+    passes_.push_back(pass);
+    ms_.push_back(0.);
+}
+
+bool PostChain::empty() const {
+    return passes_.empty();
+}
+
+void PostChain::run(FloatImage &img) {
+    for (size_t i=0; i<passes_.size(); i++) {
+        double t0 = wall_time();
+        passes_[i]->apply(img);
+        ms_[i] = (wall_time()-t0)*1000.;
+    }
+}
+
+void PostChain::report(std::ostream &out) const {
+    double total = 0.;
+    for (size_t i=0; i<ms_.size(); i++) total += ms_[i];
+    out << ", post " << total << " ms (";
+    for (size_t i=0; i<passes_.size(); i++)
+        out << (i ? ", " : "") << passes_[i]->name() << " " << ms_[i];
+    out << ")";
+}
@@ -0,0 +1,63 @@
+#ifndef __POSTFX_H__
+#define __POSTFX_H__
+#include <vector>
+#include <ostream>
+#include "framebuffer.h"
+
+// separable gaussian blur of the three channels, edges clamped
+void gaussian_blur(FloatImage &img, float sigma);
+
+// one step of the post-processing chain, working in place on the linear framebuffer
+class PostPass {
+public:
+    virtual ~PostPass();
+    virtual const char *name() const = 0;
+    virtual void apply(FloatImage &img) = 0;
+};
+
+// adds the emissive buffer (glow maps) and a blurred copy of it; the blur runs at half resolution
+class BloomPass : public PostPass {
+public:
+    BloomPass(const FloatImage &emissive, float intensity=1.5f, float sigma=8.f);
+    virtual const char *name() const;
+    virtual void apply(FloatImage &img);
+private:
+    const FloatImage &emissive_;
+    float intensity_;
+    float sigma_; // in full resolution pixels
+    FloatImage half_;
+};
+
+enum Tonemap {
+    TONEMAP_NONE, TONEMAP_REINHARD, TONEMAP_ACES
+};
+bool parse_tonemap(const char *name, Tonemap &op);
+
+// exposure, then maps [0,inf) to [0,1)
+class TonemapPass : public PostPass {
+public:
+    TonemapPass(Tonemap op=TONEMAP_ACES, float exposure=1.f);
+    virtual const char *name() const;
+    virtual void apply(FloatImage &img);
+private:
+    Tonemap op_;
+    float exposure_;
+};
+
+// ordered list of passes, owns them; keeps the time spent in each pass during the last run
+class PostChain {
+public:
+    PostChain();
+    ~PostChain();
+    void add(PostPass *pass);
+    bool empty() const;
+    void run(FloatImage &img);
+    void report(std::ostream &out) const; // ", post X ms (bloom a, tonemap b, ...)"
+private:
+    std::vector<PostPass *> passes_;
+    std::vector<double> ms_;
+    PostChain(const PostChain &);
+    PostChain &operator=(const PostChain &);
+};
+
+#endif //__POSTFX_H__
@@ -0,0 +1,1027 @@
+#include <iostream>
+#include <sstream>
+#include <limits>
+#include <climits>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+
+#include "renderer.h"
+#include "our_gl.h"
+#include "shaders.h"
+#include "framebuffer.h"
+#include "timer.h"
+
+static const char *shadow_filter_names[] = {"hard", "pcf", "vsm"};
+
+RenderSettings::RenderSettings()
+    : width(800), height(800), band_height(0), shader("shadow"), shadow_size(800), shadow_reuse(0.f), shadow_filter(SHADOW_HARD), shadow_rays(false), shadow_ray_params(), pcf_size(5), vsm_blur(2),
+      shadow_bias(50.f), ssao(false), ssao_params(), nlights(64), light_tile(16), hdr(false), post(false), bloom_intensity(1.5f),
+      bloom_sigma(8.f), tonemap(TONEMAP_ACES), exposure(1.f), gamma(2.2f), msaa(0), ssaa(1), fast_raster(false), diff(false), diff_tolerance(),
+      dump_depth(false), stats(false), heatmap(HEATMAP_NONE),
+      virtual_textures(false),
+      vt_budget_mb(16), translucent(), opacity(.35f), oit_mode(OIT_LISTS), oit_k(8), oit_budget_mb(16)
+{
+}
+
+bool parse_render_option(RenderSettings &s, int argc, char **argv, int &i, bool &ok, std::ostream &err)
+{
+    ok = true;
+    const bool has_value = i + 1 < argc;
+    if (!strcmp(argv[i], "--size") && has_value)
+    {
+        ++i;
+        if (sscanf(argv[i], "%dx%d", &s.width, &s.height) != 2 || s.width < 1 || s.height < 1 || s.width > 65535 || s.height > 65535)
+        {
+            err << "invalid image size " << argv[i] << " (expected WxH, at most 65535x65535)" << std::endl;
+            ok = false;
+        }
+    }
+    else if (!strcmp(argv[i], "--band-height") && has_value)
+        s.band_height = std::max(0, atoi(argv[++i]));
+    else if (!strcmp(argv[i], "--shadow-size") && has_value)
+        s.shadow_size = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--shadow-reuse") && has_value)
+        s.shadow_reuse = atof(argv[++i]) * 3.14159265f / 180.f;
+    else if (!strcmp(argv[i], "--shadow-filter") && has_value)
+    {
+        if (!parse_shadow_filter(argv[++i], s.shadow_filter))
+        {
+            err << "unknown shadow filter " << argv[i] << " (expected hard, pcf or vsm)" << std::endl;
+            ok = false;
+        }
+    }
+    else if (!strcmp(argv[i], "--shadows") && has_value)
+    {
+        ++i;
+        if (!strcmp(argv[i], "map") || !strcmp(argv[i], "ray"))
+            s.shadow_rays = !strcmp(argv[i], "ray");
+        else
+        {
+            err << "unknown shadow method " << argv[i] << " (expected map or ray)" << std::endl;
+            ok = false;
+        }
+    }
+    else if (!strcmp(argv[i], "--shadow-rays") && has_value)
+        s.shadow_rays = true, s.shadow_ray_params.samples = std::max(1, atoi(argv[++i]));
+    else if (!strcmp(argv[i], "--light-size") && has_value)
+        s.shadow_rays = true, s.shadow_ray_params.light_size = atof(argv[++i]) * 3.14159265f / 180.f;
+    else if (!strcmp(argv[i], "--ray-bias") && has_value)
+        s.shadow_rays = true, s.shadow_ray_params.bias = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--pcf-size") && has_value)
+    {
+        s.pcf_size = atoi(argv[++i]);
+        if (s.pcf_size < 0 || s.pcf_size > 255) // 核为(size/2*2+1)^2个纹素
+        {
+            err << "invalid PCF kernel size " << argv[i] << " (expected 0 to 255)" << std::endl;
+            ok = false;
+        }
+    }
+    else if (!strcmp(argv[i], "--vsm-blur") && has_value)
+        s.vsm_blur = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--shadow-bias") && has_value)
+        s.shadow_bias = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--shader") && has_value)
+    {
+        s.shader = argv[++i];
+        if (std::find(shader_names, shader_names + nshaders, s.shader) == shader_names + nshaders)
+        {
+            err << "unknown shader " << s.shader << std::endl;
+            ok = false;
+        }
+    }
+    else if (!strcmp(argv[i], "--lights") && has_value)
+        s.nlights = std::max(0, atoi(argv[++i]));
+    else if (!strcmp(argv[i], "--light-tile") && has_value)
+        s.light_tile = std::max(1, atoi(argv[++i]));
+    else if (!strcmp(argv[i], "--hdr"))
+        s.hdr = true;
+    else if (!strcmp(argv[i], "--post"))
+        s.post = true;
+    else if (!strcmp(argv[i], "--bloom-intensity") && has_value)
+        s.post = true, s.bloom_intensity = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--bloom-radius") && has_value)
+        s.post = true, s.bloom_sigma = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--tonemap") && has_value)
+    {
+        s.post = true;
+        if (!parse_tonemap(argv[++i], s.tonemap))
+        {
+            err << "unknown tone mapping operator " << argv[i] << " (expected none, reinhard or aces)" << std::endl;
+            ok = false;
+        }
+    }
+    else if (!strcmp(argv[i], "--exposure") && has_value)
+        s.post = true, s.exposure = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--gamma") && has_value)
+        s.post = true, s.gamma = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--msaa") && has_value)
+    {
+        s.msaa = atoi(argv[++i]);
+        if (s.msaa != 4 && s.msaa != 8)
+        {
+            err << "unsupported sample count " << argv[i] << " (expected 4 or 8)" << std::endl;
+            ok = false;
+        }
+    }
+    else if (!strcmp(argv[i], "--ssaa") && has_value)
+        s.ssaa = std::max(1, atoi(argv[++i]));
+    else if (!strcmp(argv[i], "--raster") && has_value)
+    {
+        ++i;
+        if (!strcmp(argv[i], "fast") || !strcmp(argv[i], "reference"))
+            s.fast_raster = !strcmp(argv[i], "fast");
+        else
+        {
+            err << "unknown rasterizer " << argv[i] << " (expected reference or fast)" << std::endl;
+            ok = false;
+        }
+    }
+    else if (!strcmp(argv[i], "--diff"))
+        s.diff = true;
+    else if (!strcmp(argv[i], "--diff-color") && has_value)
+        s.diff = true, s.diff_tolerance.color = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--diff-depth") && has_value)
+        s.diff = true, s.diff_tolerance.depth = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--diff-max-bad") && has_value)
+        s.diff = true, s.diff_tolerance.max_bad_percent = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--ssao"))
+        s.ssao = true;
+    else if (!strcmp(argv[i], "--ssao-half"))
+        s.ssao = s.ssao_params.half_res = true;
+    else if (!strcmp(argv[i], "--ssao-radius") && has_value)
+        s.ssao_params.radius = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--ssao-depth-scale") && has_value)
+    {
+        s.ssao_params.depth_scale = atof(argv[++i]);
+        if (!(s.ssao_params.depth_scale > 0.f && s.ssao_params.depth_scale < 1e6f))
+        {
+            err << "invalid SSAO depth scale " << argv[i] << " (expected a positive number of depth units per pixel)" << std::endl;
+            ok = false;
+        }
+    }
+    else if (!strcmp(argv[i], "--ssao-directions") && has_value)
+        s.ssao_params.directions = std::max(1, atoi(argv[++i]));
+    else if (!strcmp(argv[i], "--ssao-strength") && has_value)
+    {
+        s.ssao_params.strength = atof(argv[++i]);
+        if (!(s.ssao_params.strength >= 0.f && s.ssao_params.strength <= 1.f))
+        {
+            err << "invalid SSAO strength " << argv[i] << " (expected 0 to 1)" << std::endl;
+            ok = false;
+        }
+    }
+    else if (!strcmp(argv[i], "--dump-depth"))
+        s.dump_depth = true;
+    else if (!strcmp(argv[i], "--stats"))
+        s.stats = true;
+    else if (!strcmp(argv[i], "--heatmap") && has_value)
+    {
+        s.stats = true;
+        if (!parse_heatmap(argv[++i], s.heatmap))
+        {
+            err << "unknown heatmap " << argv[i] << " (expected overdraw or cost)" << std::endl;
+            ok = false;
+        }
+    }
+    else if (!strcmp(argv[i], "--virtual-textures"))
+        s.virtual_textures = true;
+    else if (!strcmp(argv[i], "--vt-budget") && has_value)
+    {
+        s.virtual_textures = true;
+        s.vt_budget_mb = atoi(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "--translucent") && has_value)
+        s.translucent.push_back(argv[++i]);
+    else if (!strcmp(argv[i], "--opacity") && has_value)
+        s.opacity = std::max(0.f, std::min(1.f, (float)atof(argv[++i])));
+    else if (!strcmp(argv[i], "--oit") && has_value)
+    {
+        if (!parse_oit_mode(argv[++i], s.oit_mode))
+        {
+            err << "unknown OIT mode " << argv[i] << " (expected lists or kbuffer)" << std::endl;
+            ok = false;
+        }
+    }
+    else if (!strcmp(argv[i], "--oit-k") && has_value)
+        s.oit_mode = OIT_KBUFFER, s.oit_k = std::max(1, std::min(255, atoi(argv[++i])));
+    else if (!strcmp(argv[i], "--oit-budget") && has_value)
+        s.oit_budget_mb = std::max(1, atoi(argv[++i]));
+    else
+        return false;
+    return true;
+}
+
+bool check_render_settings(const RenderSettings &s, std::ostream &err)
+{
+    if (s.msaa && s.ssaa > 1)
+    {
+        err << "--msaa and --ssaa are exclusive" << std::endl;
+        return false;
+    }
+    if (s.msaa && s.hdr)
+    {
+        err << "--msaa is not supported with --hdr" << std::endl;
+        return false;
+    }
+    // 屏幕空间的滤波（SSAO、泛光）会跨越带的边界，整帧的诊断图也需要整幅图像
+    if (s.band_height && (s.ssao || s.post || s.diff || s.heatmap != HEATMAP_NONE))
+    {
+        err << "--band-height is not supported with --ssao, --post, --diff or --heatmap" << std::endl;
+        return false;
+    }
+    if ((s.fast_raster || s.diff) && (s.msaa || s.hdr))
+    {
+        err << "--raster fast and --diff only cover the 8-bit path (no --msaa or --hdr)" << std::endl;
+        return false;
+    }
+    if (!(s.gamma > 0.f && s.gamma < 100.f))
+    {
+        err << "--gamma must be between 0 and 100 (exclusive)" << std::endl;
+        return false;
+    }
+    // 图像缓冲的大小与像素下标都按int计算：渲染目标（分带时为一带）每个采样4字节，总字节数不能超过INT_MAX
+    const double rows = s.band_height ? std::min(s.band_height, s.height) : s.height;
+    if ((double)s.width * s.ssaa * rows * s.ssaa * 4. * std::max(1, s.msaa) > INT_MAX)
+    {
+        if (s.band_height)
+            err << "bands of " << s.band_height << " rows are too large for --size " << s.width << "x" << s.height
+                << " (use a smaller --band-height)" << std::endl;
+        else
+            err << "--size " << s.width << "x" << s.height << " is too large for a single render target (use --band-height)" << std::endl;
+        return false;
+    }
+    // 半透明片段的内存受--oit-budget限制：链表模式的片段池就是这么大（片段按int下标），
+    // k-buffer每个采样固定k个槽位，超出预算时拒绝而不是静默分配
+    if (!s.translucent.empty())
+    {
+        const double budget = (double)s.oit_budget_mb * (1 << 20), fragment = OITBuffer::fragment_bytes();
+        const double kbuffer = (double)s.width * s.ssaa * rows * s.ssaa * s.oit_k * fragment;
+        if (s.oit_mode == OIT_KBUFFER && kbuffer > budget)
+        {
+            err << "a k-buffer of " << s.oit_k << " fragments per sample needs " << (int)std::ceil(kbuffer / (1 << 20))
+                << " MB, more than --oit-budget " << s.oit_budget_mb << " (use a smaller --oit-k or a larger --oit-budget)" << std::endl;
+            return false;
+        }
+        if (s.oit_mode == OIT_LISTS && budget / fragment > INT_MAX)
+        {
+            err << "--oit-budget " << s.oit_budget_mb << " is too large, the fragment lists hold at most " << INT_MAX << " fragments" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+Frame::Frame() : index(0), image(NULL), shadow_depth(NULL), heatmap(NULL), diff(NULL), diff_failed(false), log() {}
+
+Frame::Frame(const Frame &other)
+    : index(other.index), image(other.image), shadow_depth(other.shadow_depth), heatmap(other.heatmap), diff(other.diff),
+      diff_failed(other.diff_failed), log(other.log)
+{
+}
+
+Frame &Frame::operator=(const Frame &other)
+{
+    index = other.index;
+    image = other.image;
+    shadow_depth = other.shadow_depth;
+    heatmap = other.heatmap;
+    diff = other.diff;
+    diff_failed = other.diff_failed;
+    log = other.log;
+    return *this;
+}
+
+// 调试用：把深度缓冲转成灰度图（与DepthShader的着色一致）
+static TGAImage *depth_image(const float *zbuffer, int w, int h)
+{
+    TGAImage *img = new TGAImage(w, h, TGAImage::RGB);
+    for (int y = 0; y < h; y++)
+        for (int x = 0; x < w; x++)
+        {
+            float z = zbuffer[x + y * w];
+            if (z > -std::numeric_limits<float>::max())
+                img->set(x, y, TGAColor(255, 255, 255) * (z / depth));
+        }
+    return img;
+}
+
+// 三角形的纹理足迹：一个像素覆盖的uv距离的log2，由uv面积与屏幕面积之比得到（整个三角形取同一值，
+// 在此精度下选mip层级足够）；退化的三角形不画像素，返回值无关紧要
+static float uv_footprint(Model *model, int iface, const Vec4f screen_coords[3])
+{
+    Vec2f s[3], t[3];
+    for (int j = 0; j < 3; j++)
+    {
+        s[j] = Vec2f(screen_coords[j][0] / screen_coords[j][3], screen_coords[j][1] / screen_coords[j][3]);
+        t[j] = model->uv(iface, j);
+    }
+    const float pixels = std::abs((s[1].x - s[0].x) * (s[2].y - s[0].y) - (s[2].x - s[0].x) * (s[1].y - s[0].y));
+    const float texels = std::abs((t[1].x - t[0].x) * (t[2].y - t[0].y) - (t[2].x - t[0].x) * (t[1].y - t[0].y));
+    return .5f * std::log(texels / pixels) / std::log(2.f);
+}
+
+// 绘制场景中的所有模型，并在tiles中标记画到的区域；stats非空时统计各阶段的数量与顶点着色的开销
+// faces非空时只画faces[m]中列出的第m个模型的面（分带渲染时落在当前带内的三角形）
+// hdr非空时画到浮点缓冲，8位颜色经gamma解码
+static void draw_scene(const std::vector<Model *> &scene, SceneShader &shader, DirtyTiles &tiles, TGAImage *image, FloatImage *hdr,
+                       const GammaTable &gamma, MSAATarget *msaa, float *zbuffer, bool fast = false, PipelineStats *stats = NULL, const std::vector<int> *faces = NULL)
+{
+    for (size_t m = 0; m < scene.size(); m++)
+    {
+        shader.model = scene[m];
+
+        Vec4f screen_coords[3];
+        const int n = faces ? faces[m].size() : shader.model->nfaces();
+        for (int f = 0; f < n; f++)
+        {
+            const int i = faces ? faces[m][f] : f;
+            const unsigned long t0 = stats ? cpu_ticks() : 0;
+            for (int j = 0; j < 3; j++)
+            {
+                screen_coords[j] = shader.vertex(i, j);
+            }
+            if (stats)
+                stats->vertex_ticks += cpu_ticks() - t0;
+            shader.uv_footprint = uv_footprint(shader.model, i, screen_coords);
+            tiles.touch(screen_coords);
+            if (msaa)
+                triangle_msaa(screen_coords, shader, *msaa, stats);
+            else if (hdr)
+                triangle_hdr(screen_coords, shader, *hdr, zbuffer, gamma, stats);
+            else if (fast)
+                triangle_fast(screen_coords, shader, *image, zbuffer, stats);
+            else
+                triangle(screen_coords, shader, *image, zbuffer, stats);
+        }
+    }
+}
+
+// 光线追踪阴影的深度预渲染：只写相机视角的深度，阴影光线从这些可见点出发
+static void depth_prepass(const std::vector<Model *> &scene, const Matrix &M, DepthBuffer &zbuffer, const std::vector<int> *faces = NULL)
+{
+    for (size_t m = 0; m < scene.size(); m++)
+    {
+        Model *model = scene[m];
+        Vec4f screen_coords[3];
+        const int n = faces ? faces[m].size() : model->nfaces();
+        for (int f = 0; f < n; f++)
+        {
+            const int i = faces ? faces[m][f] : f;
+            for (int j = 0; j < 3; j++)
+                screen_coords[j] = M * embed<4>(model->vert(i, j));
+            zbuffer.tiles().touch(screen_coords);
+            triangle_depth(screen_coords, zbuffer.data(), zbuffer.width(), zbuffer.height());
+        }
+    }
+}
+
+// 半透明模型：只做深度测试（不写深度），片段存入OIT缓冲，之后统一排序混合，与绘制顺序无关
+static void draw_translucent(const std::vector<Model *> &scene, SceneShader &shader, DirtyTiles &tiles, OITBuffer &oit,
+                             const float *zbuffer, const std::vector<int> *faces = NULL)
+{
+    for (size_t m = 0; m < scene.size(); m++)
+    {
+        shader.model = scene[m];
+
+        Vec4f screen_coords[3];
+        const int n = faces ? faces[m].size() : shader.model->nfaces();
+        for (int f = 0; f < n; f++)
+        {
+            const int i = faces ? faces[m][f] : f;
+            for (int j = 0; j < 3; j++)
+            {
+                screen_coords[j] = shader.vertex(i, j);
+            }
+            shader.uv_footprint = uv_footprint(shader.model, i, screen_coords);
+            tiles.touch(screen_coords);
+            triangle_oit(screen_coords, shader, oit, zbuffer);
+        }
+    }
+}
+
+// 几何按带分箱：每个面按其屏幕包围盒的y范围（多留一行余量，与DirtyTiles::touch相同）放入它覆盖的各带，
+// bins[b * scene.size() + m]是第b带中第m个模型的面；返回放入的总次数
+static size_t bin_faces(const std::vector<Model *> &scene, const Matrix &M, int band, int nbands, std::vector<std::vector<int> > &bins)
+{
+    size_t refs = 0;
+    for (size_t m = 0; m < scene.size(); m++)
+    {
+        Model *model = scene[m];
+        for (int i = 0; i < model->nfaces(); i++)
+        {
+            float ymin = std::numeric_limits<float>::max(), ymax = -ymin;
+            for (int j = 0; j < 3; j++)
+            {
+                Vec4f p = M * embed<4>(model->vert(i, j));
+                ymin = std::min(ymin, p[1] / p[3]);
+                ymax = std::max(ymax, p[1] / p[3]);
+            }
+            if (!(ymax >= -1.f && ymin <= (float)band * nbands)) // 在画面之外（或NaN）
+                continue;
+            // 先在float中截到图像范围再转int，过大（或无穷）的坐标转换是未定义行为
+            const float yhi = (float)band * nbands - 1.f;
+            const int b0 = (int)std::min(yhi, std::max(0.f, ymin - 1.f)) / band, b1 = (int)std::min(yhi, std::max(0.f, ymax + 1.f)) / band;
+            for (int b = b0; b <= b1; b++)
+                bins[b * scene.size() + m].push_back(i);
+            refs += b1 - b0 + 1;
+        }
+    }
+    return refs;
+}
+
+// 模型占画面较短一边的3/4，居中，非正方形的画面不会拉伸模型
+static void frame_viewport(RenderContext &ctx, int rw, int rh)
+{
+    const int size = std::min(rw, rh) * 3 / 4;
+    viewport(ctx, (rw - size) / 2, (rh - size) / 2, size, size);
+}
+
+// 渲染目标的行数：分带时只有一带
+static int target_rows(const RenderSettings &s)
+{
+    return (s.band_height ? std::min(s.band_height, s.height) : s.height) * s.ssaa;
+}
+
+FrameView::FrameView() : eye(1, 1, 4), light_dir(-1, 1, 1) {}
+
+FrameView animation_view(int k)
+{
+    FrameView view;
+    view.eye = Vec3f(1 - 0.05 * k, 1, 4);
+    view.light_dir = Vec3f(-1 + 0.05 * k, 1, 1 - 0.005 * k);
+    return view;
+}
+
+Renderer::Renderer(const RenderSettings &settings, const std::vector<const char *> &models, ModelCache *models_cache)
+    : settings_(settings), gamma_(settings.gamma), tile_cache_(NULL), models_cache_(models_cache), scene_(), translucent_(), bvh_(NULL), lights_(), has_glow_(false), shadow_caches_(), idle_caches_(), targets_(),
+      idle_targets_(), mutex_()
+{
+    pthread_mutex_init(&mutex_, NULL);
+    if (settings_.ssaa > 1) // 半径与深度比例都按输出像素给出，超采样时换算到采样
+    {
+        settings_.ssao_params.radius *= settings_.ssaa;
+        settings_.ssao_params.depth_scale /= settings_.ssaa;
+    }
+    // 模型只加载一次；虚拟纹理模式下纹理按需分块加载，常驻内存受缓存预算限制
+    // 共享的模型从缓存取用并持有到析构，加载失败的（NULL）不放入场景
+    if (settings_.virtual_textures && !models_cache_)
+        tile_cache_ = new TileCache((size_t)settings_.vt_budget_mb << 20);
+    for (size_t m = 0; m < models.size(); m++)
+    {
+        Model *model = models_cache_ ? models_cache_->acquire(models[m]) : new Model(models[m], tile_cache_);
+        if (!model)
+            continue;
+        scene_.push_back(model);
+        has_glow_ = has_glow_ || model->has_glow();
+    }
+    for (size_t m = 0; m < settings_.translucent.size(); m++)
+    {
+        Model *model = models_cache_ ? models_cache_->acquire(settings_.translucent[m]) : new Model(settings_.translucent[m].c_str(), tile_cache_);
+        if (model)
+            translucent_.push_back(model);
+    }
+    // 场景静止，加速结构只建一次；半透明模型不投射阴影，不在其中
+    if (settings_.shadow_rays)
+        bvh_ = new BVH(scene_);
+    // 多光源：固定的点光源与聚光灯，外加主方向光（下标0，方向逐帧设置）
+    if (settings_.shader == "lights")
+    {
+        Light sun;
+        sun.type = Light::DIRECTIONAL;
+        sun.color = Vec3f(.8f, .8f, .8f);
+        lights_.push_back(sun);
+        std::vector<Light> rig = make_light_rig(settings_.nlights);
+        lights_.insert(lights_.end(), rig.begin(), rig.end());
+    }
+}
+
+Renderer::~Renderer()
+{
+    for (size_t i = 0; i < shadow_caches_.size(); i++)
+        delete shadow_caches_[i];
+    for (size_t i = 0; i < targets_.size(); i++)
+        delete targets_[i];
+    for (size_t m = 0; m < scene_.size(); m++)
+    {
+        if (models_cache_)
+            models_cache_->release(scene_[m]);
+        else
+            delete scene_[m];
+    }
+    for (size_t m = 0; m < translucent_.size(); m++)
+    {
+        if (models_cache_)
+            models_cache_->release(translucent_[m]);
+        else
+            delete translucent_[m];
+    }
+    delete bvh_;
+    delete tile_cache_;
+    pthread_mutex_destroy(&mutex_);
+}
+
+const RenderSettings &Renderer::settings() const
+{
+    return settings_;
+}
+
+const BVH *Renderer::bvh() const
+{
+    return bvh_;
+}
+
+size_t Renderer::target_bytes() const
+{
+    const size_t rw = settings_.width * settings_.ssaa, rh = target_rows(settings_);
+    size_t bytes = rw * rh * (3 + sizeof(float));
+    if (settings_.msaa)
+        bytes += rw * rh * settings_.msaa * (4 + sizeof(float));
+    if (settings_.hdr || settings_.post)
+        bytes += rw * rh * 4 * sizeof(float);
+    if (!settings_.translucent.empty())
+        bytes += settings_.oit_mode == OIT_LISTS ? rw * rh * sizeof(int) + ((size_t)settings_.oit_budget_mb << 20)
+                                                 : rw * rh * (1 + settings_.oit_k * OITBuffer::fragment_bytes());
+    return bytes;
+}
+
+// 阴影图按光源方向和场景内容缓存，光源几乎不动时跨帧复用。每个正在渲染的帧独占一个缓存，
+// 最近归还的缓存最先被取用，顺序渲染时与原来的单个缓存行为相同
+ShadowMapCache *Renderer::acquire_shadow_cache()
+{
+    pthread_mutex_lock(&mutex_);
+    ShadowMapCache *cache;
+    if (idle_caches_.empty())
+    {
+        cache = new ShadowMapCache(settings_.shadow_size, settings_.shadow_size, settings_.shadow_reuse);
+        shadow_caches_.push_back(cache);
+    }
+    else
+    {
+        cache = idle_caches_.back();
+        idle_caches_.pop_back();
+    }
+    pthread_mutex_unlock(&mutex_);
+    return cache;
+}
+
+void Renderer::release_shadow_cache(ShadowMapCache *cache)
+{
+    pthread_mutex_lock(&mutex_);
+    idle_caches_.push_back(cache);
+    pthread_mutex_unlock(&mutex_);
+}
+
+// 渲染目标（颜色、深度、多重采样与浮点缓冲）同样放在池中跨帧复用，取出时已清除上次画过的tile
+RenderTarget *Renderer::acquire_target(float *cleared)
+{
+    pthread_mutex_lock(&mutex_);
+    RenderTarget *target;
+    if (idle_targets_.empty())
+    {
+        target = new RenderTarget(settings_.width * settings_.ssaa, target_rows(settings_));
+        targets_.push_back(target);
+    }
+    else
+    {
+        target = idle_targets_.back();
+        idle_targets_.pop_back();
+    }
+    pthread_mutex_unlock(&mutex_);
+    if (cleared)
+        *cleared = target->tiles().coverage();
+    target->clear();
+    return target;
+}
+
+void Renderer::release_target(RenderTarget *target)
+{
+    pthread_mutex_lock(&mutex_);
+    idle_targets_.push_back(target);
+    pthread_mutex_unlock(&mutex_);
+}
+
+Frame Renderer::render(int k, TGAStreamWriter *bands)
+{
+    return render(k, animation_view(k), bands);
+}
+
+Frame Renderer::render(int k, const FrameView &view, TGAStreamWriter *bands)
+{
+    if (settings_.band_height && bands)
+        return render_banded(k, view, *bands);
+    const RenderSettings &s = settings_;
+    const int rw = s.width * s.ssaa;
+    const int rh = s.height * s.ssaa;
+    Frame frame;
+    frame.index = k;
+
+    RenderContext ctx;
+    ctx.eye = view.eye;
+    ctx.light_dir = view.light_dir;
+    ctx.light_dir.normalize();
+
+    lookat(ctx, ctx.eye, ctx.center, ctx.up);
+    frame_viewport(ctx, rw, rh);
+    projection(ctx, -1.f / (ctx.eye - ctx.center).norm());
+
+    double t0 = wall_time();
+    bool shadow_rendered = false;
+    ShadowMapCache *shadow_cache = NULL;
+    ShadowMap *shadow = NULL;
+    std::vector<float> shadow_mask;
+    unsigned long shadow_rays = 0;
+    double t0p = t0;
+    if (bvh_)
+    {
+        // 光线追踪阴影：相机视角的深度预渲染，再从每个可见像素向光源发射阴影光线
+        RenderTarget *prepass = acquire_target();
+        Matrix M = ctx.Viewport * ctx.Projection * ctx.ModelView;
+        depth_prepass(scene_, M, prepass->depth());
+        t0p = wall_time();
+        shadow_rays = trace_shadow_mask(*bvh_, prepass->depth().data(), rw, rh, M.invert(), ctx.light_dir, s.shadow_ray_params, shadow_mask);
+        release_target(prepass);
+    }
+    else
+    {
+        // 渲染阴影图：只写深度，不需要颜色缓冲和片段着色器；光源与场景未变时直接复用
+        shadow_cache = acquire_shadow_cache();
+        shadow = &shadow_cache->get(ctx.light_dir, ctx.center, ctx.up, scene_, &shadow_rendered);
+        if (s.dump_depth && shadow_rendered)
+            frame.shadow_depth = depth_image(shadow->buffer, shadow->width, shadow->height);
+    }
+    double t1 = wall_time();
+    // 阴影滤波的预处理（VSM的矩纹理及其模糊）
+    if (shadow && s.shadow_filter == SHADOW_VSM)
+        shadow->prepare_vsm(s.vsm_blur);
+    double t1f = wall_time();
+
+    // 渲染图像
+    float clear_coverage = 0.f;
+    RenderTarget *target = acquire_target(&clear_coverage);
+    float *zbuffer = target->depth().data();
+    TGAImage *image = &target->color();
+    MSAATarget *msaa_target = s.msaa ? &target->msaa(s.msaa) : NULL;
+    FloatImage *hdr = s.hdr || s.post ? &target->hdr() : NULL;
+
+    // 多光源按屏幕tile剔除
+    std::vector<Light> lights(lights_);
+    LightGrid light_grid(s.light_tile);
+    if (!lights.empty())
+    {
+        lights[0].direction = ctx.light_dir;
+        light_grid.build(lights, ctx.Viewport * ctx.Projection * ctx.ModelView, rw, rh);
+    }
+    double t1l = wall_time();
+
+    ShaderParams params;
+    params.shadow = shadow;
+    if (bvh_)
+    {
+        params.shadow_mask = &shadow_mask[0];
+        params.shadow_mask_width = rw;
+        params.shadow_mask_height = rh;
+    }
+    params.shadow_filter = s.shadow_filter;
+    params.pcf_size = s.pcf_size;
+    params.shadow_bias = s.shadow_bias;
+    params.lights = &lights;
+    params.light_grid = &light_grid;
+    PipelineStats stats;
+    if (s.heatmap != HEATMAP_NONE)
+        stats.enable_heatmaps(rw, rh);
+    const unsigned long main_ticks = cpu_ticks();
+    SceneShader *shader = make_shader(s.shader, ctx, params);
+    shader->prepare(); // 每次绘制的常量只算一次
+    draw_scene(scene_, *shader, target->tiles(), image, s.hdr ? hdr : NULL, gamma_, msaa_target, zbuffer, s.fast_raster, s.stats ? &stats : NULL);
+    stats.total_ticks = cpu_ticks() - main_ticks;
+    delete shader;
+
+    double t2 = wall_time();
+    // 差分模式：用另一条光栅化路径再画一遍，以triangle()的结果为参考比较颜色与深度
+    DiffResult diff;
+    if (s.diff)
+    {
+        RenderTarget *other = acquire_target();
+        float *other_zbuffer = other->depth().data();
+        SceneShader *other_shader = make_shader(s.shader, ctx, params);
+        other_shader->prepare();
+        draw_scene(scene_, *other_shader, other->tiles(), &other->color(), NULL, gamma_, NULL, other_zbuffer, !s.fast_raster);
+        delete other_shader;
+        frame.diff = new TGAImage(rw, rh, TGAImage::RGB);
+        if (s.fast_raster)
+            diff = compare_frames(other->color(), other_zbuffer, *image, zbuffer, s.diff_tolerance, frame.diff);
+        else
+            diff = compare_frames(*image, zbuffer, other->color(), other_zbuffer, s.diff_tolerance, frame.diff);
+        frame.diff_failed = !diff.passed(s.diff_tolerance);
+        release_target(other);
+    }
+    double t2d = wall_time();
+    if (msaa_target)
+    {
+        msaa_target->resolve(*image);
+        msaa_target->resolve_depth(zbuffer);
+    }
+    double t2r = wall_time();
+    // 屏幕空间环境光遮蔽：在主渲染的深度缓冲上做后处理
+    if (s.ssao)
+    {
+        std::vector<float> ao;
+        ssao(zbuffer, rw, rh, s.ssao_params, ao);
+        if (s.hdr)
+            apply_ao(*hdr, ao);
+        else
+            apply_ao(*image, ao);
+    }
+    double t3o = wall_time();
+    // 半透明：在不透明结果（含SSAO）之上，逐像素按深度从远到近混合
+    OITBuffer *oit = NULL;
+    if (!translucent_.empty())
+    {
+        oit = &target->oit(s.oit_mode, s.oit_k, (size_t)s.oit_budget_mb << 20);
+        SceneShader *translucent_shader = make_translucent_shader(make_shader(s.shader, ctx, params), s.opacity);
+        translucent_shader->prepare();
+        draw_translucent(translucent_, *translucent_shader, target->tiles(), *oit, zbuffer);
+        delete translucent_shader;
+        if (s.hdr)
+            oit->resolve(*hdr, gamma_);
+        else
+            oit->resolve(*image);
+    }
+    if (shadow_cache)
+        release_shadow_cache(shadow_cache);
+    double t3 = wall_time();
+    double t4 = t3;
+    // 后处理链：线性浮点帧缓冲上依次做泛光（来自自发光贴图）和色调映射，最后一次性gamma编码量化到8位
+    // HDR模式下着色器直接输出线性浮点颜色到该帧缓冲，否则由8位图像解码得到
+    RenderTarget *glow = NULL;
+    PostChain post_chain;
+    if (s.post)
+    {
+        const bool bloom = has_glow_ && s.bloom_intensity > 0.f;
+        if (bloom)
+        {
+            // 自发光单独渲染一遍，用自己的深度缓冲，被遮挡的部分不会发光
+            glow = acquire_target();
+            SceneShader *glow_shader = make_shader("glow", ctx, params);
+            draw_scene(scene_, *glow_shader, glow->tiles(), &glow->color(), NULL, gamma_, NULL, glow->depth().data());
+            delete glow_shader;
+            FloatImage &emissive = glow->hdr();
+            emissive.from_tga(glow->color(), gamma_);
+            post_chain.add(new BloomPass(emissive, s.bloom_intensity, s.bloom_sigma * s.ssaa));
+        }
+        post_chain.add(new TonemapPass(s.tonemap, s.exposure));
+        if (!s.hdr)
+            hdr->from_tga(*image, gamma_);
+        t4 = wall_time();
+        post_chain.run(*hdr);
+    }
+    double t5 = wall_time();
+    if (s.post || s.hdr)
+        hdr->to_tga(*image, s.gamma);
+    // 以上各步（解析、SSAO、后处理、编码）写满整帧，下次取用时整体清除
+    if (s.msaa || s.ssao || s.post || s.hdr)
+        target->tiles().touch_all();
+    double t6 = wall_time();
+    // 渲染目标留在池中，输出的是它的副本
+    frame.image = new TGAImage(*image);
+    if (s.ssaa > 1)
+        frame.image->scale(s.width, s.height, TGAImage::BOX);
+    double t7 = wall_time();
+    if (glow)
+        release_target(glow);
+    release_target(target);
+    frame.heatmap = heatmap_image(stats, s.heatmap);
+    if (frame.heatmap && s.ssaa > 1)
+        frame.heatmap->scale(s.width, s.height, TGAImage::BOX);
+
+    pass_timer_record("shadow", k, t0, t1f);
+    pass_timer_record("main", k, t1f, t2);
+    if (s.diff)
+        pass_timer_record("diff", k, t2, t2d);
+    if (s.msaa)
+        pass_timer_record("resolve", k, t2d, t2r);
+    if (s.ssao)
+        pass_timer_record("ssao", k, t2r, t3o);
+    if (oit)
+        pass_timer_record("oit", k, t3o, t3);
+    if (s.post || s.hdr)
+        pass_timer_record("post", k, t3, t6);
+
+    std::ostringstream log;
+    log << "frame " << k << ": ";
+    if (bvh_)
+        log << "shadow rays " << (t1 - t0) * 1000. << " ms (depth prepass " << (t0p - t0) * 1000. << " ms, " << shadow_rays << " rays, "
+            << shadow_rays / std::max(1e-9, t1 - t0p) * 1e-6 << " Mrays/s)";
+    else
+        log << "shadow " << (t1 - t0) * 1000. << " ms" << (shadow_rendered ? "" : " (cached)") << ", " << shadow_filter_names[s.shadow_filter]
+            << " filter " << (t1f - t1) * 1000. << " ms";
+    log << ", main " << (t2 - t1l) * 1000. << " ms"
+        << (s.fast_raster ? " (fast raster, " : " (") << clear_coverage * 100.f << "% of the target cleared)";
+    if (!lights.empty())
+        log << " (light culling " << (t1l - t1f) * 1000. << " ms, " << lights.size() << " lights, "
+            << light_grid.average_per_tile() << " avg / " << light_grid.max_per_tile() << " max per tile)";
+    if (s.msaa)
+        log << ", msaa resolve " << (t2r - t2d) * 1000. << " ms";
+    if (s.ssao)
+        log << ", ssao" << (s.ssao_params.half_res ? " (half res) " : " ") << (t3o - t2r) * 1000. << " ms";
+    if (oit)
+        log << ", oit " << (t3 - t3o) * 1000. << " ms";
+    if (s.post)
+    {
+        log << (s.hdr ? ", glow " : ", glow+decode ") << (t4 - t3) * 1000. << " ms";
+        post_chain.report(log);
+    }
+    if (s.post || s.hdr)
+        log << ", encode " << (t6 - t5) * 1000. << " ms";
+    if (s.ssaa > 1)
+        log << ", ssaa downsample " << (t7 - t6) * 1000. << " ms";
+    log << std::endl;
+    if (s.diff)
+    {
+        log << "frame " << k << " diff (" << (s.fast_raster ? "reference" : "fast") << " path " << (t2d - t2) * 1000. << " ms): ";
+        diff.report(log, s.diff_tolerance);
+        log << std::endl;
+    }
+    if (oit)
+    {
+        log << "frame " << k << " translucency: ";
+        oit->report(log);
+        log << std::endl;
+    }
+    if (s.stats)
+    {
+        log << "frame " << k << " main pass: ";
+        stats.report(log);
+        log << std::endl;
+    }
+
+    if (tile_cache_)
+    {
+        // 反馈与预取修改纹理的访问记录，同一时刻只允许一帧进行
+        pthread_mutex_lock(&mutex_);
+        log << "frame " << k << " virtual texture feedback:" << std::endl;
+        for (size_t m = 0; m < scene_.size(); m++)
+            scene_[m]->texture_feedback(log);
+        tile_cache_->report(log);
+        pthread_mutex_unlock(&mutex_);
+    }
+    frame.log = log.str();
+    return frame;
+}
+
+// 分带渲染：图像按水平带依次渲染，渲染目标只有一带大小，每带完成后立即写入输出文件，内存峰值与图像高度无关。
+// 几何先按带分箱，每带只对落在其中的三角形做顶点着色与光栅化
+Frame Renderer::render_banded(int k, const FrameView &view, TGAStreamWriter &out)
+{
+    const RenderSettings &s = settings_;
+    const int rw = s.width * s.ssaa;
+    const int rh = s.height * s.ssaa;
+    const int band = target_rows(s); // 渲染分辨率下每带的行数
+    const int nbands = (rh + band - 1) / band;
+    Frame frame;
+    frame.index = k;
+
+    RenderContext ctx;
+    ctx.eye = view.eye;
+    ctx.light_dir = view.light_dir;
+    ctx.light_dir.normalize();
+    lookat(ctx, ctx.eye, ctx.center, ctx.up);
+    frame_viewport(ctx, rw, rh);
+    projection(ctx, -1.f / (ctx.eye - ctx.center).norm());
+
+    // 阴影图的分辨率与图像无关，每帧只渲染一次；光线追踪阴影则在每带自己的深度预渲染上进行
+    double t0 = wall_time();
+    bool shadow_rendered = false;
+    ShadowMapCache *shadow_cache = NULL;
+    ShadowMap *shadow = NULL;
+    if (!bvh_)
+    {
+        shadow_cache = acquire_shadow_cache();
+        shadow = &shadow_cache->get(ctx.light_dir, ctx.center, ctx.up, scene_, &shadow_rendered);
+        if (s.dump_depth && shadow_rendered)
+            frame.shadow_depth = depth_image(shadow->buffer, shadow->width, shadow->height);
+        if (s.shadow_filter == SHADOW_VSM)
+            shadow->prepare_vsm(s.vsm_blur);
+    }
+    double t1 = wall_time();
+
+    Matrix M = ctx.Viewport * ctx.Projection * ctx.ModelView;
+    std::vector<std::vector<int> > bins(nbands * scene_.size()), translucent_bins(nbands * translucent_.size());
+    const size_t refs = bin_faces(scene_, M, band, nbands, bins) + bin_faces(translucent_, M, band, nbands, translucent_bins);
+    double t2 = wall_time();
+
+    RenderTarget *target = acquire_target();
+    RenderTarget *prepass = bvh_ ? acquire_target() : NULL;
+    std::vector<float> shadow_mask;
+    unsigned long shadow_rays = 0;
+    std::vector<Light> lights(lights_);
+    if (!lights.empty())
+        lights[0].direction = ctx.light_dir;
+    double shadow_s = t1 - t0, main_s = 0., oit_s = 0., write_s = 0.;
+    bool ok = true;
+    for (int b = 0; b < nbands && ok; b++)
+    {
+        const int y0 = b * band, rows = std::min(band, rh - y0);
+        // 视口整体上移y0行，带内的行从0开始
+        RenderContext bctx = ctx;
+        bctx.Viewport[1][3] -= y0;
+        Matrix bM = bctx.Viewport * bctx.Projection * bctx.ModelView;
+        const std::vector<int> *faces = &bins[b * scene_.size()];
+
+        double tb0 = wall_time();
+        if (prepass)
+        {
+            prepass->clear();
+            depth_prepass(scene_, bM, prepass->depth(), faces);
+            shadow_rays += trace_shadow_mask(*bvh_, prepass->depth().data(), rw, band, bM.invert(), ctx.light_dir, s.shadow_ray_params, shadow_mask);
+        }
+        double tb1 = wall_time();
+        target->clear();
+        float *zbuffer = target->depth().data();
+        TGAImage *image = &target->color();
+        MSAATarget *msaa_target = s.msaa ? &target->msaa(s.msaa) : NULL;
+        FloatImage *hdr = s.hdr ? &target->hdr() : NULL;
+        LightGrid light_grid(s.light_tile);
+        if (!lights.empty())
+            light_grid.build(lights, bM, rw, band);
+        ShaderParams params;
+        params.shadow = shadow;
+        if (prepass)
+        {
+            params.shadow_mask = &shadow_mask[0];
+            params.shadow_mask_width = rw;
+            params.shadow_mask_height = band;
+        }
+        params.shadow_filter = s.shadow_filter;
+        params.pcf_size = s.pcf_size;
+        params.shadow_bias = s.shadow_bias;
+        params.lights = &lights;
+        params.light_grid = &light_grid;
+        SceneShader *shader = make_shader(s.shader, bctx, params);
+        shader->prepare();
+        draw_scene(scene_, *shader, target->tiles(), image, hdr, gamma_, msaa_target, zbuffer, s.fast_raster, NULL, faces);
+        delete shader;
+        if (msaa_target)
+        {
+            msaa_target->resolve(*image);
+            msaa_target->resolve_depth(zbuffer);
+        }
+        double tb2 = wall_time();
+        if (!translucent_.empty())
+        {
+            OITBuffer &oit = target->oit(s.oit_mode, s.oit_k, (size_t)s.oit_budget_mb << 20);
+            SceneShader *translucent_shader = make_translucent_shader(make_shader(s.shader, bctx, params), s.opacity);
+            translucent_shader->prepare();
+            draw_translucent(translucent_, *translucent_shader, target->tiles(), oit, zbuffer, &translucent_bins[b * translucent_.size()]);
+            delete translucent_shader;
+            if (hdr)
+                oit.resolve(*hdr, gamma_);
+            else
+                oit.resolve(*image);
+        }
+        double tb3 = wall_time();
+        if (hdr)
+            hdr->to_tga(*image, s.gamma);
+        if (msaa_target || hdr)
+            target->tiles().touch_all();
+        // 只输出带内有效的行，超采样时先缩小到输出分辨率
+        TGAImage strip(rw, rows, TGAImage::RGB);
+        memcpy(strip.buffer(), image->buffer(), (size_t)rw * rows * 3);
+        if (s.ssaa > 1)
+            strip.scale(s.width, rows / s.ssaa, TGAImage::BOX);
+        ok = out.append(strip);
+        double tb4 = wall_time();
+        shadow_s += tb1 - tb0;
+        main_s += tb2 - tb1;
+        oit_s += tb3 - tb2;
+        write_s += tb4 - tb3;
+    }
+    if (prepass)
+        release_target(prepass);
+    release_target(target);
+    if (shadow_cache)
+        release_shadow_cache(shadow_cache);
+    double t3 = wall_time();
+    pass_timer_record("shadow", k, t0, t1);
+    pass_timer_record("bands", k, t2, t3);
+
+    std::ostringstream log;
+    log << "frame " << k << ": " << nbands << " bands of " << band << " rows, ";
+    if (bvh_)
+        log << "shadow rays " << shadow_s * 1000. << " ms (" << shadow_rays << " rays)";
+    else
+        log << "shadow " << shadow_s * 1000. << " ms" << (shadow_rendered ? "" : " (cached)");
+    log << ", binning " << (t2 - t1) * 1000. << " ms (" << (double)refs / std::max(1, nbands) << " triangles per band), main "
+        << main_s * 1000. << " ms";
+    if (!translucent_.empty())
+        log << ", oit " << oit_s * 1000. << " ms";
+    log << ", encode+write " << write_s * 1000. << " ms";
+    if (!ok)
+        log << ", output failed after " << out.rows_written() << " rows";
+    log << std::endl;
+    frame.log = log.str();
+    return frame;
+}
@@ -0,0 +1,140 @@
+#ifndef __RENDERER_H__
+#define __RENDERER_H__
+#include <vector>
+#include <string>
+#include <iostream>
+#include <pthread.h>
+#include "tgaimage.h"
+#include "model.h"
+#include "vtexture.h"
+#include "shadowmap.h"
+#include "ssao.h"
+#include "lights.h"
+#include "postfx.h"
+#include "stats.h"
+#include "framediff.h"
+#include "rendertarget.h"
+#include "oit.h"
+#include "bvh.h"
+
+// 一帧如何渲染的全部设置（命令行中与渲染相关的选项）
+struct RenderSettings
+{
+    RenderSettings();
+
+    int width;
+    int height;
+    int band_height; // 非0时分带渲染：每次只渲染这么多行，渲染完的带直接写入输出文件
+    std::string shader;
+    int shadow_size;
+    float shadow_reuse; // 弧度
+    ShadowFilter shadow_filter;
+    bool shadow_rays;                  // 用BVH光线追踪阴影代替阴影图
+    ShadowRayParams shadow_ray_params;
+    int pcf_size;
+    int vsm_blur;
+    float shadow_bias;
+    bool ssao;
+    SSAOParams ssao_params;
+    int nlights;
+    int light_tile;
+    bool hdr;
+    bool post;
+    float bloom_intensity;
+    float bloom_sigma;
+    Tonemap tonemap;
+    float exposure;
+    float gamma;
+    int msaa;
+    int ssaa;
+    bool fast_raster;             // 主渲染用triangle_fast()代替triangle()
+    bool diff;                    // 两条路径都渲染并比较
+    DiffTolerance diff_tolerance;
+    bool dump_depth;
+    bool stats;      // 主渲染的流水线计数
+    Heatmap heatmap; // 额外输出过度绘制或着色开销的热力图
+    bool virtual_textures;
+    int vt_budget_mb;
+    std::vector<std::string> translucent; // 半透明模型，不投射阴影，按像素排序后混合
+    float opacity;
+    OITMode oit_mode;
+    int oit_k;          // k-buffer每像素的片段数
+    int oit_budget_mb;  // 片段内存上限：链表模式的片段池大小，k-buffer的槽位不得超过
+};
+
+// 解析argv[i]处的渲染选项：不是渲染选项时返回false；否则i指向最后一个被消耗的参数，取值非法时ok为false（错误已输出到err）
+bool parse_render_option(RenderSettings &settings, int argc, char **argv, int &i, bool &ok, std::ostream &err = std::cerr);
+// 检查选项之间的冲突，错误信息输出到err
+bool check_render_settings(const RenderSettings &settings, std::ostream &err = std::cerr);
+
+// 一帧的相机位置与主光源方向（看向原点）
+struct FrameView
+{
+    FrameView();
+    Vec3f eye;
+    Vec3f light_dir;
+};
+// 命令行渲染的动画序列：相机与光源绕场景缓慢移动
+FrameView animation_view(int k);
+
+// 渲染完成的一帧：图像（原点在左上角）、可选的光源深度图与热力图，以及该帧的计时信息
+struct Frame
+{
+    Frame();
+    // 复制只复制指针，图像的所有权随之转移给最终提交它们的一方
+    Frame(const Frame &other);
+    Frame &operator=(const Frame &other);
+
+    int index;
+    TGAImage *image;
+    TGAImage *shadow_depth; // --dump-depth，仅当本帧重新渲染了阴影图
+    TGAImage *heatmap;      // --heatmap
+    TGAImage *diff;         // --diff：参考路径与快速路径的差异图
+    bool diff_failed;
+    std::string log;
+};
+
+// 持有场景和各帧共享的资源。render()只读共享的模型与光源，缓存的访问都加锁，
+// 因此可以在多个线程中同时渲染不同的帧。
+class Renderer
+{
+public:
+    // models_cache非空时模型从中取用（多个Renderer共享已加载的模型，Renderer析构时归还），否则自行加载
+    Renderer(const RenderSettings &settings, const std::vector<const char *> &models, ModelCache *models_cache = NULL);
+    ~Renderer();
+    // 相机和光源动画序列中的第k帧；分带渲染时各带依次写入bands，Frame中不再有整幅图像
+    Frame render(int k, TGAStreamWriter *bands = NULL);
+    // 指定相机与光源的一帧，k只用于日志与计时
+    Frame render(int k, const FrameView &view, TGAStreamWriter *bands = NULL);
+    // 颜色与深度缓冲的大小（字节）
+    size_t target_bytes() const;
+    const RenderSettings &settings() const;
+    // 光线追踪阴影的加速结构，不使用时为NULL
+    const BVH *bvh() const;
+
+private:
+    ShadowMapCache *acquire_shadow_cache();
+    void release_shadow_cache(ShadowMapCache *cache);
+    Frame render_banded(int k, const FrameView &view, TGAStreamWriter &out);
+    RenderTarget *acquire_target(float *cleared = NULL); // cleared: 清除的tile比例
+    void release_target(RenderTarget *target);
+    Renderer(const Renderer &);
+    Renderer &operator=(const Renderer &);
+
+    RenderSettings settings_;
+    GammaTable gamma_; // settings_.gamma的解码表，帧的编码与之互逆
+    TileCache *tile_cache_;
+    ModelCache *models_cache_; // 非空时模型由它持有
+    std::vector<Model *> scene_;
+    std::vector<Model *> translucent_;
+    BVH *bvh_;
+    std::vector<Light> lights_;
+    bool has_glow_;
+    std::vector<ShadowMapCache *> shadow_caches_; // 全部阴影图缓存
+    std::vector<ShadowMapCache *> idle_caches_;   // 当前没有帧在使用的，最近归还的在最后
+    std::vector<RenderTarget *> targets_;         // 全部渲染目标
+    std::vector<RenderTarget *> idle_targets_;
+    pthread_mutex_t mutex_;
+};
+
+#endif //__RENDERER_H__
@@ -0,0 +1,210 @@
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "rendertarget.h"
+
+float *alloc_floats(size_t n) {
+    void *p = NULL;
+    if (posix_memalign(&p, 64, std::max((size_t)1, n)*sizeof(float))) return NULL;
+    return (float *)p;
+}
+
+void free_floats(float *p) {
+    free(p);
+}
+
+void fill_floats(float *p, size_t n, float v) {
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128 v4 = _mm_set1_ps(v);
+    for (; i+16<=n; i+=16) {
+        _mm_storeu_ps(p+i, v4);
+        _mm_storeu_ps(p+i+4, v4);
+        _mm_storeu_ps(p+i+8, v4);
+        _mm_storeu_ps(p+i+12, v4);
+    }
+    for (; i+4<=n; i+=4) _mm_storeu_ps(p+i, v4);
+#endif
+    for (; i<n; i++) p[i] = v;
+}
+
+static void fill_span(float *p, size_t n, float v) {
+    fill_floats(p, n, v);
+}
+
+static void fill_span(unsigned char *p, size_t n, unsigned char v) {
+    memset(p, v, n);
+}
+
+DirtyTiles::DirtyTiles(int w, int h, int tile) : width_(w), height_(h), tile_(tile), tx_((w+tile-1)/tile), ty_((h+tile-1)/tile), dirty_() {
+    dirty_.assign((size_t)tx_*ty_, 1); // nothing is known about fresh memory
+}
+
+void DirtyTiles::touch(const Vec4f *pts) {
+    float xmin = std::numeric_limits<float>::max(), ymin = xmin, xmax = -xmin, ymax = -xmin;
+    for (int i=0; i<3; i++) {
+        const float x = pts[i][0]/pts[i][3], y = pts[i][1]/pts[i][3];
+        xmin = std::min(xmin, x); xmax = std::max(xmax, x);
+        ymin = std::min(ymin, y); ymax = std::max(ymax, y);
+    }
+    // one pixel of margin covers the rounding of every rasterizer and the half pixel reach of MSAA samples
+    if (!(xmax>=-1.f && ymax>=-1.f && xmin<=width_ && ymin<=height_)) return; // off-screen (or NaN)
+    // clamped to the target while still float: a huge (or infinite) coordinate does not fit in an int
+    const float xhi = width_-1.f, yhi = height_-1.f;
+    const int x0 = (int)std::min(xhi, std::max(0.f, xmin-1.f))/tile_, x1 = (int)std::min(xhi, std::max(0.f, xmax+1.f))/tile_;
+    const int y0 = (int)std::min(yhi, std::max(0.f, ymin-1.f))/tile_, y1 = (int)std::min(yhi, std::max(0.f, ymax+1.f))/tile_;
+    for (int ty=y0; ty<=y1; ty++)
+        memset(&dirty_[(size_t)ty*tx_+x0], 1, x1-x0+1);
+}
+
+void DirtyTiles::touch_all() {
+    std::fill(dirty_.begin(), dirty_.end(), 1);
+}
+
+void DirtyTiles::reset() {
+    std::fill(dirty_.begin(), dirty_.end(), 0);
+}
+
+bool DirtyTiles::dirty(int tx, int ty) const {
+    return dirty_[(size_t)ty*tx_+tx];
+}
+
+int DirtyTiles::tile_size() const {
+    return tile_;
+}
+
+int DirtyTiles::tiles_x() const {
+    return tx_;
+}
+
+int DirtyTiles::tiles_y() const {
+    return ty_;
+}
+
+float DirtyTiles::coverage() const {
+    return dirty_.empty() ? 0.f : std::count(dirty_.begin(), dirty_.end(), 1)/(float)dirty_.size();
+}
+
+// runs of adjacent dirty tiles are cleared as one span per pixel row
+template <typename T> static void clear_tiles(const DirtyTiles &tiles, int width, int height, T *buf, size_t pitch, int n, T value) {
+    const int ts = tiles.tile_size();
+    for (int ty=0; ty<tiles.tiles_y(); ty++) {
+        for (int tx=0; tx<tiles.tiles_x(); tx++) {
+            if (!tiles.dirty(tx, ty)) continue;
+            int end = tx;
+            while (end+1<tiles.tiles_x() && tiles.dirty(end+1, ty)) end++;
+            const int x0 = tx*ts, x1 = std::min(width, (end+1)*ts);
+            for (int y=ty*ts; y<std::min(height, (ty+1)*ts); y++)
+                fill_span(buf + y*pitch + (size_t)x0*n, (size_t)(x1-x0)*n, value);
+            tx = end;
+        }
+    }
+}
+
+void DirtyTiles::clear(float *buf, size_t pitch, int n, float value) const {
+    clear_tiles(*this, width_, height_, buf, pitch, n, value);
+}
+
+void DirtyTiles::clear(unsigned char *buf, size_t pitch, int n, unsigned char value) const {
+    clear_tiles(*this, width_, height_, buf, pitch, n, value);
+}
+
+DepthBuffer::DepthBuffer(int w, int h) : width_(w), height_(h), data_(alloc_floats((size_t)w*h)), tiles_(w, h) {
+    clear();
+}
+
+DepthBuffer::~DepthBuffer() {
+    free_floats(data_);
+}
+
+float *DepthBuffer::data() {
+    return data_;
+}
+
+const float *DepthBuffer::data() const {
+    return data_;
+}
+
+int DepthBuffer::width() const {
+    return width_;
+}
+
+int DepthBuffer::height() const {
+    return height_;
+}
+
+DirtyTiles &DepthBuffer::tiles() {
+    return tiles_;
+}
+
+void DepthBuffer::clear() {
+    tiles_.clear(data_, width_, 1, -std::numeric_limits<float>::max());
+    tiles_.reset();
+}
+
+RenderTarget::RenderTarget(int w, int h) : color_(w, h, TGAImage::RGB), depth_(w, h), msaa_(NULL), hdr_(), oit_(NULL),
+    oit_mode_(OIT_LISTS), oit_k_(0), oit_bytes_(0) {
+}
+
+RenderTarget::~RenderTarget() {
+    delete msaa_;
+    delete oit_;
+}
+
+void RenderTarget::clear() {
+    DirtyTiles &tiles = depth_.tiles();
+    const int w = color_.get_width();
+    tiles.clear(color_.buffer(), (size_t)w*color_.get_bytespp(), color_.get_bytespp(), 0);
+    if (msaa_) {
+        tiles.clear(&msaa_->depth[0], (size_t)w*msaa_->samples, msaa_->samples, -std::numeric_limits<float>::max());
+        tiles.clear(&msaa_->color[0], (size_t)w*msaa_->samples*4, msaa_->samples*4, 0);
+    }
+    if (hdr_.width())
+        for (int c=0; c<4; c++)
+            tiles.clear(hdr_.row(c, 0), hdr_.stride(), 1, 0.f);
+    if (oit_)
+        oit_->clear();
+    depth_.clear();
+}
+
+TGAImage &RenderTarget::color() {
+    return color_;
+}
+
+DepthBuffer &RenderTarget::depth() {
+    return depth_;
+}
+
+DirtyTiles &RenderTarget::tiles() {
+    return depth_.tiles();
+}
+
+// buffers allocated later start cleared, so they are consistent with the tiles whatever their state
+MSAATarget &RenderTarget::msaa(int samples) {
+    if (!msaa_ || msaa_->samples!=(samples>4 ? 8 : 4)) {
+        delete msaa_;
+        msaa_ = new MSAATarget(color_.get_width(), color_.get_height(), samples);
+    }
+    return *msaa_;
+}
+
+FloatImage &RenderTarget::hdr() {
+    if (!hdr_.width())
+        hdr_.resize(color_.get_width(), color_.get_height());
+    return hdr_;
+}
+
+OITBuffer &RenderTarget::oit(OITMode mode, int k, size_t arena_bytes) {
+    if (!oit_ || oit_mode_!=mode || oit_k_!=k || oit_bytes_!=arena_bytes) {
+        delete oit_;
+        oit_ = new OITBuffer(color_.get_width(), color_.get_height(), mode, k, arena_bytes);
+        oit_mode_ = mode;
+        oit_k_ = k;
+        oit_bytes_ = arena_bytes;
+    }
+    return *oit_;
+}
@@ -0,0 +1,91 @@
+#ifndef __RENDERTARGET_H__
+#define __RENDERTARGET_H__
+#include <vector>
+#include <cstddef>
+#include "geometry.h"
+#include "tgaimage.h"
+#include "framebuffer.h"
+#include "our_gl.h"
+#include "oit.h"
+
+// cache line aligned float arrays, for buffers the SSE loops sweep over
+float *alloc_floats(size_t n);
+void free_floats(float *p);
+// SSE fill, no alignment requirement
+void fill_floats(float *p, size_t n, float v);
+
+// Screen split in square tiles, each flagged when something may have been drawn into it since the last
+// clear. The rasterizers are not involved: whoever submits a triangle marks its screen bounding box.
+class DirtyTiles {
+public:
+    DirtyTiles(int w, int h, int tile=32);
+    // marks the tiles under the bounding box of the triangle (clip coordinates, as the rasterizers take them)
+    void touch(const Vec4f *pts);
+    // after a pass that writes every pixel (post-processing, SSAO, encode)
+    void touch_all();
+    void reset();
+    bool dirty(int tx, int ty) const;
+    int tile_size() const;
+    int tiles_x() const;
+    int tiles_y() const;
+    // fraction of the tiles that are dirty
+    float coverage() const;
+    // sets the pixels of the dirty tiles of a buffer with pitch elements per row and n per pixel
+    void clear(float *buf, size_t pitch, int n, float value) const;
+    void clear(unsigned char *buf, size_t pitch, int n, unsigned char value) const;
+private:
+    int width_, height_, tile_, tx_, ty_;
+    std::vector<unsigned char> dirty_;
+};
+
+// Aligned depth buffer, row-major without padding (the rasterizers index it as x+y*width).
+class DepthBuffer {
+public:
+    DepthBuffer(int w, int h);
+    ~DepthBuffer();
+    float *data();
+    const float *data() const;
+    int width() const;
+    int height() const;
+    DirtyTiles &tiles();
+    // back to -max where something was drawn since the last clear
+    void clear();
+private:
+    DepthBuffer(const DepthBuffer &);
+    DepthBuffer &operator=(const DepthBuffer &);
+
+    int width_, height_;
+    float *data_;
+    DirtyTiles tiles_;
+};
+
+// Color, depth and, allocated on first use, multisampled and float buffers of one frame. The Renderer keeps
+// a pool of them, so a frame in flight reuses the buffers of a finished one. All buffers follow the
+// dirty tiles of the depth buffer: clear() only resets what was drawn since the previous clear().
+class RenderTarget {
+public:
+    RenderTarget(int w, int h);
+    ~RenderTarget();
+    void clear();
+    TGAImage &color();
+    DepthBuffer &depth();
+    DirtyTiles &tiles();
+    MSAATarget &msaa(int samples);
+    FloatImage &hdr();
+    // reallocated when the mode or the memory bound change, emptied by clear()
+    OITBuffer &oit(OITMode mode, int k, size_t arena_bytes);
+private:
+    RenderTarget(const RenderTarget &);
+    RenderTarget &operator=(const RenderTarget &);
+
+    TGAImage color_;
+    DepthBuffer depth_;
+    MSAATarget *msaa_;
+    FloatImage hdr_;
+    OITBuffer *oit_;
+    OITMode oit_mode_;
+    int oit_k_;
+    size_t oit_bytes_;
+};
+
+#endif //__RENDERTARGET_H__
@@ -0,0 +1,547 @@
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "server.h"
+#include "our_gl.h"
+#include "timer.h"
+
+ServerSettings::ServerSettings() : threads(2), queue(64), renderers(4), models(16) {}
+
+RenderServer::Connection::Connection(RenderServer *s, int in_fd, int out_fd, bool sock) : server(s), in(in_fd), out(out_fd),
+    socket(sock), refs(1), write_mutex() {
+    pthread_mutex_init(&write_mutex, NULL);
+}
+
+RenderServer::Job::Job() : id(0), connection(NULL), settings(), key(), models(), view(), output(), format(TGAImage::TGA),
+    submitted(0), depth(0) {}
+
+RenderServer::RenderServer(const ServerSettings &settings, const RenderSettings &defaults, const std::vector<const char *> &models) :
+    settings_(settings), defaults_(defaults), default_models_(models.begin(), models.end()), models_(std::max(0, settings.models)), renderers_(),
+    renderers_mutex_(), renderers_created_(0), renderers_reused_(0), renderers_evicted_(0), queue_(), threads_(), connections_(),
+    mutex_(), not_empty_(), not_full_(), readers_done_(), readers_(0), listen_fd_(-1), stopping_(false), done_(false), next_id_(0),
+    failures_(0), max_depth_(0), latencies_(), wait_total_(0), render_total_(0) {
+    settings_.threads = std::max(1, settings_.threads);
+    settings_.queue = std::max(1, settings_.queue);
+    settings_.renderers = std::max(1, settings_.renderers);
+    pthread_mutex_init(&renderers_mutex_, NULL);
+    pthread_mutex_init(&mutex_, NULL);
+    pthread_cond_init(&not_empty_, NULL);
+    pthread_cond_init(&not_full_, NULL);
+    pthread_cond_init(&readers_done_, NULL);
+    // the default scene is loaded before the first job arrives
+    for (size_t m=0; m<default_models_.size(); m++)
+        models_.load(default_models_[m]);
+    for (int i=0; i<settings_.threads; i++) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, work, this)) {
+            std::cerr << "can't start render server thread\n";
+            break;
+        }
+        threads_.push_back(t);
+    }
+}
+
+RenderServer::~RenderServer() {
+    finish();
+    for (std::map<std::string, Entry>::iterator it=renderers_.begin(); it!=renderers_.end(); ++it)
+        delete it->second.renderer;
+    pthread_cond_destroy(&readers_done_);
+    pthread_cond_destroy(&not_full_);
+    pthread_cond_destroy(&not_empty_);
+    pthread_mutex_destroy(&mutex_);
+    pthread_mutex_destroy(&renderers_mutex_);
+}
+
+bool RenderServer::serve_stdio() {
+    signal(SIGPIPE, SIG_IGN); // a client going away must not kill the server
+    Connection *c = new Connection(this, 0, 1, false);
+    read_lines(c);
+    release(c);
+    stop();
+    finish();
+    return true;
+}
+
+bool RenderServer::serve_socket(const char *path) {
+    signal(SIGPIPE, SIG_IGN);
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path)>=sizeof(addr.sun_path)) {
+        std::cerr << "socket path too long: " << path << std::endl;
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+    // a socket file left behind by a server that is gone is replaced, a live one is not
+    struct stat st;
+    if (!stat(path, &st)) {
+        if (!S_ISSOCK(st.st_mode)) {
+            std::cerr << path << " exists and is not a socket" << std::endl;
+            return false;
+        }
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        bool live = probe>=0 && !connect(probe, (sockaddr *)&addr, sizeof(addr));
+        if (probe>=0) close(probe);
+        if (live) {
+            std::cerr << "a render server is already listening on " << path << std::endl;
+            return false;
+        }
+        unlink(path);
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd<0 || bind(fd, (sockaddr *)&addr, sizeof(addr)) || listen(fd, 16)) {
+        std::cerr << "can't listen on " << path << ": " << strerror(errno) << std::endl;
+        if (fd>=0) close(fd);
+        return false;
+    }
+    pthread_mutex_lock(&mutex_);
+    listen_fd_ = fd;
+    pthread_mutex_unlock(&mutex_);
+    std::cerr << "render server listening on " << path << ", " << threads_.size() << " worker threads" << std::endl;
+
+    for (;;) {
+        int client = accept(fd, NULL, NULL);
+        if (client<0) {
+            if (errno==EINTR) continue;
+            break; // stop() shut the listening socket down
+        }
+        pthread_mutex_lock(&mutex_);
+        if (stopping_) {
+            pthread_mutex_unlock(&mutex_);
+            close(client);
+            break;
+        }
+        Connection *c = new Connection(this, client, client, true);
+        connections_.push_back(c);
+        readers_++;
+        pthread_mutex_unlock(&mutex_);
+        pthread_t t;
+        if (pthread_create(&t, NULL, read_connection, c)) {
+            std::cerr << "can't start connection thread\n";
+            pthread_mutex_lock(&mutex_);
+            readers_--;
+            pthread_mutex_unlock(&mutex_);
+            release(c);
+        } else {
+            pthread_detach(t);
+        }
+    }
+    stop();
+    // the other clients stop being read; the jobs they already sent are still rendered and answered
+    pthread_mutex_lock(&mutex_);
+    for (size_t i=0; i<connections_.size(); i++)
+        shutdown(connections_[i]->in, SHUT_RD);
+    while (readers_)
+        pthread_cond_wait(&readers_done_, &mutex_);
+    listen_fd_ = -1;
+    pthread_mutex_unlock(&mutex_);
+    finish();
+    close(fd);
+    unlink(path);
+    return true;
+}
+
+void *RenderServer::read_connection(void *arg) {
+    Connection *c = (Connection *)arg;
+    RenderServer *s = c->server;
+    s->read_lines(c);
+    pthread_mutex_lock(&s->mutex_);
+    s->readers_--;
+    pthread_cond_signal(&s->readers_done_);
+    pthread_mutex_unlock(&s->mutex_);
+    s->release(c);
+    return NULL;
+}
+
+void RenderServer::read_lines(Connection *c) {
+    std::string pending;
+    char buf[4096];
+    for (;;) {
+        ssize_t n = read(c->in, buf, sizeof(buf));
+        if (n<0 && errno==EINTR) continue;
+        if (n<=0) break;
+        pending.append(buf, n);
+        size_t eol;
+        while ((eol = pending.find('\n'))!=std::string::npos) {
+            std::string line = pending.substr(0, eol);
+            pending.erase(0, eol+1);
+            if (!handle_line(c, line)) return;
+        }
+    }
+    if (!pending.empty()) handle_line(c, pending); // last line without a newline
+}
+
+bool RenderServer::handle_line(Connection *c, std::string line) {
+    const size_t first = line.find_first_not_of(" \t\r");
+    if (first==std::string::npos || line[first]=='#') return true;
+    line = line.substr(first, line.find_last_not_of(" \t\r")-first+1);
+    if (line=="quit") {
+        stop();
+        return false;
+    }
+    if (line=="stats") {
+        std::ostringstream out;
+        out << "stats: ";
+        report(out);
+        reply(c, out.str());
+        return true;
+    }
+    Job *job = new Job();
+    job->connection = c;
+    job->submitted = wall_time();
+    pthread_mutex_lock(&mutex_);
+    job->id = next_id_++;
+    pthread_mutex_unlock(&mutex_);
+    std::string error;
+    if (!parse_job(line, *job, error)) {
+        std::ostringstream out;
+        out << "error " << job->id << ": " << error;
+        reply(c, out.str());
+        pthread_mutex_lock(&mutex_);
+        failures_++;
+        pthread_mutex_unlock(&mutex_);
+        delete job;
+        return true;
+    }
+    submit(job);
+    return true;
+}
+
+static bool parse_vec3(const char *s, Vec3f &v) {
+    float x, y, z;
+    if (sscanf(s, "%f,%f,%f", &x, &y, &z)!=3) return false;
+    v = Vec3f(x, y, z);
+    return true;
+}
+
+// the camera looks at the center of the default RenderContext with its up vector: the eye can't be the
+// center itself (no view direction) nor lie on the up axis through it (no horizontal axis for lookat)
+static bool valid_eye(const Vec3f &eye) {
+    const RenderContext ctx;
+    Vec3f d = eye-ctx.center, up = ctx.up;
+    const float n = d.norm();
+    return n>0.f && cross(d, up).norm()>1e-6f*n*up.norm(); // false for NaN and infinity as well
+}
+
+// clients only write below the server's working directory: no absolute path, no ".." component
+static bool valid_output(const std::string &path) {
+    if (path.empty() || path[0]=='/') return false;
+    for (size_t begin=0; begin<=path.size(); ) {
+        size_t end = path.find('/', begin);
+        if (end==std::string::npos) end = path.size();
+        if (path.compare(begin, end-begin, "..")==0) return false;
+        begin = end+1;
+    }
+    return true;
+}
+
+bool RenderServer::parse_job(const std::string &line, Job &job, std::string &error) {
+    std::vector<std::string> tokens;
+    std::istringstream in(line);
+    std::string token;
+    while (in >> token) tokens.push_back(token);
+    std::vector<char *> argv;
+    for (size_t i=0; i<tokens.size(); i++)
+        argv.push_back(&tokens[i][0]);
+    const int argc = argv.size();
+
+    std::ostringstream err, key;
+    job.settings = defaults_;
+    for (int i=0; i<argc; i++) {
+        bool ok = true;
+        const int first = i;
+        if (parse_render_option(job.settings, argc, &argv[0], i, ok, err)) {
+            if (!ok) break;
+            for (int j=first; j<=i; j++) key << argv[j] << ' ';
+        } else if (!strcmp(argv[i], "--output") && i+1<argc) {
+            job.output = argv[++i];
+            if (!valid_output(job.output)) {
+                err << "invalid output file " << job.output << " (expected a relative path without \"..\")";
+                break;
+            }
+        } else if (!strcmp(argv[i], "--format") && i+1<argc) {
+            if (!TGAImage::parse_format(argv[++i], job.format)) {
+                err << "unknown output format " << argv[i] << " (expected tga, qoi, ppm or pam)";
+                break;
+            }
+        } else if (!strcmp(argv[i], "--frame") && i+1<argc) {
+            job.view = animation_view(atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--eye") && i+1<argc) {
+            if (!parse_vec3(argv[++i], job.view.eye)) {
+                err << "invalid camera position " << argv[i] << " (expected X,Y,Z)";
+                break;
+            }
+            if (!valid_eye(job.view.eye)) {
+                err << "invalid camera position " << argv[i] << " (the camera can't be at the center or right above or below it)";
+                break;
+            }
+        } else if (!strcmp(argv[i], "--light") && i+1<argc) {
+            if (!parse_vec3(argv[++i], job.view.light_dir) || job.view.light_dir.norm()==0.f) {
+                err << "invalid light direction " << argv[i] << " (expected X,Y,Z)";
+                break;
+            }
+        } else if (argv[i][0]=='-') {
+            err << "unknown option " << argv[i];
+            break;
+        } else {
+            job.models.push_back(argv[i]);
+        }
+    }
+    if (err.str().empty()) {
+        if (job.models.empty()) job.models = default_models_;
+        if (job.models.empty())
+            err << "no model to render";
+        // the virtual texture feedback and the extra images of a frame have no place in a reply
+        else if (job.settings.virtual_textures || job.settings.dump_depth || job.settings.heatmap!=HEATMAP_NONE)
+            err << "--virtual-textures, --dump-depth and --heatmap are not available to server jobs";
+        else if (job.settings.band_height && job.format!=TGAImage::TGA)
+            err << "--band-height streams TGA files only";
+        else
+            check_render_settings(job.settings, err);
+    }
+    error = err.str();
+    error.erase(error.find_last_not_of("\n")+1);
+    if (!error.empty()) return false;
+    for (size_t m=0; m<job.models.size(); m++) key << job.models[m] << ' ';
+    job.key = key.str();
+    if (job.output.empty()) {
+        char filename[40];
+        sprintf(filename, "job%04d.%s", job.id, TGAImage::extension(job.format));
+        job.output = filename;
+    }
+    return true;
+}
+
+void RenderServer::submit(Job *job) {
+    pthread_mutex_lock(&mutex_);
+    while ((int)queue_.size()>=settings_.queue && !stopping_)
+        pthread_cond_wait(&not_full_, &mutex_);
+    if (stopping_) {
+        failures_++;
+        pthread_mutex_unlock(&mutex_);
+        std::ostringstream out;
+        out << "error " << job->id << ": the server is shutting down";
+        reply(job->connection, out.str());
+        delete job;
+        return;
+    }
+    queue_.push_back(job);
+    job->depth = queue_.size();
+    max_depth_ = std::max(max_depth_, job->depth);
+    job->connection->refs++;
+    pthread_cond_signal(&not_empty_);
+    pthread_mutex_unlock(&mutex_);
+}
+
+void *RenderServer::work(void *arg) {
+    RenderServer *s = (RenderServer *)arg;
+    for (;;) {
+        pthread_mutex_lock(&s->mutex_);
+        while (s->queue_.empty() && !s->done_)
+            pthread_cond_wait(&s->not_empty_, &s->mutex_);
+        if (s->queue_.empty()) { // done_ and drained
+            pthread_mutex_unlock(&s->mutex_);
+            return NULL;
+        }
+        Job *job = s->queue_.front();
+        s->queue_.pop_front();
+        pthread_cond_signal(&s->not_full_);
+        pthread_mutex_unlock(&s->mutex_);
+
+        s->run_job(*job);
+        s->release(job->connection);
+        delete job;
+    }
+}
+
+void RenderServer::run_job(Job &job) {
+    const double t0 = wall_time();
+    bool created = false;
+    std::string error;
+    Renderer *renderer = acquire_renderer(job, created, error);
+    Frame frame;
+    bool ok = renderer!=NULL;
+    if (renderer && job.settings.band_height) {
+        TGAStreamWriter out;
+        ok = out.open(job.output.c_str(), job.settings.width, job.settings.height, TGAImage::RGB, true, true);
+        if (ok) {
+            frame = renderer->render(job.id, job.view, &out);
+            ok = out.close();
+        }
+    } else if (renderer) {
+        frame = renderer->render(job.id, job.view);
+    }
+    if (renderer) release_renderer(job.key);
+    const double t1 = wall_time();
+    if (frame.image) ok = frame.image->write_file(job.output.c_str(), job.format, true); // bottom left origin, like main
+    if (renderer && !ok) error = "can't write " + job.output;
+    delete frame.image;
+    delete frame.shadow_depth;
+    delete frame.heatmap;
+    delete frame.diff;
+    const double t2 = wall_time();
+
+    std::ostringstream out;
+    pthread_mutex_lock(&mutex_);
+    std::cerr << frame.log;
+    if (ok) {
+        latencies_.push_back((t2-job.submitted)*1000.);
+        wait_total_ += (t0-job.submitted)*1000.;
+        render_total_ += (t1-t0)*1000.;
+    } else {
+        failures_++;
+    }
+    pthread_mutex_unlock(&mutex_);
+    if (ok)
+        out << "ok " << job.id << " " << job.output << ": queue " << (t0-job.submitted)*1000. << " ms, render " << (t1-t0)*1000.
+            << " ms, write " << (t2-t1)*1000. << " ms, total " << (t2-job.submitted)*1000. << " ms (queue depth " << job.depth
+            << (created ? ", new renderer)" : ")");
+    else
+        out << "error " << job.id << ": " << error;
+    reply(job.connection, out.str());
+}
+
+// Jobs with the same render options and models share a Renderer. It is built outside the lock, a job
+// that needs a warm renderer does not wait for another one being built; when two jobs race to build
+// the same one, the loser's is dropped.
+Renderer *RenderServer::acquire_renderer(const Job &job, bool &created, std::string &error) {
+    pthread_mutex_lock(&renderers_mutex_);
+    std::map<std::string, Entry>::iterator it = renderers_.find(job.key);
+    if (it!=renderers_.end()) {
+        it->second.users++;
+        renderers_reused_++;
+        pthread_mutex_unlock(&renderers_mutex_);
+        return it->second.renderer;
+    }
+    pthread_mutex_unlock(&renderers_mutex_);
+
+    std::vector<const char *> names;
+    for (size_t m=0; m<job.models.size(); m++) {
+        if (!models_.load(job.models[m])) {
+            error = "can't open file " + job.models[m];
+            return NULL;
+        }
+        names.push_back(job.models[m].c_str());
+    }
+    for (size_t m=0; m<job.settings.translucent.size(); m++) {
+        if (!models_.load(job.settings.translucent[m])) {
+            error = "can't open file " + job.settings.translucent[m];
+            return NULL;
+        }
+    }
+    Renderer *renderer = new Renderer(job.settings, names, &models_);
+
+    pthread_mutex_lock(&renderers_mutex_);
+    it = renderers_.find(job.key);
+    if (it!=renderers_.end()) {
+        delete renderer;
+        renderer = it->second.renderer;
+        it->second.users++;
+        renderers_reused_++;
+    } else {
+        Entry e = {renderer, 1, wall_time()};
+        renderers_[job.key] = e;
+        renderers_created_++;
+        created = true;
+    }
+    pthread_mutex_unlock(&renderers_mutex_);
+    return renderer;
+}
+
+void RenderServer::release_renderer(const std::string &key) {
+    pthread_mutex_lock(&renderers_mutex_);
+    Entry &e = renderers_[key];
+    e.users--;
+    e.last_used = wall_time();
+    // beyond the limit, the least recently used idle renderers go (with their shadow maps and targets)
+    while ((int)renderers_.size()>settings_.renderers) {
+        std::map<std::string, Entry>::iterator lru = renderers_.end();
+        for (std::map<std::string, Entry>::iterator it=renderers_.begin(); it!=renderers_.end(); ++it)
+            if (!it->second.users && (lru==renderers_.end() || it->second.last_used<lru->second.last_used)) lru = it;
+        if (lru==renderers_.end()) break; // all in use
+        delete lru->second.renderer;
+        renderers_.erase(lru);
+        renderers_evicted_++;
+    }
+    pthread_mutex_unlock(&renderers_mutex_);
+}
+
+void RenderServer::reply(Connection *c, const std::string &line) {
+    std::string msg = line + "\n";
+    pthread_mutex_lock(&c->write_mutex);
+    for (size_t done=0; done<msg.size(); ) {
+        ssize_t n = write(c->out, msg.data()+done, msg.size()-done);
+        if (n<0 && errno==EINTR) continue;
+        if (n<=0) break; // the client is gone
+        done += n;
+    }
+    pthread_mutex_unlock(&c->write_mutex);
+}
+
+void RenderServer::release(Connection *c) {
+    pthread_mutex_lock(&mutex_);
+    const bool last = --c->refs==0;
+    if (last) connections_.erase(std::remove(connections_.begin(), connections_.end(), c), connections_.end());
+    pthread_mutex_unlock(&mutex_);
+    if (!last) return;
+    if (c->socket) close(c->in);
+    pthread_mutex_destroy(&c->write_mutex);
+    delete c;
+}
+
+void RenderServer::stop() {
+    pthread_mutex_lock(&mutex_);
+    stopping_ = true;
+    pthread_cond_broadcast(&not_full_);
+    if (listen_fd_>=0) shutdown(listen_fd_, SHUT_RDWR); // wakes up accept()
+    pthread_mutex_unlock(&mutex_);
+}
+
+void RenderServer::finish() {
+    pthread_mutex_lock(&mutex_);
+    done_ = true;
+    pthread_cond_broadcast(&not_empty_);
+    pthread_mutex_unlock(&mutex_);
+    for (size_t i=0; i<threads_.size(); i++)
+        pthread_join(threads_[i], NULL);
+    threads_.clear();
+}
+
+void RenderServer::report(std::ostream &out) {
+    pthread_mutex_lock(&mutex_);
+    std::vector<double> lat(latencies_);
+    const int failed = failures_, max_depth = max_depth_, depth = queue_.size();
+    const double wait = wait_total_, render = render_total_;
+    pthread_mutex_unlock(&mutex_);
+    std::sort(lat.begin(), lat.end());
+    out << lat.size() << " jobs done, " << failed << " failed";
+    if (!lat.empty()) {
+        double total = 0;
+        for (size_t i=0; i<lat.size(); i++) total += lat[i];
+        out << ", latency mean " << total/lat.size() << " ms, p50 " << lat[lat.size()/2] << " ms, p95 "
+            << lat[std::min(lat.size()-1, lat.size()*95/100)] << " ms, max " << lat.back() << " ms (queue "
+            << wait/lat.size() << " ms, render " << render/lat.size() << " ms on average)";
+    }
+    out << "; queue depth " << depth << ", max " << max_depth << "; " << models_.size() << " models loaded, "
+        << models_.hits() << " lookups served from memory, " << models_.evictions() << " dropped";
+    pthread_mutex_lock(&renderers_mutex_);
+    out << "; renderers: " << renderers_.size() << " warm, " << renderers_created_ << " built, " << renderers_reused_
+        << " reused, " << renderers_evicted_ << " dropped";
+    pthread_mutex_unlock(&renderers_mutex_);
+}
+
+int RenderServer::failures() {
+    pthread_mutex_lock(&mutex_);
+    int n = failures_;
+    pthread_mutex_unlock(&mutex_);
+    return n;
+}
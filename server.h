@@ -0,0 +1,126 @@
+#ifndef __SERVER_H__
+#define __SERVER_H__
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <ostream>
+#include <pthread.h>
+#include "tgaimage.h"
+#include "model.h"
+#include "renderer.h"
+
+// A resident renderer: render jobs arrive as text lines on stdin or on a Unix domain socket and are
+// rendered by a pool of worker threads. Models stay loaded between jobs (ModelCache), and jobs with
+// the same render options share a Renderer, so its shadow map caches and render targets stay warm.
+//
+// A job line takes the render options of the command line (--size, --shader, --shadows, ...), the
+// models to draw (the ones given at startup when there are none) and:
+//   --output FILE          where to write the image (default jobN.<format>), relative to the server's
+//                          working directory: absolute paths and ".." components are rejected
+//   --format tga|qoi|ppm|pam
+//   --frame K              camera and light of frame K of the command line animation
+//   --eye X,Y,Z            camera position, looking at the origin
+//   --light X,Y,Z          direction towards the main light
+// Every job gets one reply line on its connection, in completion order:
+//   ok N FILE: queue Q ms, render R ms, write W ms, total T ms (queue depth D)
+//   error N: MESSAGE
+// "stats" replies with the server statistics and "quit" stops the server once the queued jobs are done.
+struct ServerSettings {
+    ServerSettings();
+    int threads;   // jobs rendered at once
+    int queue;     // jobs waiting for a worker before the readers block
+    int renderers; // Renderers kept once idle, least recently used ones are dropped first
+    int models;    // models kept loaded, beyond the ones warm Renderers hold; 0 keeps every model
+};
+
+class RenderServer {
+public:
+    // defaults: the settings every job starts from; models: the default scene, loaded right away
+    RenderServer(const ServerSettings &settings, const RenderSettings &defaults, const std::vector<const char *> &models);
+    ~RenderServer();
+    // serves the jobs read from stdin, replying on stdout, until the end of the input or "quit"
+    bool serve_stdio();
+    // serves every client of a Unix domain socket created at path until one of them sends "quit"
+    bool serve_socket(const char *path);
+    // jobs, latency percentiles, queue depth and cache reuse
+    void report(std::ostream &out);
+    int failures();
+private:
+    RenderServer(const RenderServer &);
+    RenderServer &operator=(const RenderServer &);
+
+    struct Connection {
+        Connection(RenderServer *s, int in_fd, int out_fd, bool sock);
+        RenderServer *server;
+        int in, out;
+        bool socket; // closed with the connection, stdin and stdout are not
+        int refs;    // the reader and the jobs still to reply to, under the server mutex
+        pthread_mutex_t write_mutex;
+    };
+    struct Job {
+        Job();
+        int id;
+        Connection *connection;
+        RenderSettings settings;
+        std::string key; // the render options and models, jobs with the same key share a Renderer
+        std::vector<std::string> models;
+        FrameView view;
+        std::string output;
+        TGAImage::FileFormat format;
+        double submitted;
+        int depth; // queued jobs, this one included, when it was submitted
+    private:
+        Job(const Job &);
+        Job &operator=(const Job &);
+    };
+    struct Entry {
+        Renderer *renderer;
+        int users;
+        double last_used;
+    };
+
+    // reads and handles the lines of a connection until its end or "quit"
+    void read_lines(Connection *c);
+    // false once the server is stopping
+    bool handle_line(Connection *c, std::string line);
+    bool parse_job(const std::string &line, Job &job, std::string &error);
+    void submit(Job *job);
+    void run_job(Job &job);
+    Renderer *acquire_renderer(const Job &job, bool &created, std::string &error);
+    void release_renderer(const std::string &key);
+    void reply(Connection *c, const std::string &line);
+    void release(Connection *c);
+    void stop();
+    void finish();
+    static void *work(void *arg);
+    static void *read_connection(void *arg);
+
+    ServerSettings settings_;
+    RenderSettings defaults_;
+    std::vector<std::string> default_models_;
+    ModelCache models_;
+    std::map<std::string, Entry> renderers_;
+    pthread_mutex_t renderers_mutex_;
+    int renderers_created_, renderers_reused_, renderers_evicted_;
+
+    std::deque<Job *> queue_;
+    std::vector<pthread_t> threads_;
+    std::vector<Connection *> connections_; // open socket connections
+    pthread_mutex_t mutex_;
+    pthread_cond_t not_empty_;
+    pthread_cond_t not_full_;
+    pthread_cond_t readers_done_;
+    int readers_;
+    int listen_fd_;
+    bool stopping_; // no more jobs are accepted
+    bool done_;     // workers exit once the queue is empty
+    int next_id_;
+    int failures_;
+    int max_depth_;
+    std::vector<double> latencies_; // ms, submission to reply, of the successful jobs
+    double wait_total_;             // ms spent in the queue
+    double render_total_;
+};
+
+#endif //__SERVER_H__
@@ -0,0 +1,567 @@
+#include <algorithm>
+#include "shaders.h"
+#include "framebuffer.h"
+
+SceneShader::SceneShader(const RenderContext &context) : ctx(context), model(NULL), uv_footprint(-1e30f) {}
+
+ShaderParams::ShaderParams() : shadow(NULL), shadow_mask(NULL), shadow_mask_width(0), shadow_mask_height(0), shadow_filter(SHADOW_HARD), pcf_size(5), shadow_bias(50.f), lights(NULL), light_grid(NULL) {}
+
+struct GouraudShader : public SceneShader
+{
+    mat<3, 3, float> varying_tri; // 变换后的顶点坐标
+    Vec3f varying_intensity;      // 顶点着色器写入，片段着色器读取
+
+    GouraudShader(const RenderContext &context) : SceneShader(context), varying_tri(), varying_intensity() {}
+
+    // iface为面的序号，nthvert为顶点序号
+    virtual Vec4f vertex(int iface, int nthvert)
+    {
+        // 从.obj文件读取顶点坐标，并转换到裁剪空间
+        Vec4f gl_Vertex = embed<4>(model->vert(iface, nthvert));
+        gl_Vertex = ctx.Viewport * ctx.Projection * ctx.ModelView * gl_Vertex;
+        varying_tri.set_col(nthvert, proj<3>(gl_Vertex / gl_Vertex[3]));
+        // 计算光照强度
+        varying_intensity[nthvert] = std::max(0.f, model->normal(iface, nthvert) * ctx.light_dir);
+        return gl_Vertex;
+    }
+
+    // bar为三角形重心坐标
+    virtual bool fragment(Vec3f bar, TGAColor &color)
+    {
+        // 为当前像素计算强度插值，并着色
+        float intensity = varying_intensity * bar;
+        color = TGAColor(255, 255, 255) * intensity;
+        return false;
+    }
+};
+
+struct StylizedGouraudShader : public SceneShader
+{
+    mat<3, 3, float> varying_tri; // 变换后的顶点坐标
+    Vec3f varying_intensity;      // 顶点着色器写入，片段着色器读取
+
+    StylizedGouraudShader(const RenderContext &context) : SceneShader(context), varying_tri(), varying_intensity() {}
+
+    // iface为面的序号，nthvert为顶点序号
+    virtual Vec4f vertex(int iface, int nthvert)
+    {
+        // 从.obj文件读取顶点坐标，并转换到裁剪空间
+        Vec4f gl_Vertex = embed<4>(model->vert(iface, nthvert));
+        gl_Vertex = ctx.Viewport * ctx.Projection * ctx.ModelView * gl_Vertex;
+        varying_tri.set_col(nthvert, proj<3>(gl_Vertex / gl_Vertex[3]));
+        // 计算光照强度
+        varying_intensity[nthvert] = std::max(0.f, model->normal(iface, nthvert) * ctx.light_dir);
+        return gl_Vertex;
+    }
+
+    // bar为三角形重心坐标
+    virtual bool fragment(Vec3f bar, TGAColor &color)
+    {
+        // 为当前像素计算强度插值，并着色
+        float intensity = varying_intensity * bar;
+        if (intensity > .85)
+            intensity = 1;
+        else if (intensity > .60)
+            intensity = .80;
+        else if (intensity > .45)
+            intensity = .60;
+        else if (intensity > .30)
+            intensity = .45;
+        else if (intensity > .15)
+            intensity = .30;
+        else
+            intensity = 0;
+        color = TGAColor(255, 155, 0) * intensity;
+        return false;
+    }
+};
+
+struct TextureGouraudShader : public SceneShader
+{
+    mat<3, 3, float> varying_tri; // 变换后的顶点坐标
+    Vec3f varying_intensity;      // 顶点着色器写入，片段着色器读取
+    mat<2, 3, float> varying_uv;  // uv坐标，对应三个顶点
+
+    TextureGouraudShader(const RenderContext &context) : SceneShader(context), varying_tri(), varying_intensity(), varying_uv() {}
+
+    virtual Vec4f vertex(int iface, int nthvert)
+    {
+        // 从.obj文件读取顶点坐标，并转换到裁剪空间
+        Vec4f gl_Vertex = embed<4>(model->vert(iface, nthvert));
+        gl_Vertex = ctx.Viewport * ctx.Projection * ctx.ModelView * gl_Vertex;
+        varying_tri.set_col(nthvert, proj<3>(gl_Vertex / gl_Vertex[3]));
+        // 从obj文件读取uv坐标
+        varying_uv.set_col(nthvert, model->uv(iface, nthvert));
+        // 计算光照强度
+        varying_intensity[nthvert] = std::max(0.f, model->normal(iface, nthvert) * ctx.light_dir);
+        return gl_Vertex;
+    }
+
+    virtual bool fragment(Vec3f bar, TGAColor &color)
+    {
+        // 为当前像素计算强度插值，采样纹理，并着色
+        float intensity = varying_intensity * bar;
+        Vec2f uv = varying_uv * bar;
+        color = model->diffuse(uv, uv_footprint) * intensity;
+        return false;
+    }
+};
+
+struct NormalMapShader : public SceneShader
+{
+    mat<3, 3, float> varying_tri; // 变换后的顶点坐标
+    mat<2, 3, float> varying_uv;  // uv坐标，对应三个顶点
+    mat<4, 4, float> uniform_M;   //  Projection*ModelView
+    mat<4, 4, float> uniform_MIT; // (Projection*ModelView).invert_transpose()
+    Vec3f uniform_l;              // 投影空间中的光源方向，每次绘制只计算一次
+
+    NormalMapShader(const RenderContext &context) : SceneShader(context), varying_tri(), varying_uv(), uniform_M(), uniform_MIT(), uniform_l() {}
+
+    virtual void prepare()
+    {
+        uniform_l = proj<3>(uniform_M * embed<4>(ctx.light_dir)).normalize();
+    }
+
+    virtual Vec4f vertex(int iface, int nthvert)
+    {
+        // 从.obj文件读取顶点坐标，并转换到裁剪空间
+        Vec4f gl_Vertex = embed<4>(model->vert(iface, nthvert));
+        gl_Vertex = ctx.Viewport * ctx.Projection * ctx.ModelView * gl_Vertex;
+        varying_tri.set_col(nthvert, proj<3>(gl_Vertex / gl_Vertex[3]));
+        // 从obj文件读取uv坐标
+        varying_uv.set_col(nthvert, model->uv(iface, nthvert));
+        return gl_Vertex;
+    }
+
+    virtual bool fragment(Vec3f bar, TGAColor &color)
+    {
+        // 为当前像素计算uv坐标插值
+        Vec2f uv = varying_uv * bar;
+        // 将法线转换到投影空间
+        Vec3f n = proj<3>(uniform_MIT * embed<4>(model->normal(uv, uv_footprint))).normalize();
+        // 投影空间中的光源方向（prepare()中已计算）
+        const Vec3f &l = uniform_l;
+        // 着色
+        float intensity = std::max(0.f, n * l);
+        color = model->diffuse(uv, uv_footprint) * intensity;
+        return false;
+    }
+};
+
+struct PhongShader : public SceneShader
+{
+    mat<3, 3, float> varying_tri; // 变换后的顶点坐标
+    mat<2, 3, float> varying_uv;  // uv坐标，对应三个顶点
+    mat<4, 4, float> uniform_M;   //  Projection*ModelView
+    mat<4, 4, float> uniform_MIT; // (Projection*ModelView).invert_transpose()
+    Vec3f uniform_l;              // 投影空间中的光源方向，每次绘制只计算一次
+
+    PhongShader(const RenderContext &context) : SceneShader(context), varying_tri(), varying_uv(), uniform_M(), uniform_MIT(), uniform_l() {}
+
+    virtual void prepare()
+    {
+        uniform_l = proj<3>(uniform_M * embed<4>(ctx.light_dir)).normalize();
+    }
+
+    virtual Vec4f vertex(int iface, int nthvert)
+    {
+        // 从.obj文件读取顶点坐标，并转换到裁剪空间
+        Vec4f gl_Vertex = embed<4>(model->vert(iface, nthvert));
+        gl_Vertex = ctx.Viewport * ctx.Projection * ctx.ModelView * gl_Vertex;
+        varying_tri.set_col(nthvert, proj<3>(gl_Vertex / gl_Vertex[3]));
+        // 从obj文件读取uv坐标
+        varying_uv.set_col(nthvert, model->uv(iface, nthvert));
+        return gl_Vertex;
+    }
+
+    // 计算漫反射与高光强度系数，返回插值后的uv坐标
+    Vec2f shade(Vec3f bar, float &diff, float &spec)
+    {
+        // 为当前像素计算uv坐标插值
+        Vec2f uv = varying_uv * bar;
+        // 将法线转换到投影空间
+        Vec3f n = proj<3>(uniform_MIT * embed<4>(model->normal(uv, uv_footprint))).normalize();
+        // 投影空间中的光源方向（prepare()中已计算）
+        const Vec3f &l = uniform_l;
+        // 计算反射光线
+        Vec3f r = (n * (n * l * 2.f) - l).normalize();
+        // 计算高光强度系数
+        spec = spec_pow(std::max(r.z, 0.0f), model->specular(uv, uv_footprint));
+        // 计算漫反射强度系数
+        diff = std::max(0.f, n * l);
+        return uv;
+    }
+
+    virtual bool fragment(Vec3f bar, TGAColor &color)
+    {
+        float diff, spec;
+        Vec2f uv = shade(bar, diff, spec);
+        // 读取漫反射纹理颜色
+        TGAColor c = model->diffuse(uv, uv_footprint);
+        // 着色
+        color = c;
+        for (int i = 0; i < 3; i++)
+            color[i] = std::min<float>(5 + c[i] * (diff + .6 * spec), 255);
+        return false;
+    }
+
+    virtual bool fragment_hdr(Vec3f bar, const GammaTable &gamma, Vec4f &color)
+    {
+        float diff, spec;
+        Vec2f uv = shade(bar, diff, spec);
+        // 线性空间中着色，不截断（TGAColor按BGR存放）
+        TGAColor c = model->diffuse(uv, uv_footprint);
+        for (int i = 0; i < 3; i++)
+            color[i] = gamma.decode(5) + gamma.decode(c[2 - i]) * (diff + .6f * spec);
+        color[3] = 1.f;
+        return false;
+    }
+};
+
+struct TangentNormalMapShader : public SceneShader
+{
+    mat<2, 3, float> varying_uv;  // uv坐标，对应三个顶点
+    mat<3, 3, float> varying_tri; // 变换后的顶点坐标
+    mat<3, 3, float> varying_nrm; // 变换后的顶点法线
+    mat<3, 3, float> varying_tan; // 变换后的顶点切线（模型加载时预计算）
+    Vec3f varying_sign;           // 副切线方向的符号
+    mat<4, 4, float> uniform_M;   //  Projection*ModelView
+    mat<4, 4, float> uniform_MIT; // (Projection*ModelView).invert_transpose()
+    Vec3f uniform_l;              // 投影空间中的光源方向，每次绘制只计算一次
+
+    TangentNormalMapShader(const RenderContext &context) : SceneShader(context), varying_uv(), varying_tri(), varying_nrm(), varying_tan(), varying_sign(), uniform_M(), uniform_MIT(), uniform_l() {}
+
+    virtual void prepare()
+    {
+        uniform_l = proj<3>(uniform_M * embed<4>(ctx.light_dir)).normalize();
+    }
+
+    virtual Vec4f vertex(int iface, int nthvert)
+    {
+        // 从.obj文件读取顶点坐标，并转换到裁剪空间
+        Vec4f gl_Vertex = embed<4>(model->vert(iface, nthvert));
+        gl_Vertex = ctx.Viewport * ctx.Projection * ctx.ModelView * gl_Vertex;
+        varying_tri.set_col(nthvert, proj<3>(gl_Vertex / gl_Vertex[3]));
+        // 从obj文件读取uv坐标
+        varying_uv.set_col(nthvert, model->uv(iface, nthvert));
+        // 从.obj文件读取顶点法线，并转换到裁剪空间
+        varying_nrm.set_col(nthvert, proj<3>(uniform_MIT * embed<4>(model->normal(iface, nthvert), 0.f)));
+        // 切线是表面上的方向，用M而不是MIT变换
+        Vec4f t = model->tangent(iface, nthvert);
+        varying_tan.set_col(nthvert, proj<3>(uniform_M * embed<4>(proj<3>(t), 0.f)));
+        varying_sign[nthvert] = t[3];
+        return gl_Vertex;
+    }
+
+    virtual bool fragment(Vec3f bar, TGAColor &color)
+    {
+        // 为当前像素插值法线与切线，重新正交化后得到切线空间基
+        Vec3f bn = (varying_nrm * bar).normalize();
+        Vec3f t = varying_tan * bar;
+        t = (t - bn * (bn * t)).normalize();
+        Vec3f b = cross(bn, t) * (varying_sign * bar < 0.f ? -1.f : 1.f);
+        // 为当前像素计算uv坐标插值
+        Vec2f uv = varying_uv * bar;
+
+        Vec3f tn = model->tangent_normal(uv, uv_footprint);
+        Vec3f n = (t * tn.x + b * tn.y + bn * tn.z).normalize();
+
+        // 着色
+        float diff = std::max(0.f, n * uniform_l);
+        color = model->diffuse(uv, uv_footprint) * diff;
+
+        return false;
+    }
+};
+
+struct ShadowShader : public SceneShader
+{
+    mat<4, 4, float> uniform_M;       //  Projection*ModelView
+    mat<4, 4, float> uniform_MIT;     // (Projection*ModelView).invert_transpose()
+    mat<4, 4, float> uniform_Mshadow; // transform framebuffer screen coordinates to shadowbuffer screen coordinates
+    const ShadowMap *uniform_shadow; // the shadow map, its resolution is independent of the framebuffer
+    const float *uniform_mask;       // or, when not NULL, the visibility of each framebuffer pixel (ray traced)
+    int uniform_mask_width;
+    int uniform_mask_height;
+    ShadowFilter uniform_filter;     // hard, PCF or VSM lookups
+    int uniform_pcf_size;            // PCF footprint is uniform_pcf_size x uniform_pcf_size texels
+    float uniform_bias;              // depth bias against shadow acne
+    Vec3f uniform_l;                 // light direction in clip space, evaluated once per draw by prepare()
+    mat<2, 3, float> varying_uv;      // triangle uv coordinates, written by the vertex shader, read by the fragment shader
+    mat<3, 3, float> varying_tri;     // triangle coordinates before Viewport transform, written by VS, read by FS
+
+    ShadowShader(const RenderContext &context, Matrix M, Matrix MIT, Matrix MS, const ShadowMap *SM, ShadowFilter filter = SHADOW_HARD, int pcf_size = 5, float bias = 50.f)
+        : SceneShader(context), uniform_M(M), uniform_MIT(MIT), uniform_Mshadow(MS), uniform_shadow(SM), uniform_mask(NULL), uniform_mask_width(0),
+          uniform_mask_height(0), uniform_filter(filter), uniform_pcf_size(pcf_size), uniform_bias(bias), uniform_l(), varying_uv(), varying_tri() {}
+
+    virtual void prepare()
+    {
+        uniform_l = proj<3>(uniform_M * embed<4>(ctx.light_dir)).normalize();
+    }
+
+    virtual Vec4f vertex(int iface, int nthvert)
+    {
+        varying_uv.set_col(nthvert, model->uv(iface, nthvert));
+        Vec4f gl_Vertex = ctx.Viewport * ctx.Projection * ctx.ModelView * embed<4>(model->vert(iface, nthvert));
+        varying_tri.set_col(nthvert, proj<3>(gl_Vertex / gl_Vertex[3]));
+        return gl_Vertex;
+    }
+
+    // shadow, diffuse and specular factors of the fragment, returns its uv coordinates
+    Vec2f shade(Vec3f bar, float &shadow, float &diff, float &spec)
+    {
+        if (uniform_mask)
+        {
+            // 片段所在的像素（重心坐标在整数像素坐标处求得）
+            Vec3f p = varying_tri * bar;
+            int x = std::max(0, std::min(uniform_mask_width - 1, int(p.x + .5f)));
+            int y = std::max(0, std::min(uniform_mask_height - 1, int(p.y + .5f)));
+            shadow = .1 + .9 * uniform_mask[x + y * uniform_mask_width];
+        }
+        else
+        {
+            Vec4f sb_p = uniform_Mshadow * embed<4>(varying_tri * bar); // corresponding point in the shadow buffer
+            sb_p = sb_p / sb_p[3];
+            shadow = .1 + .9 * uniform_shadow->visibility(uniform_filter, int(sb_p[0]), int(sb_p[1]), sb_p[2], uniform_bias, uniform_pcf_size);
+        }
+        // 插值uv坐标
+        Vec2f uv = varying_uv * bar;
+        // 将法线转换到投影空间
+        Vec3f n = proj<3>(uniform_MIT * embed<4>(model->normal(uv, uv_footprint))).normalize();
+        // 投影空间中的光源方向（prepare()中已计算）
+        const Vec3f &l = uniform_l;
+        // 计算反射光线
+        Vec3f r = (n * (n * l * 2.f) - l).normalize();
+        // 计算高光强度系数
+        spec = spec_pow(std::max(r.z, 0.0f), model->specular(uv, uv_footprint));
+        // 计算漫反射强度系数
+        diff = std::max(0.f, n * l);
+        return uv;
+    }
+
+    virtual bool fragment(Vec3f bar, TGAColor &color)
+    {
+        float shadow, diff, spec;
+        Vec2f uv = shade(bar, shadow, diff, spec);
+        // 读取漫反射纹理
+        TGAColor c = model->diffuse(uv, uv_footprint);
+        // 着色
+        for (int i = 0; i < 3; i++)
+            color[i] = std::min<float>(20 + c[i] * shadow * (1.2 * diff + .6 * spec), 255);
+        return false;
+    }
+
+    virtual bool fragment_hdr(Vec3f bar, const GammaTable &gamma, Vec4f &color)
+    {
+        float shadow, diff, spec;
+        Vec2f uv = shade(bar, shadow, diff, spec);
+        TGAColor c = model->diffuse(uv, uv_footprint);
+        for (int i = 0; i < 3; i++)
+            color[i] = gamma.decode(20) + gamma.decode(c[2 - i]) * shadow * (1.2f * diff + .6f * spec);
+        color[3] = 1.f;
+        return false;
+    }
+
+private:
+    ShadowShader(const ShadowShader &);
+    ShadowShader &operator=(const ShadowShader &);
+};
+
+struct MultiLightShader : public SceneShader
+{
+    const std::vector<Light> &uniform_lights; // all the lights of the scene, in world space
+    const LightGrid &uniform_grid;            // per screen tile lists of the lights that can reach it
+    mat<2, 3, float> varying_uv;              // triangle uv coordinates
+    mat<3, 3, float> varying_tri;             // triangle screen coordinates, used to find the tile of the fragment
+    mat<3, 3, float> varying_pos;             // triangle world coordinates, the lights are evaluated in world space
+
+    MultiLightShader(const RenderContext &context, const std::vector<Light> &lights, const LightGrid &grid)
+        : SceneShader(context), uniform_lights(lights), uniform_grid(grid), varying_uv(), varying_tri(), varying_pos() {}
+
+    virtual Vec4f vertex(int iface, int nthvert)
+    {
+        Vec3f v = model->vert(iface, nthvert);
+        varying_uv.set_col(nthvert, model->uv(iface, nthvert));
+        varying_pos.set_col(nthvert, v);
+        Vec4f gl_Vertex = ctx.Viewport * ctx.Projection * ctx.ModelView * embed<4>(v);
+        varying_tri.set_col(nthvert, proj<3>(gl_Vertex / gl_Vertex[3]));
+        return gl_Vertex;
+    }
+
+    // 所有光源照射到该片段的辐照度，返回插值后的uv坐标
+    Vec2f shade(Vec3f bar, Vec3f &irradiance)
+    {
+        Vec2f uv = varying_uv * bar;
+        Vec3f p = varying_pos * bar;
+        Vec3f s = varying_tri * bar;
+        // 法线贴图在模型空间，模型空间即世界空间
+        Vec3f n = model->normal(uv, uv_footprint);
+        // 只遍历当前像素所在tile的光源列表
+        irradiance = Vec3f(.1f, .1f, .1f);
+        int count = 0;
+        const int *idx = uniform_grid.lights_at(int(s.x), int(s.y), count);
+        for (int i = 0; i < count; i++)
+            irradiance = irradiance + uniform_lights[idx[i]].illuminate(p, n);
+        return uv;
+    }
+
+    virtual bool fragment(Vec3f bar, TGAColor &color)
+    {
+        Vec3f irradiance;
+        Vec2f uv = shade(bar, irradiance);
+        TGAColor c = model->diffuse(uv, uv_footprint);
+        color = c;
+        // TGAColor按BGR存放
+        for (int i = 0; i < 3; i++)
+            color[i] = std::min<float>(c[i] * irradiance[2 - i], 255);
+        return false;
+    }
+
+    virtual bool fragment_hdr(Vec3f bar, const GammaTable &gamma, Vec4f &color)
+    {
+        Vec3f irradiance;
+        Vec2f uv = shade(bar, irradiance);
+        TGAColor c = model->diffuse(uv, uv_footprint);
+        for (int i = 0; i < 3; i++)
+            color[i] = gamma.decode(c[2 - i]) * irradiance[i];
+        color[3] = 1.f;
+        return false;
+    }
+};
+
+struct DepthShader : public SceneShader
+{
+    mat<3, 3, float> varying_tri;
+
+    DepthShader(const RenderContext &context) : SceneShader(context), varying_tri() {}
+
+    virtual Vec4f vertex(int iface, int nthvert)
+    {
+        Vec4f gl_Vertex = embed<4>(model->vert(iface, nthvert));   // read the vertex from .obj file
+        gl_Vertex = ctx.Viewport * ctx.Projection * ctx.ModelView * gl_Vertex; // transform it to screen coordinates
+        varying_tri.set_col(nthvert, proj<3>(gl_Vertex / gl_Vertex[3]));
+        return gl_Vertex;
+    }
+
+    virtual bool fragment(Vec3f bar, TGAColor &color)
+    {
+        Vec3f p = varying_tri * bar;
+        color = TGAColor(255, 255, 255) * (p.z / depth);
+        return false;
+    }
+};
+
+// 自发光贴图：只输出_glow.tga的颜色，渲染到单独的缓冲中供泛光使用
+struct GlowShader : public SceneShader
+{
+    mat<2, 3, float> varying_uv;
+
+    GlowShader(const RenderContext &context) : SceneShader(context), varying_uv() {}
+
+    virtual Vec4f vertex(int iface, int nthvert)
+    {
+        varying_uv.set_col(nthvert, model->uv(iface, nthvert));
+        return ctx.Viewport * ctx.Projection * ctx.ModelView * embed<4>(model->vert(iface, nthvert));
+    }
+
+    virtual bool fragment(Vec3f bar, TGAColor &color)
+    {
+        color = model->glow(varying_uv * bar, uv_footprint);
+        return false;
+    }
+};
+
+// 半透明模型：颜色由内部着色器计算，不透明度为漫反射贴图的alpha乘以整体的opacity，写入color[3]供OIT使用
+struct TranslucentShader : public SceneShader
+{
+    SceneShader *inner;   // 持有
+    float opacity;
+    mat<2, 3, float> varying_uv;
+
+    TranslucentShader(SceneShader *shader, float alpha) : SceneShader(shader->ctx), inner(shader), opacity(alpha), varying_uv() {}
+    virtual ~TranslucentShader() { delete inner; }
+
+    virtual void prepare()
+    {
+        inner->prepare();
+    }
+
+    virtual Vec4f vertex(int iface, int nthvert)
+    {
+        inner->model = model;
+        varying_uv.set_col(nthvert, model->uv(iface, nthvert));
+        return inner->vertex(iface, nthvert);
+    }
+
+    virtual bool fragment(Vec3f bar, TGAColor &color)
+    {
+        inner->uv_footprint = uv_footprint;
+        if (inner->fragment(bar, color))
+            return true;
+        TGAColor diffuse = model->diffuse(varying_uv * bar, uv_footprint);
+        float alpha = (diffuse.bytespp == 4 ? diffuse.bgra[3] : 255) * opacity;
+        color.bgra[3] = std::min(255.f, alpha + .5f);
+        return false;
+    }
+
+private:
+    TranslucentShader(const TranslucentShader &);
+    TranslucentShader &operator=(const TranslucentShader &);
+};
+
+SceneShader *make_translucent_shader(SceneShader *shader, float opacity)
+{
+    return new TranslucentShader(shader, opacity);
+}
+
+const char *shader_names[] = {"gouraud", "stylized", "texture", "normalmap", "phong", "tangent", "shadow", "lights"};
+const int nshaders = sizeof(shader_names) / sizeof(shader_names[0]);
+
+SceneShader *make_shader(const std::string &name, const RenderContext &ctx, const ShaderParams &params)
+{
+    Matrix M = ctx.Projection * ctx.ModelView;
+    if (name == "gouraud")
+        return new GouraudShader(ctx);
+    if (name == "stylized")
+        return new StylizedGouraudShader(ctx);
+    if (name == "texture")
+        return new TextureGouraudShader(ctx);
+    if (name == "normalmap")
+    {
+        NormalMapShader *shader = new NormalMapShader(ctx);
+        shader->uniform_M = M;
+        shader->uniform_MIT = M.invert_transpose();
+        return shader;
+    }
+    if (name == "phong")
+    {
+        PhongShader *shader = new PhongShader(ctx);
+        shader->uniform_M = M;
+        shader->uniform_MIT = M.invert_transpose();
+        return shader;
+    }
+    if (name == "tangent")
+    {
+        TangentNormalMapShader *shader = new TangentNormalMapShader(ctx);
+        shader->uniform_M = M;
+        shader->uniform_MIT = M.invert_transpose();
+        return shader;
+    }
+    if (name == "lights")
+        return new MultiLightShader(ctx, *params.lights, *params.light_grid);
+    if (name == "glow")
+        return new GlowShader(ctx);
+    if (name == "depth")
+        return new DepthShader(ctx);
+    if (params.shadow_mask)
+    {
+        ShadowShader *shader = new ShadowShader(ctx, M, M.invert_transpose(), Matrix::identity(), NULL);
+        shader->uniform_mask = params.shadow_mask;
+        shader->uniform_mask_width = params.shadow_mask_width;
+        shader->uniform_mask_height = params.shadow_mask_height;
+        return shader;
+    }
+    const ShadowMap &shadow = *params.shadow;
+    return new ShadowShader(ctx, M, M.invert_transpose(), shadow.M * (ctx.Viewport * ctx.Projection * ctx.ModelView).invert(), &shadow,
+                            params.shadow_filter, params.pcf_size, params.shadow_bias);
+}
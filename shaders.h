@@ -0,0 +1,49 @@
+#ifndef __SHADERS_H__
+#define __SHADERS_H__
+#include <string>
+#include <vector>
+#include "our_gl.h"
+#include "model.h"
+#include "shadowmap.h"
+#include "lights.h"
+
+// 场景着色器的公共部分：帧上下文（变换矩阵、相机、光源）和当前绘制的模型
+struct SceneShader : public IShader
+{
+    SceneShader(const RenderContext &context);
+
+    const RenderContext &ctx;
+    Model *model;       // 绘制每个模型之前设置
+    float uv_footprint; // 每个三角形之前设置：一个像素覆盖的uv距离的log2，虚拟纹理据此选择mip层级
+
+private:
+    SceneShader(const SceneShader &);
+    SceneShader &operator=(const SceneShader &);
+};
+
+// 不来自RenderContext的uniform参数
+struct ShaderParams
+{
+    ShaderParams();
+
+    const ShadowMap *shadow;          // shadow着色器
+    const float *shadow_mask;         // 光线追踪的阴影：每个像素的可见度，非空时代替阴影图
+    int shadow_mask_width;
+    int shadow_mask_height;
+    ShadowFilter shadow_filter;
+    int pcf_size;
+    float shadow_bias;
+    const std::vector<Light> *lights; // lights着色器
+    const LightGrid *light_grid;
+};
+
+// 可用--shader选择的主渲染着色器
+extern const char *shader_names[];
+extern const int nshaders;
+
+// 按名字创建着色器（shader_names中的名字，以及内部使用的"glow"和"depth"），须在lookat/viewport/projection之后调用
+SceneShader *make_shader(const std::string &name, const RenderContext &ctx, const ShaderParams &params);
+// 把着色器包装成半透明的（接管其所有权）：color[3]为不透明度，供triangle_oit()使用
+SceneShader *make_translucent_shader(SceneShader *shader, float opacity);
+
+#endif //__SHADERS_H__
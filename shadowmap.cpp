@@ -0,0 +1,210 @@
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "shadowmap.h"
+#include "our_gl.h"
+
+bool parse_shadow_filter(const char *name, ShadowFilter &filter) {
+    if (!strcmp(name, "hard")) filter = SHADOW_HARD;
+    else if (!strcmp(name, "pcf")) filter = SHADOW_PCF;
+    else if (!strcmp(name, "vsm")) filter = SHADOW_VSM;
+    else return false;
+    return true;
+}
+
+ShadowMap::ShadowMap(int w, int h) : width(w), height(h), depth(w, h), buffer(depth.data()), M(), light_dir(), center(), up(), scene_key(0), moments(), moments_radius(-1) {
+    clear();
+}
+
+ShadowMap::~ShadowMap() {
+}
+
+void ShadowMap::clear() {
+    depth.clear();
+    moments_radius = -1;
+}
+
+float ShadowMap::at(int x, int y) const {
+    if (x<0 || y<0 || x>=width || y>=height) return -std::numeric_limits<float>::max();
+    return buffer[x+y*width];
+}
+
+float ShadowMap::visibility(ShadowFilter filter, int x, int y, float z, float bias, int pcf_size) const {
+    switch (filter) {
+        case SHADOW_PCF: return pcf(x, y, z+bias, pcf_size);
+        case SHADOW_VSM: return vsm(x, y, z+bias);
+        default:         return at(x, y) < z+bias;
+    }
+}
+
+float ShadowMap::pcf(int x, int y, float z, int size) const {
+    const int r = size/2, n = 2*r+1;
+    int lit = 0;
+    if (x-r<0 || y-r<0 || x+r>=width || y+r>=height) { // footprint crosses the border, go through at()
+        for (int j=-r; j<=r; j++)
+            for (int i=-r; i<=r; i++)
+                lit += at(x+i, y+j) < z;
+        return lit/(float)(n*n);
+    }
+#ifdef __SSE2__
+    static const int bits[16] = {0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4};
+    const __m128 z4 = _mm_set1_ps(z);
+#endif
+    for (int j=-r; j<=r; j++) {
+        const float *row = buffer + (y+j)*width + x-r;
+        int i = 0;
+#ifdef __SSE2__
+        for (; i+4<=n; i+=4)
+            lit += bits[_mm_movemask_ps(_mm_cmplt_ps(_mm_loadu_ps(row+i), z4))];
+#endif
+        for (; i<n; i++)
+            lit += row[i] < z;
+    }
+    return lit/(float)(n*n);
+}
+
+// light distance normalized to [0,1], empty texels are as far as it gets
+static inline float light_distance(float z) {
+    return z<=-std::numeric_limits<float>::max() ? 1.f : std::min(1.f, std::max(0.f, 1.f-z/depth));
+}
+
+float ShadowMap::vsm(int x, int y, float z) const {
+    if (moments_radius<0 || x<0 || y<0 || x>=width || y>=height) return 1.f;
+    const float *m = &moments[2*(x+y*width)];
+    const float d = light_distance(z);
+    if (d<=m[0]) return 1.f;
+    const float variance = std::max(m[1]-m[0]*m[0], 1e-6f);
+    const float delta = d-m[0];
+    const float p = variance/(variance+delta*delta);
+    const float bleed = .2f; // cut the tail of the Chebyshev bound to reduce light bleeding
+    return std::max(0.f, (p-bleed)/(1.f-bleed));
+}
+
+void ShadowMap::prepare_vsm(int blur_radius) {
+    blur_radius = std::max(0, blur_radius);
+    if (moments_radius==blur_radius) return;
+    const int rowlen = 2*width;
+    std::vector<float> tmp(rowlen*height);
+    moments.resize(rowlen*height);
+    const float norm = 1.f/(2*blur_radius+1);
+    // horizontal pass: running sums of (d, d^2) with clamp to edge
+#pragma omp parallel for
+    for (int y=0; y<height; y++) {
+        const float *src = buffer + y*width;
+        float *dst = &tmp[y*rowlen];
+        float s0 = 0, s1 = 0;
+        for (int i=-blur_radius-1; i<blur_radius; i++) { // window of x=-1
+            float d = light_distance(src[std::max(0, std::min(width-1, i))]);
+            s0 += d;
+            s1 += d*d;
+        }
+        for (int x=0; x<width; x++) {
+            float din  = light_distance(src[std::min(width-1, x+blur_radius)]);
+            float dout = light_distance(src[std::max(0, x-blur_radius-1)]);
+            s0 += din - dout;
+            s1 += din*din - dout*dout;
+            dst[2*x] = s0*norm;
+            dst[2*x+1] = s1*norm;
+        }
+    }
+    // vertical pass: whole rows are accumulated at once
+#pragma omp parallel for
+    for (int y=0; y<height; y++) {
+        float *dst = &moments[y*rowlen];
+        std::fill(dst, dst+rowlen, 0.f);
+        for (int j=y-blur_radius; j<=y+blur_radius; j++) {
+            const float *src = &tmp[std::max(0, std::min(height-1, j))*rowlen];
+            int i = 0;
+#ifdef __SSE2__
+            for (; i+4<=rowlen; i+=4)
+                _mm_storeu_ps(dst+i, _mm_add_ps(_mm_loadu_ps(dst+i), _mm_loadu_ps(src+i)));
+#endif
+            for (; i<rowlen; i++) dst[i] += src[i];
+        }
+        for (int i=0; i<rowlen; i++) dst[i] *= norm;
+    }
+    moments_radius = blur_radius;
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+
+ShadowMapCache::ShadowMapCache(int width, int height, float max_angle, int capacity) : width_(width), height_(height),
+    cos_max_angle_(std::cos(max_angle)), capacity_(capacity>0 ? capacity : 1), maps_(), hits_(0), misses_(0) {}
+
+ShadowMapCache::~ShadowMapCache() {
+    for (size_t i=0; i<maps_.size(); i++) delete maps_[i];
+}
+
+int ShadowMapCache::hits() {
+    return hits_;
+}
+
+int ShadowMapCache::misses() {
+    return misses_;
+}
+
+// models are immutable once loaded, so their identity and size stand for their contents
+unsigned long ShadowMapCache::scene_key(const std::vector<Model *> &scene) {
+    unsigned long key = 14695981039346656037UL;
+    for (size_t i=0; i<scene.size(); i++) {
+        // the model id, not its address: a model freed and another one loaded at the same address must not match
+        unsigned long v[3] = {scene[i]->id(), (unsigned long)scene[i]->nverts(), (unsigned long)scene[i]->nfaces()};
+        for (int j=0; j<3; j++) key = (key^v[j])*1099511628211UL;
+    }
+    return key;
+}
+
+ShadowMap &ShadowMapCache::get(Vec3f light_dir, Vec3f center, Vec3f up, const std::vector<Model *> &scene, bool *rendered) {
+    light_dir.normalize();
+    const unsigned long key = scene_key(scene);
+    for (size_t i=0; i<maps_.size(); i++) {
+        ShadowMap *sm = maps_[i];
+        bool same_light = (cos_max_angle_>=1.f) ? (sm->light_dir.x==light_dir.x && sm->light_dir.y==light_dir.y && sm->light_dir.z==light_dir.z)
+                                                : (sm->light_dir*light_dir>=cos_max_angle_);
+        // the light transform also depends on where the light view looks and how it is oriented
+        bool same_view = sm->center.x==center.x && sm->center.y==center.y && sm->center.z==center.z &&
+                         sm->up.x==up.x && sm->up.y==up.y && sm->up.z==up.z;
+        if (sm->scene_key!=key || !same_light || !same_view) continue;
+        maps_.erase(maps_.begin()+i);
+        maps_.insert(maps_.begin(), sm);
+        hits_++;
+        if (rendered) *rendered = false;
+        return *sm;
+    }
+
+    ShadowMap *sm;
+    if (maps_.size()<capacity_) {
+        sm = new ShadowMap(width_, height_);
+    } else { // recycle the least recently used one
+        sm = maps_.back();
+        maps_.pop_back();
+        sm->clear();
+    }
+    maps_.insert(maps_.begin(), sm);
+    misses_++;
+    if (rendered) *rendered = true;
+
+    RenderContext ctx;
+    lookat(ctx, light_dir, center, up);
+    viewport(ctx, width_/8, height_/8, width_*3/4, height_*3/4);
+    projection(ctx, 0);
+    sm->M = ctx.Viewport*ctx.Projection*ctx.ModelView;
+    sm->light_dir = light_dir;
+    sm->center = center;
+    sm->up = up;
+    sm->scene_key = key;
+    for (size_t m=0; m<scene.size(); m++) {
+        Model *model = scene[m];
+        Vec4f screen_coords[3];
+        for (int i=0; i<model->nfaces(); i++) {
+            for (int j=0; j<3; j++) screen_coords[j] = sm->M*embed<4>(model->vert(i, j));
+            sm->depth.tiles().touch(screen_coords);
+            triangle_depth(screen_coords, sm->buffer, width_, height_);
+        }
+    }
+    return *sm;
+}
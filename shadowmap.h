@@ -0,0 +1,71 @@
+#ifndef __SHADOWMAP_H__
+#define __SHADOWMAP_H__
+#include <vector>
+#include "geometry.h"
+#include "model.h"
+#include "rendertarget.h"
+
+enum ShadowFilter {
+    SHADOW_HARD, // single depth comparison
+    SHADOW_PCF,  // percentage-closer filtering over an NxN footprint
+    SHADOW_VSM   // variance shadow map: Chebyshev bound on blurred depth moments
+};
+
+bool parse_shadow_filter(const char *name, ShadowFilter &filter);
+
+// Depth of the scene as seen from a directional light, together with the transform that maps
+// world space into it. Its resolution is independent of the framebuffer.
+struct ShadowMap {
+    ShadowMap(int w, int h);
+    ~ShadowMap();
+    void clear();
+    // depth at a shadow map pixel, -max outside of the map (i.e. nothing occludes it)
+    float at(int x, int y) const;
+    // fraction of light reaching a point at depth z that projects onto pixel (x,y); bias is in depth units
+    float visibility(ShadowFilter filter, int x, int y, float z, float bias, int pcf_size=5) const;
+    float pcf(int x, int y, float z, int size) const;
+    float vsm(int x, int y, float z) const;
+    // builds the blurred moments texture the VSM lookups need, unless it already exists for this radius
+    void prepare_vsm(int blur_radius);
+
+    int width;
+    int height;
+    DepthBuffer depth; // only the tiles the previous light view drew into are cleared
+    float *buffer;     // depth.data()
+    Matrix M;        // Viewport*Projection*ModelView of the light
+    Vec3f light_dir; // normalized
+    Vec3f center;    // the light view looks at center with this up vector; both are part of M
+    Vec3f up;
+    unsigned long scene_key;
+    std::vector<float> moments; // VSM: interleaved E[d], E[d^2] of the normalized light distance d
+    int moments_radius;         // blur radius the moments were built with, -1 when stale
+private:
+    ShadowMap(const ShadowMap &);
+    ShadowMap &operator=(const ShadowMap &);
+};
+
+// Keeps the last few shadow maps and hands one back instead of re-rendering when the scene, the center
+// and the up vector of the light view are the same and the light moved by less than max_angle (radians,
+// 0 means the light must not move at all).
+class ShadowMapCache {
+public:
+    ShadowMapCache(int width, int height, float max_angle=0.f, int capacity=2);
+    ~ShadowMapCache();
+    ShadowMap &get(Vec3f light_dir, Vec3f center, Vec3f up, const std::vector<Model *> &scene, bool *rendered=NULL);
+    int hits();
+    int misses();
+    static unsigned long scene_key(const std::vector<Model *> &scene);
+private:
+    ShadowMapCache(const ShadowMapCache &);
+    ShadowMapCache &operator=(const ShadowMapCache &);
+
+    int width_;
+    int height_;
+    float cos_max_angle_;
+    size_t capacity_;
+    std::vector<ShadowMap *> maps_; // most recently used first
+    int hits_;
+    int misses_;
+};
+
+#endif //__SHADOWMAP_H__
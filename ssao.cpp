@@ -0,0 +1,147 @@
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include "ssao.h"
+
+static const int tile_size = 32;
+
+static inline bool empty(float z) {
+    return z<=-std::numeric_limits<float>::max();
+}
+
+// horizon-based estimate: for each direction, how far the depth field rises above the local tangent plane
+// as seen from the pixel (the tangent is taken from the first step, so that slanted but flat surfaces stay open)
+static float occlusion(const float *zbuffer, int width, int height, int x, int y, const SSAOParams &p, const std::vector<float> &dirs) {
+    const float z = zbuffer[x+y*width];
+    if (empty(z)) return 1.f;
+    const int steps = std::max(2, (int)p.radius);
+    float total = 0.f;
+    for (int d=0; d<p.directions; d++) {
+        const float dx = dirs[2*d], dy = dirs[2*d+1];
+        float tangent = 0.f, horizon = 0.f;
+        bool first = true; // any angle in (-pi/2, pi/2) is a valid horizon, so no sentinel value
+        for (int s=1; s<=steps; s++) {
+            int sx = (int)(x + dx*s + .5f), sy = (int)(y + dy*s + .5f);
+            if (sx<0 || sy<0 || sx>=width || sy>=height) break;
+            float zs = zbuffer[sx+sy*width];
+            if (empty(zs)) continue;
+            float angle = atanf((zs-z)/(p.depth_scale*s));
+            if (first) tangent = horizon = angle, first = false;
+            else horizon = std::max(horizon, angle);
+        }
+        total += std::max(0.f, horizon-tangent);
+    }
+    float occluded = total/(1.57079633f*p.directions);
+    return 1.f - p.strength*std::min(1.f, occluded);
+}
+
+// one direction of the separable bilateral blur: taps across a depth discontinuity get no weight
+static void blur(const float *zbuffer, int width, int height, int radius, int step_x, int step_y, const std::vector<float> &src, std::vector<float> &dst) {
+    const float sigma = radius*.5f+.5f;
+#pragma omp parallel for
+    for (int y=0; y<height; y++) {
+        for (int x=0; x<width; x++) {
+            const int i = x+y*width;
+            const float z = zbuffer[i];
+            if (empty(z)) {
+                dst[i] = src[i];
+                continue;
+            }
+            float sum = 0.f, wsum = 0.f;
+            for (int t=-radius; t<=radius; t++) {
+                int sx = x+t*step_x, sy = y+t*step_y;
+                if (sx<0 || sy<0 || sx>=width || sy>=height) continue;
+                float zs = zbuffer[sx+sy*width];
+                if (empty(zs)) continue;
+                float dz = (zs-z)/8.f;
+                float w = expf(-(t*t)/(2.f*sigma*sigma) - dz*dz);
+                sum += w*src[sx+sy*width];
+                wsum += w;
+            }
+            dst[i] = wsum>0.f ? sum/wsum : src[i];
+        }
+    }
+}
+
+void ssao(const float *zbuffer, int width, int height, const SSAOParams &params, std::vector<float> &ao) {
+    SSAOParams p = params;
+    const int scale = p.half_res ? 2 : 1;
+    const int w = (width+scale-1)/scale, h = (height+scale-1)/scale;
+    std::vector<float> zlow;
+    const float *z = zbuffer;
+    if (scale>1) { // point-sampled depth at half resolution, everything else runs on it
+        zlow.resize(w*h);
+        for (int y=0; y<h; y++)
+            for (int x=0; x<w; x++)
+                zlow[x+y*w] = zbuffer[x*scale + y*scale*width];
+        z = &zlow[0];
+        p.radius /= scale;
+        p.depth_scale *= scale;
+    }
+    std::vector<float> dirs(2*p.directions);
+    for (int d=0; d<p.directions; d++) {
+        dirs[2*d]   = cosf(6.28318531f*d/p.directions);
+        dirs[2*d+1] = sinf(6.28318531f*d/p.directions);
+    }
+
+    // tiles keep the neighbourhood each thread samples in cache
+    std::vector<float> raw(w*h, 1.f);
+    const int ntx = (w+tile_size-1)/tile_size, nty = (h+tile_size-1)/tile_size;
+#pragma omp parallel for schedule(dynamic)
+    for (int t=0; t<ntx*nty; t++) {
+        const int x0 = (t%ntx)*tile_size, y0 = (t/ntx)*tile_size;
+        for (int y=y0; y<std::min(h, y0+tile_size); y++)
+            for (int x=x0; x<std::min(w, x0+tile_size); x++)
+                raw[x+y*w] = occlusion(z, w, h, x, y, p, dirs);
+    }
+
+    if (p.blur_radius>0) {
+        std::vector<float> tmp(w*h);
+        const int r = std::max(1, p.blur_radius/scale);
+        blur(z, w, h, r, 1, 0, raw, tmp);
+        blur(z, w, h, r, 0, 1, tmp, raw);
+    }
+
+    ao.resize(width*height);
+    if (scale==1) {
+        ao.swap(raw);
+        return;
+    }
+    // depth-aware upsampling: among the four nearest low resolution samples take the one closest in depth
+#pragma omp parallel for
+    for (int y=0; y<height; y++) {
+        for (int x=0; x<width; x++) {
+            const float zf = zbuffer[x+y*width];
+            const int lx = std::min(w-1, x/scale), ly = std::min(h-1, y/scale);
+            const int nx = std::min(w-1, (x+1)/scale), ny = std::min(h-1, (y+1)/scale);
+            const int cand[4] = {lx+ly*w, nx+ly*w, lx+ny*w, nx+ny*w};
+            int best = cand[0];
+            for (int c=1; c<4; c++)
+                if (std::abs(z[cand[c]]-zf)<std::abs(z[best]-zf)) best = cand[c];
+            ao[x+y*width] = raw[best];
+        }
+    }
+}
+
+void apply_ao(TGAImage &image, const std::vector<float> &ao) {
+    const int bpp = image.get_bytespp(), n = image.get_width()*image.get_height();
+    if ((int)ao.size()!=n) return;
+    unsigned char *data = image.buffer();
+#pragma omp parallel for
+    for (int i=0; i<n; i++) {
+        for (int c=0; c<std::min(bpp, 3); c++)
+            data[i*bpp+c] = (unsigned char)(data[i*bpp+c]*std::max(0.f, std::min(1.f, ao[i])));
+    }
+}
+
+void apply_ao(FloatImage &image, const std::vector<float> &ao) {
+    const int w = image.width(), h = image.height();
+    if ((int)ao.size()!=w*h) return;
+#pragma omp parallel for
+    for (int y=0; y<h; y++) {
+        for (int c=0; c<3; c++) {
+            float *p = image.row(c, y);
+            for (int x=0; x<w; x++) p[x] *= std::max(0.f, std::min(1.f, ao[x+y*w]));
+        }
+    }
+}
@@ -0,0 +1,26 @@
+#ifndef __SSAO_H__
+#define __SSAO_H__
+#include <vector>
+#include "tgaimage.h"
+#include "framebuffer.h"
+
+struct SSAOParams {
+    SSAOParams() : directions(8), radius(20.f), depth_scale(1.f), strength(1.f), blur_radius(4), half_res(false) {}
+    int directions;    // horizon directions sampled around each pixel
+    float radius;      // search radius in (full resolution) pixels
+    float depth_scale; // screen z units (0..2000 over the depth range) per pixel, to turn depth differences into
+                       // elevation angles: larger values flatten the relief and weaken the occlusion (--ssao-depth-scale)
+    float strength;    // 0 disables the effect, 1 is the plain horizon-based estimate
+    int blur_radius;   // half width of the separable bilateral blur, 0 disables it
+    bool half_res;     // estimate occlusion at half resolution, then upsample with depth awareness
+};
+
+// Screen-space ambient occlusion over a z-buffer where a larger value is closer to the eye and
+// -max marks empty pixels. Fills ao with width*height factors in [0,1] (1 = unoccluded).
+void ssao(const float *zbuffer, int width, int height, const SSAOParams &params, std::vector<float> &ao);
+
+// darkens the image by the occlusion factors
+void apply_ao(TGAImage &image, const std::vector<float> &ao);
+void apply_ao(FloatImage &image, const std::vector<float> &ao);
+
+#endif //__SSAO_H__
@@ -0,0 +1,186 @@
+#include <cstring>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <pthread.h>
+#include "stats.h"
+
+PipelineStats::PipelineStats() : triangles_submitted(0), triangles_culled(0), triangles_rasterized(0), pixels_tested(0),
+    pixels_depth_rejected(0), pixels_shaded(0), discards(0), vertex_ticks(0), fragment_ticks(0), total_ticks(0),
+    width(0), height(0), overdraw(), cost() {
+}
+
+void PipelineStats::enable_heatmaps(int w, int h) {
+    width = w;
+    height = h;
+    overdraw.assign((size_t)w*h, 0);
+    cost.assign((size_t)w*h, 0.f);
+}
+
+void PipelineStats::report(std::ostream &out) const {
+    out << "triangles " << triangles_submitted << " submitted, " << triangles_culled << " culled, " << triangles_rasterized << " rasterized; "
+        << "pixels " << pixels_tested << " tested, " << pixels_depth_rejected << " depth-rejected, " << pixels_shaded << " shaded, "
+        << discards << " discarded";
+    if (total_ticks) {
+        const double total = total_ticks;
+        const double raster = std::max(0., total-vertex_ticks-fragment_ticks);
+        out << "; time " << 100.*vertex_ticks/total << "% vertex, " << 100.*fragment_ticks/total << "% fragment, "
+            << 100.*raster/total << "% raster+depth";
+    }
+}
+
+static const char *heatmap_names[] = {"none", "overdraw", "cost"};
+
+bool parse_heatmap(const char *name, Heatmap &mode) {
+    for (int i=0; i<3; i++) {
+        if (!strcmp(name, heatmap_names[i])) {
+            mode = (Heatmap)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *heatmap_name(Heatmap mode) {
+    return heatmap_names[mode];
+}
+
+// black -> blue -> green -> yellow -> red
+static TGAColor ramp(float t) {
+    static const float stops[5][3] = {{0, 0, 0}, {0, 0, 255}, {0, 255, 0}, {255, 255, 0}, {255, 0, 0}};
+    t = std::min(1.f, std::max(0.f, t))*4.f;
+    const int i = std::min(3, (int)t);
+    const float f = t-i;
+    float c[3];
+    for (int k=0; k<3; k++) c[k] = stops[i][k] + (stops[i+1][k]-stops[i][k])*f;
+    return TGAColor(c[0]+.5f, c[1]+.5f, c[2]+.5f);
+}
+
+TGAImage *heatmap_image(const PipelineStats &stats, Heatmap mode) {
+    if (!stats.heatmaps() || mode==HEATMAP_NONE) return NULL;
+    const size_t n = (size_t)stats.width*stats.height;
+    std::vector<float> v(n);
+    for (size_t i=0; i<n; i++) v[i] = mode==HEATMAP_OVERDRAW ? stats.overdraw[i] : stats.cost[i];
+    // the maximum for overdraw, so that every layer stays distinguishable; a percentile for the cost, where
+    // a few pixels hit by an interrupt or a cache miss storm would otherwise flatten the whole picture
+    float scale = 0.f;
+    if (mode==HEATMAP_OVERDRAW) {
+        scale = *std::max_element(v.begin(), v.end());
+    } else {
+        std::vector<float> nonzero;
+        for (size_t i=0; i<n; i++) if (v[i]>0.f) nonzero.push_back(v[i]);
+        if (!nonzero.empty()) {
+            std::vector<float>::iterator p = nonzero.begin() + (nonzero.size()-1)*99/100;
+            std::nth_element(nonzero.begin(), p, nonzero.end());
+            scale = *p;
+        }
+    }
+    TGAImage *img = new TGAImage(stats.width, stats.height, TGAImage::RGB);
+    if (scale<=0.f) return img;
+    for (int y=0; y<stats.height; y++)
+        for (int x=0; x<stats.width; x++)
+            img->set(x, y, ramp(v[x+(size_t)y*stats.width]/scale));
+    return img;
+}
+
+struct PassEvent {
+    const char *pass;
+    int frame;
+    double t0, t1;
+};
+
+struct ThreadBuffer {
+    ThreadBuffer(int i) : id(i), events() {}
+    int id;
+    std::vector<PassEvent> events;
+};
+
+static bool timers_enabled = false;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t buffer_key;
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<ThreadBuffer *> registry; // buffers live until exit, reports read them after the threads are done
+
+static void create_key() {
+    pthread_key_create(&buffer_key, NULL);
+}
+
+static ThreadBuffer *thread_buffer() {
+    pthread_once(&key_once, create_key);
+    ThreadBuffer *buf = (ThreadBuffer *)pthread_getspecific(buffer_key);
+    if (!buf) {
+        pthread_mutex_lock(&registry_mutex);
+        buf = new ThreadBuffer(registry.size());
+        registry.push_back(buf);
+        pthread_mutex_unlock(&registry_mutex);
+        pthread_setspecific(buffer_key, buf);
+    }
+    return buf;
+}
+
+void pass_timers_enable() {
+    timers_enabled = true;
+}
+
+bool pass_timers_enabled() {
+    return timers_enabled;
+}
+
+void pass_timer_record(const char *pass, int frame, double t0, double t1) {
+    if (!timers_enabled) return;
+    PassEvent e = {pass, frame, t0, t1};
+    thread_buffer()->events.push_back(e);
+}
+
+void pass_timers_report(std::ostream &out) {
+    pthread_mutex_lock(&registry_mutex);
+    for (size_t i=0; i<registry.size(); i++) {
+        const std::vector<PassEvent> &events = registry[i]->events;
+        std::map<std::string, std::pair<int, double> > passes;
+        for (size_t j=0; j<events.size(); j++) {
+            std::pair<int, double> &p = passes[events[j].pass];
+            p.first++;
+            p.second += events[j].t1-events[j].t0;
+        }
+        out << "thread " << registry[i]->id << ":";
+        for (std::map<std::string, std::pair<int, double> >::iterator it=passes.begin(); it!=passes.end(); ++it)
+            out << (it==passes.begin() ? " " : ", ") << it->first << " " << it->second.first << "x "
+                << it->second.second*1000. << " ms (" << it->second.second*1000./it->second.first << " ms avg)";
+        out << std::endl;
+    }
+    pthread_mutex_unlock(&registry_mutex);
+}
+
+bool pass_timers_write_trace(const char *filename) {
+    std::ofstream out(filename);
+    if (!out) {
+        std::cerr << "can't open file " << filename << "\n";
+        return false;
+    }
+    pthread_mutex_lock(&registry_mutex);
+    double origin = 0.;
+    bool first = true;
+    for (size_t i=0; i<registry.size(); i++)
+        for (size_t j=0; j<registry[i]->events.size(); j++)
+            if (first || registry[i]->events[j].t0<origin) origin = registry[i]->events[j].t0, first = false;
+    out << "{\"traceEvents\": [";
+    first = true;
+    out.setf(std::ios::fixed);
+    out.precision(1);
+    for (size_t i=0; i<registry.size(); i++) {
+        for (size_t j=0; j<registry[i]->events.size(); j++) {
+            const PassEvent &e = registry[i]->events[j];
+            out << (first ? "\n" : ",\n") << "  {\"name\": \"" << e.pass << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << registry[i]->id
+                << ", \"ts\": " << (e.t0-origin)*1e6 << ", \"dur\": " << (e.t1-e.t0)*1e6;
+            if (e.frame>=0) out << ", \"args\": {\"frame\": " << e.frame << "}";
+            out << "}";
+            first = false;
+        }
+    }
+    pthread_mutex_unlock(&registry_mutex);
+    out << "\n]}\n";
+    return out.good();
+}
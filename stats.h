@@ -0,0 +1,63 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+#include <vector>
+#include <ostream>
+#include "tgaimage.h"
+#include "timer.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// cheap monotonic tick counter for timing very short spans (single shader invocations)
+inline unsigned long cpu_ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return (unsigned long)__rdtsc();
+#else
+    return (unsigned long)(wall_time()*1e9);
+#endif
+}
+
+// Counters of one pass, filled by the rasterizers when they are given a non-NULL pointer. Each frame
+// owns its own instance, so no synchronization is needed.
+struct PipelineStats {
+    PipelineStats();
+    // also gather per-pixel overdraw and fragment shader cost, for heatmaps
+    void enable_heatmaps(int w, int h);
+    bool heatmaps() const { return !overdraw.empty(); }
+    void report(std::ostream &out) const;
+
+    unsigned long triangles_submitted;
+    unsigned long triangles_culled;     // degenerate or entirely off-screen
+    unsigned long triangles_rasterized;
+    unsigned long pixels_tested;        // covered pixels reaching the depth test
+    unsigned long pixels_depth_rejected;
+    unsigned long pixels_shaded;        // fragment shader invocations
+    unsigned long discards;
+    unsigned long vertex_ticks;         // spent in the vertex shader
+    unsigned long fragment_ticks;       // spent in the fragment shader
+    unsigned long total_ticks;          // the whole pass, set by the caller
+    int width;
+    int height;
+    std::vector<unsigned int> overdraw; // fragment shader invocations per pixel
+    std::vector<float> cost;            // fragment shader ticks per pixel
+};
+
+enum Heatmap {
+    HEATMAP_NONE, HEATMAP_OVERDRAW, HEATMAP_COST
+};
+bool parse_heatmap(const char *name, Heatmap &mode);
+const char *heatmap_name(Heatmap mode);
+// false color image of the overdraw (scaled to the maximum) or of the shading cost (scaled to the 99th percentile)
+TGAImage *heatmap_image(const PipelineStats &stats, Heatmap mode);
+
+// Wall-clock timers of the pipeline passes. Every thread appends to its own buffer, only the first
+// record of a thread takes a lock. Recording is a no-op until pass_timers_enable() is called.
+void pass_timers_enable();
+bool pass_timers_enabled();
+void pass_timer_record(const char *pass, int frame, double t0, double t1);
+// per thread and per pass: count, total and mean time
+void pass_timers_report(std::ostream &out);
+// all recorded spans in the Chrome trace event format (chrome://tracing, Perfetto)
+bool pass_timers_write_trace(const char *filename);
+
+#endif //__STATS_H__
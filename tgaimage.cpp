@@ -3,6 +3,12 @@
 #include <string.h>
 #include <time.h>
 #include <math.h>
+#include <stdio.h>
+#include <algorithm>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "tgaimage.h"
 
 TGAImage::TGAImage() : data(NULL), width(0), height(0), bytespp(0) {}
@@ -141,7 +147,7 @@ bool TGAImage::load_rle_data(std::ifstream &in) {
     return true;
 }
 
-bool TGAImage::write_tga_file(const char *filename, bool rle) {
+bool TGAImage::write_tga_file(const char *filename, bool rle, bool vflip) {
     unsigned char developer_area_ref[4] = {0, 0, 0, 0};
     unsigned char extension_area_ref[4] = {0, 0, 0, 0};
     unsigned char footer[18] = {'T','R','U','E','V','I','S','I','O','N','-','X','F','I','L','E','.','\0'};
@@ -158,7 +164,7 @@ bool TGAImage::write_tga_file(const char *filename, bool rle) {
     header.width  = width;
     header.height = height;
     header.datatypecode = (bytespp==GRAYSCALE?(rle?11:3):(rle?10:2));
-    header.imagedescriptor = 0x20; // top-left origin
+    header.imagedescriptor = vflip ? 0x00 : 0x20; // bottom-left or top-left origin
     out.write((char *)&header, sizeof(header));
     if (!out.good()) {
         out.close();
@@ -244,6 +250,183 @@ bool TGAImage::unload_rle_data(std::ofstream &out) {
     return true;
 }
 
+bool TGAImage::write_buffer(const char *filename, const std::string &buf) {
+    std::ofstream out;
+    out.open (filename, std::ios::binary);
+    if (!out.is_open()) {
+        std::cerr << "can't open file " << filename << "\n";
+        out.close();
+        return false;
+    }
+    out.write(buf.data(), buf.size());
+    if (!out.good()) {
+        std::cerr << "can't dump the image file\n";
+        out.close();
+        return false;
+    }
+    out.close();
+    return true;
+}
+
+static void put_be32(std::string &buf, unsigned int v) {
+    buf += (char)(v>>24);
+    buf += (char)(v>>16);
+    buf += (char)(v>>8);
+    buf += (char)v;
+}
+
+bool TGAImage::write_qoi_file(const char *filename, bool vflip) {
+    if (!data) return false;
+    const unsigned char QOI_OP_INDEX = 0x00, QOI_OP_DIFF = 0x40, QOI_OP_LUMA = 0x80,
+                        QOI_OP_RUN   = 0xc0, QOI_OP_RGB  = 0xfe, QOI_OP_RGBA = 0xff;
+    const int channels = (bytespp==RGBA ? 4 : 3);
+    unsigned long npixels = width*height;
+    std::string buf;
+    buf.reserve(14 + npixels*(channels+1) + 8); // worst case, so the encoder never reallocates
+    buf += "qoif";
+    put_be32(buf, width);
+    put_be32(buf, height);
+    buf += (char)channels;
+    buf += (char)0; // sRGB with linear alpha
+
+    unsigned char index[64][4];
+    memset(index, 0, sizeof(index));
+    unsigned char prev[4] = {0, 0, 0, 255};
+    unsigned char px[4]   = {0, 0, 0, 255};
+    int run = 0;
+    const unsigned char *p = data;
+    for (unsigned long i=0, x=0, y=0; i<npixels; i++, x++, p+=bytespp) {
+        if (x==(unsigned long)width) { x = 0; y++; }
+        if (0==x) p = data + (vflip ? height-1-y : y)*width*bytespp;
+        if (bytespp==GRAYSCALE) {
+            px[0] = px[1] = px[2] = p[0];
+        } else {
+            px[0] = p[2]; px[1] = p[1]; px[2] = p[0];
+            if (bytespp==RGBA) px[3] = p[3];
+        }
+        if (!memcmp(px, prev, 4)) {
+            if (++run==62 || i+1==npixels) {
+                buf += (char)(QOI_OP_RUN | (run-1));
+                run = 0;
+            }
+            continue;
+        }
+        if (run) {
+            buf += (char)(QOI_OP_RUN | (run-1));
+            run = 0;
+        }
+        int h = (px[0]*3 + px[1]*5 + px[2]*7 + px[3]*11) & 63;
+        if (!memcmp(index[h], px, 4)) {
+            buf += (char)(QOI_OP_INDEX | h);
+        } else {
+            memcpy(index[h], px, 4);
+            if (px[3]==prev[3]) {
+                signed char vr = px[0]-prev[0];
+                signed char vg = px[1]-prev[1];
+                signed char vb = px[2]-prev[2];
+                signed char vg_r = vr-vg;
+                signed char vg_b = vb-vg;
+                if (vr>-3 && vr<2 && vg>-3 && vg<2 && vb>-3 && vb<2) {
+                    buf += (char)(QOI_OP_DIFF | (vr+2)<<4 | (vg+2)<<2 | (vb+2));
+                } else if (vg_r>-9 && vg_r<8 && vg>-33 && vg<32 && vg_b>-9 && vg_b<8) {
+                    buf += (char)(QOI_OP_LUMA | (vg+32));
+                    buf += (char)((vg_r+8)<<4 | (vg_b+8));
+                } else {
+                    buf += (char)QOI_OP_RGB;
+                    buf.append((char *)px, 3);
+                }
+            } else {
+                buf += (char)QOI_OP_RGBA;
+                buf.append((char *)px, 4);
+            }
+        }
+        memcpy(prev, px, 4);
+    }
+    static const char padding[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+    buf.append(padding, sizeof(padding));
+    return write_buffer(filename, buf);
+}
+
+// binary netpbm: P5 for grayscale, P6 for color (alpha is dropped, use PAM to keep it)
+bool TGAImage::write_ppm_file(const char *filename, bool vflip) {
+    if (!data) return false;
+    const int channels = (bytespp==GRAYSCALE ? 1 : 3);
+    char header[64];
+    int hlen = sprintf(header, "P%d\n%d %d\n255\n", channels==1 ? 5 : 6, width, height);
+    std::string buf;
+    buf.reserve(hlen + width*height*channels);
+    buf.append(header, hlen);
+    buf.resize(hlen + width*height*channels);
+    unsigned char *dst = (unsigned char *)&buf[hlen];
+    for (int j=0; j<height; j++) {
+        const unsigned char *p = data + (vflip ? height-1-j : j)*width*bytespp;
+        if (channels==1) {
+            memcpy(dst, p, width);
+            dst += width;
+            continue;
+        }
+        for (int i=0; i<width; i++, p+=bytespp, dst+=3) {
+            dst[0] = p[2]; dst[1] = p[1]; dst[2] = p[0];
+        }
+    }
+    return write_buffer(filename, buf);
+}
+
+bool TGAImage::write_pam_file(const char *filename, bool vflip) {
+    if (!data) return false;
+    const char *tupltype = (bytespp==GRAYSCALE ? "GRAYSCALE" : (bytespp==RGB ? "RGB" : "RGB_ALPHA"));
+    char header[128];
+    int hlen = sprintf(header, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH %d\nMAXVAL 255\nTUPLTYPE %s\nENDHDR\n", width, height, bytespp, tupltype);
+    unsigned long nbytes = width*height*bytespp;
+    std::string buf;
+    buf.reserve(hlen + nbytes);
+    buf.append(header, hlen);
+    buf.resize(hlen + nbytes);
+    unsigned char *dst = (unsigned char *)&buf[hlen];
+    unsigned long linebytes = width*bytespp;
+    for (int j=0; j<height; j++, dst+=linebytes) {
+        const unsigned char *p = data + (vflip ? height-1-j : j)*linebytes;
+        if (bytespp==GRAYSCALE) {
+            memcpy(dst, p, linebytes);
+            continue;
+        }
+        for (unsigned long i=0; i<linebytes; i+=bytespp) {
+            dst[i] = p[i+2]; dst[i+1] = p[i+1]; dst[i+2] = p[i];
+            if (bytespp==RGBA) dst[i+3] = p[i+3];
+        }
+    }
+    return write_buffer(filename, buf);
+}
+
+bool TGAImage::write_file(const char *filename, FileFormat fmt, bool vflip) {
+    switch (fmt) {
+        case QOI: return write_qoi_file(filename, vflip);
+        case PPM: return write_ppm_file(filename, vflip);
+        case PAM: return write_pam_file(filename, vflip);
+        default:  return write_tga_file(filename, true, vflip);
+    }
+}
+
+const char *TGAImage::extension(FileFormat fmt) {
+    switch (fmt) {
+        case QOI: return "qoi";
+        case PPM: return "ppm";
+        case PAM: return "pam";
+        default:  return "tga";
+    }
+}
+
+bool TGAImage::parse_format(const char *name, FileFormat &fmt) {
+    const FileFormat all[] = {TGA, QOI, PPM, PAM};
+    for (int i=0; i<4; i++) {
+        if (!strcmp(name, extension(all[i]))) {
+            fmt = all[i];
+            return true;
+        }
+    }
+    return false;
+}
+
 TGAColor TGAImage::get(int x, int y) {
     if (!data || x<0 || y<0 || x>=width || y>=height) {
         return TGAColor();
@@ -279,15 +462,23 @@ int TGAImage::get_height() {
     return height;
 }
 
+// images below this many pixels are not worth waking up the thread team for
+static const long parallel_threshold = 256*256;
+
 bool TGAImage::flip_horizontally() {
     if (!data) return false;
-    int half = width>>1;
-    for (int i=0; i<half; i++) {
-        for (int j=0; j<height; j++) {
-            TGAColor c1 = get(i, j);
-            TGAColor c2 = get(width-1-i, j);
-            set(i, j, c2);
-            set(width-1-i, j, c1);
+    const int half = width>>1;
+    const unsigned long bytes_per_line = width*bytespp;
+#pragma omp parallel for if ((long)width*height>=parallel_threshold)
+    for (int j=0; j<height; j++) {
+        unsigned char *l = data + j*bytes_per_line;
+        unsigned char *r = l + (width-1)*bytespp;
+        for (int i=0; i<half; i++, l+=bytespp, r-=bytespp) {
+            for (int t=0; t<bytespp; t++) {
+                unsigned char c = l[t];
+                l[t] = r[t];
+                r[t] = c;
+            }
         }
     }
     return true;
@@ -295,17 +486,12 @@ bool TGAImage::flip_horizontally() {
 
 bool TGAImage::flip_vertically() {
     if (!data) return false;
-    unsigned long bytes_per_line = width*bytespp;
-    unsigned char *line = new unsigned char[bytes_per_line];
-    int half = height>>1;
+    const unsigned long bytes_per_line = width*bytespp;
+    const int half = height>>1;
+#pragma omp parallel for if ((long)width*height>=parallel_threshold)
     for (int j=0; j<half; j++) {
-        unsigned long l1 = j*bytes_per_line;
-        unsigned long l2 = (height-1-j)*bytes_per_line;
-        memmove((void *)line,      (void *)(data+l1), bytes_per_line);
-        memmove((void *)(data+l1), (void *)(data+l2), bytes_per_line);
-        memmove((void *)(data+l2), (void *)line,      bytes_per_line);
+        std::swap_ranges(data+j*bytes_per_line, data+(j+1)*bytes_per_line, data+(height-1-j)*bytes_per_line);
     }
-    delete [] line;
     return true;
 }
 
@@ -317,8 +503,9 @@ void TGAImage::clear() {
     memset((void *)data, 0, width*height*bytespp);
 }
 
-bool TGAImage::scale(int w, int h) {
+bool TGAImage::scale(int w, int h, Filter filter) {
     if (w<=0 || h<=0 || !data) return false;
+    if (filter!=NEAREST) return resample(w, h, filter);
     unsigned char *tdata = new unsigned char[w*h*bytespp];
     int nscanline = 0;
     int oscanline = 0;
@@ -354,3 +541,207 @@ bool TGAImage::scale(int w, int h) {
     return true;
 }
 
+
+static float filter_radius(int filter) {
+    switch (filter) {
+        case TGAImage::BOX:      return .5f;
+        case TGAImage::BILINEAR: return 1.f;
+        default:                 return 3.f; // Lanczos-3
+    }
+}
+
+static float filter_weight(int filter, float x) {
+    x = fabsf(x);
+    switch (filter) {
+        case TGAImage::BOX:
+            return x<=.5f ? 1.f : 0.f;
+        case TGAImage::BILINEAR:
+            return x<1.f ? 1.f-x : 0.f;
+        default: {
+            if (x<1e-6f) return 1.f;
+            if (x>=3.f) return 0.f;
+            const float pix = 3.14159265f*x;
+            return 3.f*sinf(pix)*sinf(pix/3.f)/(pix*pix);
+        }
+    }
+}
+
+// For every destination coordinate, the first source sample it reads and the normalized weights of the
+// taps (ntaps per destination, zero padded). When minifying, the kernel is stretched by the scale factor
+// so that every source pixel contributes, which turns BOX into area averaging.
+static int filter_taps(int filter, int src, int dst, std::vector<int> &first, std::vector<float> &weights) {
+    const float ratio = (float)src/dst;
+    const float support = ratio>1.f ? ratio : 1.f;
+    const float radius = filter_radius(filter)*support;
+    const int ntaps = (int)ceilf(radius*2.f)+1;
+    first.assign(dst, 0);
+    weights.assign(dst*ntaps, 0.f);
+    for (int o=0; o<dst; o++) {
+        const float center = (o+.5f)*ratio-.5f;
+        int lo = (int)floorf(center-radius+.5f);
+        float sum = 0.f;
+        float *w = &weights[o*ntaps];
+        for (int t=0; t<ntaps; t++) {
+            w[t] = filter_weight(filter, (lo+t-center)/support);
+            sum += w[t];
+        }
+        // clamp to the edge: fold the taps that fall outside of the image onto the border pixels
+        if (lo<0 || lo+ntaps>src) {
+            std::vector<float> folded(ntaps, 0.f);
+            int flo = std::max(0, std::min(lo, src-ntaps));
+            for (int t=0; t<ntaps; t++) {
+                int i = std::max(0, std::min(src-1, lo+t)) - flo;
+                if (i>=0 && i<ntaps) folded[i] += w[t];
+            }
+            std::copy(folded.begin(), folded.end(), w);
+            lo = flo;
+        }
+        first[o] = lo;
+        if (sum!=0.f)
+            for (int t=0; t<ntaps; t++) w[t] /= sum;
+    }
+    return ntaps;
+}
+
+// separable resampling: the horizontal pass goes to a float buffer of height x w, the vertical pass
+// accumulates whole rows of it at once, which is where SSE pays off
+bool TGAImage::resample(int w, int h, int filter) {
+    std::vector<int> xfirst, yfirst;
+    std::vector<float> xweights, yweights;
+    const int xtaps = filter_taps(filter, width, w, xfirst, xweights);
+    const int ytaps = filter_taps(filter, height, h, yfirst, yweights);
+    if (width<xtaps || height<ytaps) { // too small to filter, replicate pixels instead
+        return scale(w, h, NEAREST);
+    }
+    const int rowlen = w*bytespp;
+    std::vector<float> tmp((size_t)height*rowlen);
+    const bool parallel = (long)std::max(width, w)*std::max(height, h)>=parallel_threshold;
+
+#pragma omp parallel for if (parallel)
+    for (int j=0; j<height; j++) {
+        const unsigned char *src = data + (size_t)j*width*bytespp;
+        float *dst = &tmp[(size_t)j*rowlen];
+        for (int o=0; o<w; o++) {
+            const float *wt = &xweights[o*xtaps];
+            const unsigned char *s = src + xfirst[o]*bytespp;
+            float acc[4] = {0.f, 0.f, 0.f, 0.f};
+            for (int t=0; t<xtaps; t++, s+=bytespp) {
+                for (int c=0; c<bytespp; c++) acc[c] += wt[t]*s[c];
+            }
+            for (int c=0; c<bytespp; c++) dst[o*bytespp+c] = acc[c];
+        }
+    }
+
+    unsigned char *tdata = new unsigned char[(size_t)h*rowlen];
+#pragma omp parallel for if (parallel)
+    for (int j=0; j<h; j++) {
+        std::vector<float> acc(rowlen, 0.f);
+        const float *wt = &yweights[j*ytaps];
+        for (int t=0; t<ytaps; t++) {
+            const float *src = &tmp[(size_t)(yfirst[j]+t)*rowlen];
+            const float wv = wt[t];
+            if (wv==0.f) continue;
+            int i = 0;
+#ifdef __SSE2__
+            const __m128 w4 = _mm_set1_ps(wv);
+            for (; i+4<=rowlen; i+=4)
+                _mm_storeu_ps(&acc[i], _mm_add_ps(_mm_loadu_ps(&acc[i]), _mm_mul_ps(w4, _mm_loadu_ps(src+i))));
+#endif
+            for (; i<rowlen; i++) acc[i] += wv*src[i];
+        }
+        unsigned char *dst = tdata + (size_t)j*rowlen;
+        int i = 0;
+#ifdef __SSE2__
+        const __m128 lo = _mm_setzero_ps(), hi = _mm_set1_ps(255.f);
+        for (; i+8<=rowlen; i+=8) { // round, clamp and narrow 8 channels at a time
+            __m128i a = _mm_cvtps_epi32(_mm_min_ps(hi, _mm_max_ps(lo, _mm_loadu_ps(&acc[i]))));
+            __m128i b = _mm_cvtps_epi32(_mm_min_ps(hi, _mm_max_ps(lo, _mm_loadu_ps(&acc[i+4]))));
+            __m128i p = _mm_packs_epi32(a, b);
+            _mm_storel_epi64((__m128i *)(dst+i), _mm_packus_epi16(p, p));
+        }
+#endif
+        for (; i<rowlen; i++) {
+            float v = acc[i]+.5f;
+            dst[i] = v<0.f ? 0 : (v>255.f ? 255 : (unsigned char)v);
+        }
+    }
+
+    delete [] data;
+    data = tdata;
+    width = w;
+    height = h;
+    return true;
+}
+
+TGAStreamWriter::TGAStreamWriter() : out_(), width_(0), height_(0), bytespp_(0), rows_(0), rle_(true) {
+}
+
+TGAStreamWriter::~TGAStreamWriter() {
+    if (out_.is_open()) out_.close();
+}
+
+bool TGAStreamWriter::open(const char *filename, int w, int h, int bpp, bool rle, bool vflip) {
+    out_.open(filename, std::ios::binary);
+    if (!out_.is_open()) {
+        std::cerr << "can't open file " << filename << "\n";
+        return false;
+    }
+    width_ = w;
+    height_ = h;
+    bytespp_ = bpp;
+    rows_ = 0;
+    rle_ = rle;
+    TGA_Header header;
+    memset((void *)&header, 0, sizeof(header));
+    header.bitsperpixel = bytespp_<<3;
+    header.width  = width_;
+    header.height = height_;
+    header.datatypecode = (bytespp_==TGAImage::GRAYSCALE?(rle_?11:3):(rle_?10:2));
+    header.imagedescriptor = vflip ? 0x00 : 0x20;
+    out_.write((char *)&header, sizeof(header));
+    if (!out_.good()) {
+        std::cerr << "can't dump the tga file\n";
+        out_.close();
+        return false;
+    }
+    return true;
+}
+
+bool TGAStreamWriter::append(TGAImage &rows) {
+    if (!out_.is_open() || rows.get_width()!=width_ || rows.get_bytespp()!=bytespp_ || rows_+rows.get_height()>height_) {
+        std::cerr << "can't append a " << rows.get_width() << "x" << rows.get_height() << " band to the tga stream\n";
+        return false;
+    }
+    if (rle_) {
+        if (!rows.unload_rle_data(out_)) {
+            std::cerr << "can't unload rle data\n";
+            return false;
+        }
+    } else {
+        out_.write((char *)rows.buffer(), (size_t)width_*rows.get_height()*bytespp_);
+        if (!out_.good()) {
+            std::cerr << "can't unload raw data\n";
+            return false;
+        }
+    }
+    rows_ += rows.get_height();
+    return true;
+}
+
+bool TGAStreamWriter::close() {
+    if (!out_.is_open()) return false;
+    unsigned char developer_area_ref[4] = {0, 0, 0, 0};
+    unsigned char extension_area_ref[4] = {0, 0, 0, 0};
+    unsigned char footer[18] = {'T','R','U','E','V','I','S','I','O','N','-','X','F','I','L','E','.','\0'};
+    out_.write((char *)developer_area_ref, sizeof(developer_area_ref));
+    out_.write((char *)extension_area_ref, sizeof(extension_area_ref));
+    out_.write((char *)footer, sizeof(footer));
+    const bool ok = out_.good() && rows_==height_;
+    out_.close();
+    if (!ok) std::cerr << "can't dump the tga file (" << rows_ << " of " << height_ << " rows written)\n";
+    return ok;
+}
+
+int TGAStreamWriter::rows_written() const {
+    return rows_;
+}
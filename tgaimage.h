@@ -2,6 +2,7 @@
 #define __IMAGE_H__
 
 #include <fstream>
+#include <string>
 
 #pragma pack(push,1)
 struct TGA_Header {
@@ -69,19 +70,39 @@ protected:
 
     bool   load_rle_data(std::ifstream &in);
     bool unload_rle_data(std::ofstream &out);
+    bool write_buffer(const char *filename, const std::string &buf);
+    bool resample(int w, int h, int filter);
 public:
     enum Format {
         GRAYSCALE=1, RGB=3, RGBA=4
     };
 
+    // output container selectable when writing frames; all but TGA are written without compression
+    // except QOI, which is a fast lossless byte-oriented codec (https://qoiformat.org)
+    enum FileFormat {
+        TGA, QOI, PPM, PAM
+    };
+
+    // resampling kernels for scale(); NEAREST is the original Bresenham pixel replication
+    enum Filter {
+        NEAREST, BOX, BILINEAR, LANCZOS
+    };
+
     TGAImage();
     TGAImage(int w, int h, int bpp);
     TGAImage(const TGAImage &img);
     bool read_tga_file(const char *filename);
-    bool write_tga_file(const char *filename, bool rle=true);
+    // vflip writes the rows bottom-up without touching the pixel data (for TGA it only clears the top-left origin bit)
+    bool write_tga_file(const char *filename, bool rle=true, bool vflip=false);
+    bool write_qoi_file(const char *filename, bool vflip=false);
+    bool write_ppm_file(const char *filename, bool vflip=false);
+    bool write_pam_file(const char *filename, bool vflip=false);
+    bool write_file(const char *filename, FileFormat fmt, bool vflip=false);
+    static const char *extension(FileFormat fmt);
+    static bool parse_format(const char *name, FileFormat &fmt);
     bool flip_horizontally();
     bool flip_vertically();
-    bool scale(int w, int h);
+    bool scale(int w, int h, Filter filter=NEAREST);
     TGAColor get(int x, int y);
     bool set(int x, int y, TGAColor &c);
     bool set(int x, int y, const TGAColor &c);
@@ -92,6 +113,30 @@ public:
     int get_bytespp();
     unsigned char *buffer();
     void clear();
+
+    friend class TGAStreamWriter;
+};
+
+// Writes a TGA file a band of rows at a time, for images too large to be held in memory at once: the header goes
+// out first, then append() adds rows in order (in memory order, like write_tga_file). RLE packets stop at band
+// boundaries, the file is otherwise what write_tga_file would have produced for the whole image.
+class TGAStreamWriter {
+public:
+    TGAStreamWriter();
+    ~TGAStreamWriter();
+    bool open(const char *filename, int w, int h, int bpp, bool rle=true, bool vflip=false);
+    // rows.get_width() must be the image width and its bytes per pixel those given to open()
+    bool append(TGAImage &rows);
+    // fails when fewer rows than the height were appended
+    bool close();
+    int rows_written() const;
+private:
+    TGAStreamWriter(const TGAStreamWriter &);
+    TGAStreamWriter &operator=(const TGAStreamWriter &);
+
+    std::ofstream out_;
+    int width_, height_, bytespp_, rows_;
+    bool rle_;
 };
 
 #endif //__IMAGE_H__
@@ -0,0 +1,9 @@
+#include <cstddef>
+#include <sys/time.h>
+#include "timer.h"
+
+double wall_time() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec*1e-6;
+}
@@ -0,0 +1,7 @@
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+// wall-clock time in seconds from an arbitrary origin, for measuring intervals
+double wall_time();
+
+#endif //__TIMER_H__
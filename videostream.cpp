@@ -0,0 +1,159 @@
+#include <iostream>
+#include <cstring>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "videostream.h"
+
+VideoStream::VideoStream() : out_(NULL), fmt_(Y4M420), fps_(25), width_(0), height_(0), frame_() {}
+
+VideoStream::~VideoStream() {
+    close();
+}
+
+bool VideoStream::open(const char *path, Format fmt, int fps) {
+    close();
+    out_ = strcmp(path, "-") ? fopen(path, "wb") : stdout;
+    if (!out_) {
+        std::cerr << "can't open video stream " << path << "\n";
+        return false;
+    }
+    fmt_ = fmt;
+    fps_ = fps>0 ? fps : 25;
+    width_ = height_ = 0;
+    return true;
+}
+
+void VideoStream::close() {
+    if (!out_) return;
+    if (out_==stdout) fflush(out_);
+    else fclose(out_);
+    out_ = NULL;
+}
+
+static inline unsigned char clamp_byte(int v) {
+    return v<0 ? 0 : (v>255 ? 255 : v);
+}
+
+#ifdef __SSE2__
+static inline __m128i pair16(short lo, short hi) {
+    return _mm_set1_epi32((int)(((unsigned int)(unsigned short)hi<<16) | (unsigned short)lo));
+}
+#endif
+
+void bgr_to_yuv_row(const unsigned char *bgr, int bytespp, int n, unsigned char *y, unsigned char *u, unsigned char *v) {
+    int i = 0;
+#ifdef __SSE2__
+    // _mm_madd_epi16 on (r,g) and (b,1) pairs gives the three dot products in 32 bits
+    const __m128i cy_rg = pair16( 66, 129), cy_b1 = pair16( 25, 128);
+    const __m128i cu_rg = pair16(-38, -74), cu_b1 = pair16(112, 128);
+    const __m128i cv_rg = pair16(112, -94), cv_b1 = pair16(-18, 128);
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i off16 = _mm_set1_epi32(16), off128 = _mm_set1_epi32(128);
+    for (; i+8<=n; i+=8) {
+        short rs[8], gs[8], bs[8];
+        const unsigned char *p = bgr + i*bytespp;
+        for (int k=0; k<8; k++, p+=bytespp) {
+            bs[k] = p[0]; gs[k] = p[1]; rs[k] = p[2];
+        }
+        __m128i r = _mm_loadu_si128((const __m128i *)rs);
+        __m128i g = _mm_loadu_si128((const __m128i *)gs);
+        __m128i b = _mm_loadu_si128((const __m128i *)bs);
+        __m128i rg_lo = _mm_unpacklo_epi16(r, g), rg_hi = _mm_unpackhi_epi16(r, g);
+        __m128i b1_lo = _mm_unpacklo_epi16(b, one), b1_hi = _mm_unpackhi_epi16(b, one);
+#define YUV_CHANNEL(crg, cb1, off, dst) { \
+            __m128i lo = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(rg_lo, crg), _mm_madd_epi16(b1_lo, cb1)), 8), off); \
+            __m128i hi = _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(rg_hi, crg), _mm_madd_epi16(b1_hi, cb1)), 8), off); \
+            __m128i w = _mm_packs_epi32(lo, hi); \
+            _mm_storel_epi64((__m128i *)(dst+i), _mm_packus_epi16(w, w)); }
+        YUV_CHANNEL(cy_rg, cy_b1, off16,  y)
+        YUV_CHANNEL(cu_rg, cu_b1, off128, u)
+        YUV_CHANNEL(cv_rg, cv_b1, off128, v)
+#undef YUV_CHANNEL
+    }
+#endif
+    for (; i<n; i++) {
+        const unsigned char *p = bgr + i*bytespp;
+        int b = p[0], g = p[1], r = p[2];
+        y[i] = clamp_byte((( 66*r + 129*g +  25*b + 128)>>8) +  16);
+        u[i] = clamp_byte(((-38*r -  74*g + 112*b + 128)>>8) + 128);
+        v[i] = clamp_byte(((112*r -  94*g -  18*b + 128)>>8) + 128);
+    }
+}
+
+bool VideoStream::write_frame(TGAImage &img, bool vflip) {
+    if (!out_ || !img.buffer()) return false;
+    const int w = img.get_width(), h = img.get_height(), bpp = img.get_bytespp();
+    if (!width_) {
+        width_ = w;
+        height_ = h;
+        if (fmt_!=RAWRGB) {
+            fprintf(out_, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 %s\n", w, h, fps_, fmt_==Y4M444 ? "C444" : "C420jpeg");
+        } else {
+            std::cerr << "raw video stream: rgb24 " << w << "x" << h << " @ " << fps_ << " fps\n";
+        }
+    } else if (w!=width_ || h!=height_) {
+        std::cerr << "video stream frame size changed from " << width_ << "x" << height_ << " to " << w << "x" << h << "\n";
+        return false;
+    }
+
+    const unsigned char *data = img.buffer();
+    const int cw = (w+1)/2, ch = (h+1)/2;
+    if (fmt_==RAWRGB) {
+        frame_.resize(w*h*3);
+        for (int j=0; j<h; j++) {
+            const unsigned char *p = data + (vflip ? h-1-j : j)*w*bpp;
+            unsigned char *dst = &frame_[j*w*3];
+            for (int i=0; i<w; i++, p+=bpp, dst+=3) {
+                if (bpp==TGAImage::GRAYSCALE) {
+                    dst[0] = dst[1] = dst[2] = p[0];
+                } else {
+                    dst[0] = p[2]; dst[1] = p[1]; dst[2] = p[0];
+                }
+            }
+        }
+    } else {
+        if (bpp==TGAImage::GRAYSCALE) {
+            std::cerr << "y4m output expects a color image\n";
+            return false;
+        }
+        // Y, U, V planes at full resolution, then 4:2:0 chroma is averaged in place over 2x2 blocks
+        frame_.resize(w*h*3);
+        unsigned char *Y = &frame_[0], *U = Y + w*h, *V = U + w*h;
+        for (int j=0; j<h; j++)
+            bgr_to_yuv_row(data + (vflip ? h-1-j : j)*w*bpp, bpp, w, Y+j*w, U+j*w, V+j*w);
+        if (fmt_==Y4M420) {
+            unsigned char *planes[2] = {U, V};
+            unsigned char *dst = U;
+            for (int c=0; c<2; c++) {
+                const unsigned char *src = planes[c];
+                for (int j=0; j<ch; j++) {
+                    const unsigned char *r0 = src + 2*j*w;
+                    const unsigned char *r1 = (2*j+1<h) ? r0 + w : r0;
+                    for (int i=0; i<cw; i++) {
+                        int i1 = (2*i+1<w) ? 2*i+1 : 2*i;
+                        *dst++ = (r0[2*i] + r0[i1] + r1[2*i] + r1[i1] + 2)>>2;
+                    }
+                }
+            }
+            frame_.resize(w*h + 2*cw*ch);
+        }
+        if (fputs("FRAME\n", out_)<0) {
+            std::cerr << "can't write the video stream\n";
+            return false;
+        }
+    }
+    if (fwrite(&frame_[0], 1, frame_.size(), out_)!=frame_.size()) {
+        std::cerr << "can't write the video stream\n";
+        return false;
+    }
+    return true;
+}
+
+bool VideoStream::parse_format(const char *name, Format &fmt) {
+    if (!strcmp(name, "y4m") || !strcmp(name, "y4m420")) fmt = Y4M420;
+    else if (!strcmp(name, "y4m444")) fmt = Y4M444;
+    else if (!strcmp(name, "rgb")) fmt = RAWRGB;
+    else return false;
+    return true;
+}
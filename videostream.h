@@ -0,0 +1,41 @@
+#ifndef __VIDEOSTREAM_H__
+#define __VIDEOSTREAM_H__
+#include <cstdio>
+#include <vector>
+#include "tgaimage.h"
+
+// Writes a sequence of frames as a single uncompressed video stream (to a file or to stdout),
+// ready to be piped into an encoder or a viewer, e.g.
+//     ./main --video - obj/african_head.obj | ffmpeg -i - out.mp4
+//     ./main --video - --video-format rgb obj/african_head.obj | ffplay -f rawvideo -pixel_format rgb24 -video_size 800x800 -
+class VideoStream {
+public:
+    enum Format {
+        Y4M444, // YUV4MPEG2, 4:4:4 BT.601 limited range
+        Y4M420, // YUV4MPEG2, 4:2:0 (C420jpeg), what most players expect
+        RAWRGB  // headerless packed rgb24 frames
+    };
+
+    VideoStream();
+    ~VideoStream();
+    bool open(const char *path, Format fmt, int fps=25); // path "-" means stdout
+    // the stream header is emitted with the first frame, all frames must have the same size
+    bool write_frame(TGAImage &img, bool vflip=false);
+    void close();
+    static bool parse_format(const char *name, Format &fmt);
+private:
+    VideoStream(const VideoStream &);
+    VideoStream &operator=(const VideoStream &);
+
+    FILE *out_;
+    Format fmt_;
+    int fps_;
+    int width_;
+    int height_;
+    std::vector<unsigned char> frame_;
+};
+
+// BT.601 limited range conversion of n pixels (BGR or BGRA as stored by TGAImage) into planar Y, U and V
+void bgr_to_yuv_row(const unsigned char *bgr, int bytespp, int n, unsigned char *y, unsigned char *u, unsigned char *v);
+
+#endif //__VIDEOSTREAM_H__
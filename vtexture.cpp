@@ -0,0 +1,338 @@
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "vtexture.h"
+
+static const char vt_magic[4] = {'T', 'R', 'V', 'T'};
+static const int vt_version = 1;
+static const int vt_header_ints = 6; // version, width, height, bytespp, tile size, levels
+
+TileCache::TileCache(size_t budget_bytes, int tile_size) : tile_size_(tile_size), slot_bytes_(tile_size*tile_size*4),
+    slots_(), memory_(), hand_(0), nfree_(0), mutex_(), loaded_(), hits_(0), misses_(0), evictions_(0) {
+    int nslots = std::max<size_t>(1, budget_bytes/slot_bytes_);
+    slots_.resize(nslots);
+    memory_.resize(nslots*slot_bytes_);
+    nfree_ = nslots;
+    pthread_mutex_init(&mutex_, NULL);
+    pthread_cond_init(&loaded_, NULL);
+}
+
+TileCache::~TileCache() {
+    pthread_cond_destroy(&loaded_);
+    pthread_mutex_destroy(&mutex_);
+}
+
+int TileCache::tile_size() {
+    return tile_size_;
+}
+
+size_t TileCache::budget() {
+    return memory_.size();
+}
+
+// the writer side of the slot generation counters, always under the lock
+void TileCache::begin_write(int slot) {
+    __atomic_store_n(&slots_[slot].gen, slots_[slot].gen+1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE); // odd before the slot contents change
+}
+
+void TileCache::end_write(int slot) {
+    __atomic_store_n(&slots_[slot].gen, slots_[slot].gen+1, __ATOMIC_RELEASE);
+}
+
+// returns a slot that holds no tile, being written (odd generation): a never used one, or the first tile the
+// clock hand finds not sampled since its last pass
+int TileCache::evict() {
+    if (nfree_) {
+        for (int i=(int)slots_.size(); i--; ) { // free slots are the only ones without an owner
+            if (!slots_[i].owner && !slots_[i].loading) {
+                nfree_--;
+                begin_write(i);
+                return i;
+            }
+        }
+    }
+    const int n = (int)slots_.size();
+    for (int step=0; step<2*n; step++) { // two turns: the first one may only clear the flags
+        const int slot = hand_;
+        hand_ = (hand_+1)%n;
+        Slot &s = slots_[slot];
+        if (s.loading || !s.owner) continue;
+        if (__atomic_load_n(&s.referenced, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&s.referenced, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+        __atomic_store_n(&s.owner->page_table_[s.tile], -1, __ATOMIC_RELAXED);
+        begin_write(slot);
+        __atomic_store_n(&s.owner, (VirtualTexture *)NULL, __ATOMIC_RELAXED);
+        __atomic_store_n(&s.tile, -1, __ATOMIC_RELAXED);
+        evictions_++;
+        return slot;
+    }
+    return -1;
+}
+
+void TileCache::release(VirtualTexture *owner) {
+    pthread_mutex_lock(&mutex_);
+    for (int i=(int)slots_.size(); i--; ) {
+        if (slots_[i].owner!=owner) continue;
+        begin_write(i);
+        slots_[i].owner = NULL;
+        slots_[i].tile = -1;
+        end_write(i);
+        nfree_++;
+    }
+    pthread_mutex_unlock(&mutex_);
+}
+
+void TileCache::report(std::ostream &out) {
+    pthread_mutex_lock(&mutex_);
+    int resident = (int)slots_.size()-nfree_;
+    out << "tile cache: " << resident << "/" << slots_.size() << " tiles resident (" << resident*slot_bytes_/1024 << " of "
+        << memory_.size()/1024 << " KB), " << __atomic_load_n(&hits_, __ATOMIC_RELAXED) << " hits, " << misses_ << " misses, " << evictions_ << " evictions" << std::endl;
+    pthread_mutex_unlock(&mutex_);
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+
+VirtualTexture::VirtualTexture(const std::string &tgafile, TileCache *cache) : cache_(cache), fd_(-1), bytespp_(0),
+    tile_size_(cache->tile_size()), data_offset_(0), levels_(), page_table_(), feedback_() {
+    std::string vtfile = tgafile + ".vt";
+    struct stat src, dst;
+    if (stat(tgafile.c_str(), &src)) {
+        std::cerr << "can't find texture " << tgafile << "\n";
+        return;
+    }
+    // the tiled pyramid is rebuilt whenever the source texture is newer or was tiled differently
+    if (stat(vtfile.c_str(), &dst) || dst.st_mtime<src.st_mtime || !open(vtfile)) {
+        if (!build(tgafile, vtfile, tile_size_) || !open(vtfile)) {
+            std::cerr << "can't build virtual texture " << vtfile << "\n";
+            return;
+        }
+    }
+    std::cerr << "virtual texture " << vtfile << " " << levels_[0].width << "x" << levels_[0].height << ", "
+              << levels_.size() << " levels, " << page_table_.size() << " tiles" << std::endl;
+}
+
+VirtualTexture::~VirtualTexture() {
+    cache_->release(this);
+    if (fd_>=0) close(fd_);
+}
+
+bool VirtualTexture::valid() {
+    return fd_>=0;
+}
+
+int VirtualTexture::levels() {
+    return (int)levels_.size();
+}
+
+int VirtualTexture::get_width(int level) {
+    return valid() ? levels_[level].width : 0;
+}
+
+int VirtualTexture::get_height(int level) {
+    return valid() ? levels_[level].height : 0;
+}
+
+bool VirtualTexture::build(const std::string &tgafile, const std::string &vtfile, int tile_size) {
+    TGAImage img;
+    if (!img.read_tga_file(tgafile.c_str())) return false;
+    img.flip_vertically(); // same orientation as Model::load_texture, v goes up
+    int nlevels = 1;
+    for (int w=img.get_width(), h=img.get_height(); w>tile_size || h>tile_size; w=std::max(1, w/2), h=std::max(1, h/2))
+        nlevels++;
+    std::string tmpfile = vtfile + ".tmp";
+    std::ofstream out(tmpfile.c_str(), std::ios::binary);
+    if (!out.is_open()) return false;
+    int header[vt_header_ints] = {vt_version, img.get_width(), img.get_height(), img.get_bytespp(), tile_size, nlevels};
+    out.write(vt_magic, sizeof(vt_magic));
+    out.write((char *)header, sizeof(header));
+    const int bpp = img.get_bytespp();
+    std::vector<unsigned char> tile(tile_size*tile_size*bpp);
+    for (int l=0; l<nlevels; l++) {
+        if (l) img.scale(std::max(1, img.get_width()/2), std::max(1, img.get_height()/2), TGAImage::BOX);
+        const int w = img.get_width(), h = img.get_height();
+        const unsigned char *data = img.buffer();
+        for (int ty=0; ty<(h+tile_size-1)/tile_size; ty++) {
+            for (int tx=0; tx<(w+tile_size-1)/tile_size; tx++) {
+                for (int j=0; j<tile_size; j++) { // border tiles are padded by clamping to the edge
+                    int y = std::min(h-1, ty*tile_size+j);
+                    for (int i=0; i<tile_size; i++) {
+                        int x = std::min(w-1, tx*tile_size+i);
+                        memcpy(&tile[(j*tile_size+i)*bpp], data+(x+y*w)*bpp, bpp);
+                    }
+                }
+                out.write((char *)&tile[0], tile.size());
+            }
+        }
+    }
+    bool ok = out.good();
+    out.close();
+    return ok && !rename(tmpfile.c_str(), vtfile.c_str());
+}
+
+bool VirtualTexture::open(const std::string &vtfile) {
+    int fd = ::open(vtfile.c_str(), O_RDONLY);
+    if (fd<0) return false;
+    char magic[4];
+    int header[vt_header_ints];
+    if (read(fd, magic, sizeof(magic))!=(ssize_t)sizeof(magic) || memcmp(magic, vt_magic, sizeof(magic)) ||
+        read(fd, header, sizeof(header))!=(ssize_t)sizeof(header) || header[0]!=vt_version || header[4]!=tile_size_ ||
+        header[1]<=0 || header[2]<=0 || header[3]<1 || header[3]>4 || header[5]<1) {
+        ::close(fd);
+        return false;
+    }
+    bytespp_ = header[3];
+    data_offset_ = sizeof(magic)+sizeof(header);
+    levels_.clear();
+    int ntiles = 0;
+    for (int l=0, w=header[1], h=header[2]; l<header[5]; l++, w=std::max(1, w/2), h=std::max(1, h/2)) {
+        Level L;
+        L.width = w;
+        L.height = h;
+        L.ntx = (w+tile_size_-1)/tile_size_;
+        L.nty = (h+tile_size_-1)/tile_size_;
+        L.first_tile = ntiles;
+        ntiles += L.ntx*L.nty;
+        levels_.push_back(L);
+    }
+    if (lseek(fd, 0, SEEK_END)!=data_offset_+(off_t)ntiles*tile_size_*tile_size_*bytespp_) { // truncated file
+        ::close(fd);
+        return false;
+    }
+    page_table_.assign(ntiles, -1);
+    feedback_.assign(ntiles, 0);
+    fd_ = fd;
+    return true;
+}
+
+bool VirtualTexture::read_resident(int tile, size_t offset, TGAColor &c) {
+    const int slot = __atomic_load_n(&page_table_[tile], __ATOMIC_ACQUIRE);
+    if (slot<0) return false;
+    TileCache::Slot &s = cache_->slots_[slot];
+    const unsigned int gen = __atomic_load_n(&s.gen, __ATOMIC_ACQUIRE);
+    if ((gen&1) || __atomic_load_n(&s.owner, __ATOMIC_RELAXED)!=this || __atomic_load_n(&s.tile, __ATOMIC_RELAXED)!=tile)
+        return false;
+    unsigned char bgra[4] = {0, 0, 0, 0};
+    const unsigned char *src = &cache_->memory_[slot*cache_->slot_bytes_ + offset];
+    for (int i=0; i<bytespp_; i++) bgra[i] = __atomic_load_n(src+i, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&s.gen, __ATOMIC_RELAXED)!=gen) return false; // evicted or refilled while reading
+    if (!__atomic_load_n(&s.referenced, __ATOMIC_RELAXED)) __atomic_store_n(&s.referenced, 1, __ATOMIC_RELAXED);
+    c = TGAColor(bgra, bytespp_);
+    return true;
+}
+
+int VirtualTexture::acquire(int tile) {
+    for (;;) {
+        int slot = page_table_[tile];
+        if (slot>=0) {
+            __atomic_store_n(&cache_->slots_[slot].referenced, 1, __ATOMIC_RELAXED);
+            return slot;
+        }
+        if (slot==-2) { // another thread is reading this tile
+            pthread_cond_wait(&cache_->loaded_, &cache_->mutex_);
+            continue;
+        }
+        slot = cache_->evict();
+        if (slot<0) { // every slot is being loaded
+            pthread_cond_wait(&cache_->loaded_, &cache_->mutex_);
+            continue;
+        }
+        TileCache::Slot &s = cache_->slots_[slot];
+        s.loading = true;
+        __atomic_store_n(&page_table_[tile], -2, __ATOMIC_RELAXED);
+        cache_->misses_++;
+        pthread_mutex_unlock(&cache_->mutex_);
+
+        const size_t tilebytes = tile_size_*tile_size_*bytespp_;
+        unsigned char *dst = &cache_->memory_[slot*cache_->slot_bytes_];
+        const bool ok = pread(fd_, dst, tilebytes, data_offset_+(off_t)tile*tilebytes)==(ssize_t)tilebytes;
+
+        pthread_mutex_lock(&cache_->mutex_);
+        s.loading = false;
+        if (ok) {
+            __atomic_store_n(&s.owner, this, __ATOMIC_RELAXED);
+            __atomic_store_n(&s.tile, tile, __ATOMIC_RELAXED);
+            __atomic_store_n(&s.referenced, 1, __ATOMIC_RELAXED);
+        } else {
+            cache_->nfree_++;
+        }
+        cache_->end_write(slot);
+        __atomic_store_n(&page_table_[tile], ok ? slot : -1, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&cache_->loaded_);
+        if (!ok) {
+            std::cerr << "can't read virtual texture tile " << tile << "\n";
+            return -1;
+        }
+        return slot;
+    }
+}
+
+TGAColor VirtualTexture::get(int x, int y, int level) {
+    if (!valid()) return TGAColor();
+    level = std::max(0, std::min(level, (int)levels_.size()-1));
+    const Level &L = levels_[level];
+    if (x<0 || y<0 || x>=L.width || y>=L.height) return TGAColor();
+    const int tile = L.first_tile + (y/tile_size_)*L.ntx + x/tile_size_;
+    const size_t offset = ((y%tile_size_)*tile_size_ + x%tile_size_)*bytespp_;
+    // other frames sample while one of them takes the feedback: each flag is set and taken atomically
+    if (!__atomic_load_n(&feedback_[tile], __ATOMIC_RELAXED)) __atomic_store_n(&feedback_[tile], 1, __ATOMIC_RELAXED);
+    TGAColor c;
+    if (read_resident(tile, offset, c)) {
+        __atomic_fetch_add(&cache_->hits_, 1, __ATOMIC_RELAXED);
+        return c;
+    }
+    pthread_mutex_lock(&cache_->mutex_);
+    const int slot = acquire(tile);
+    if (slot>=0) c = TGAColor(&cache_->memory_[slot*cache_->slot_bytes_ + offset], bytespp_);
+    pthread_mutex_unlock(&cache_->mutex_);
+    return c;
+}
+
+TGAColor VirtualTexture::sample(Vec2f uv, int level) {
+    level = std::max(0, std::min(level, (int)levels_.size()-1));
+    return get(uv[0]*get_width(level), uv[1]*get_height(level), level);
+}
+
+TGAColor VirtualTexture::sample_footprint(Vec2f uv, float footprint) {
+    if (!valid()) return TGAColor();
+    // texels per pixel along one axis at level 0 is 2^footprint * size; each level halves it
+    const float lod = footprint + .5f*std::log(float(levels_[0].width)*levels_[0].height)/std::log(2.f);
+    const int last = (int)levels_.size()-1;
+    int level = 0; // also for a NaN footprint (degenerate triangle)
+    if (lod>=last) level = last;
+    else if (lod>0.f) level = (int)(lod+.5f);
+    return sample(uv, level);
+}
+
+int VirtualTexture::touched_tiles() {
+    int n = 0;
+    for (size_t t=0; t<feedback_.size(); t++) n += __atomic_load_n(&feedback_[t], __ATOMIC_RELAXED);
+    return n;
+}
+
+int VirtualTexture::total_tiles() {
+    return (int)feedback_.size();
+}
+
+// Every flag is taken (and cleared) with one atomic exchange, so samples recorded by frames still in flight
+// are either taken by this call or left for the next one, never lost. Tiles are then loaded in file order.
+int VirtualTexture::prefetch_feedback() {
+    std::vector<int> touched;
+    for (int t=0; t<(int)feedback_.size(); t++)
+        if (__atomic_exchange_n(&feedback_[t], 0, __ATOMIC_RELAXED)) touched.push_back(t);
+    const int budget = std::min((int)touched.size(), (int)cache_->slots_.size());
+    pthread_mutex_lock(&cache_->mutex_);
+    for (int i=0; i<budget; i++)
+        acquire(touched[i]);
+    pthread_mutex_unlock(&cache_->mutex_);
+    return (int)touched.size();
+}
@@ -0,0 +1,103 @@
+#ifndef __VTEXTURE_H__
+#define __VTEXTURE_H__
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include "geometry.h"
+#include "tgaimage.h"
+
+class VirtualTexture;
+
+// Fixed pool of tile slots shared by all virtual textures. The pool size is derived from a memory
+// budget; when it is full, a tile that was not sampled lately is evicted (the CLOCK approximation of
+// LRU: a hit only sets a flag, so it needs no lock).
+//
+// Resident tiles are read without the lock: each slot carries a generation counter that is odd while
+// the slot is being evicted or filled, and a reader retries under the lock when the counter changed
+// under it. Misses reserve a slot under the lock, read the tile from disk without it, and publish the
+// tile under the lock again; the other threads keep sampling resident tiles meanwhile.
+class TileCache {
+public:
+    TileCache(size_t budget_bytes, int tile_size=128);
+    ~TileCache();
+    int tile_size();
+    size_t budget();
+    void report(std::ostream &out);
+private:
+    friend class VirtualTexture;
+    TileCache(const TileCache &);
+    TileCache &operator=(const TileCache &);
+
+    struct Slot {
+        Slot() : owner(NULL), tile(-1), gen(0), referenced(0), loading(false) {}
+        VirtualTexture *owner;
+        int tile;                 // index in owner's page table
+        unsigned int gen;         // odd while the slot changes
+        unsigned char referenced; // sampled since the clock hand last passed
+        bool loading;             // reserved by a miss whose read is in progress
+    };
+
+    int  evict(); // -1 when every slot is being loaded
+    void begin_write(int slot);
+    void end_write(int slot);
+    void release(VirtualTexture *owner);
+
+    int tile_size_;
+    size_t slot_bytes_;
+    std::vector<Slot> slots_;
+    std::vector<unsigned char> memory_;
+    int hand_;
+    int nfree_;
+    pthread_mutex_t mutex_;
+    pthread_cond_t loaded_; // a miss finished loading its tile
+    unsigned long hits_, misses_, evictions_;
+};
+
+// Texture stored on disk as a pre-tiled mip pyramid (built from the .tga on first use) whose tiles
+// are paged into a TileCache on demand. Every sample is recorded in a feedback map, which is used
+// to prefetch the working set of the previous frame in file order.
+class VirtualTexture {
+public:
+    VirtualTexture(const std::string &tgafile, TileCache *cache);
+    ~VirtualTexture();
+    bool valid();
+    int get_width(int level=0);
+    int get_height(int level=0);
+    int levels();
+    TGAColor get(int x, int y, int level=0);
+    TGAColor sample(Vec2f uv, int level=0);
+    // footprint: log2 of the uv distance covered by one pixel (see Model::sample), picks the nearest mip level
+    TGAColor sample_footprint(Vec2f uv, float footprint);
+    int touched_tiles();
+    int total_tiles();
+    // takes the tiles sampled since the last call, clearing the feedback, and loads (in file order) the ones
+    // that are no longer resident; returns the number of tiles sampled
+    int prefetch_feedback();
+private:
+    friend class TileCache;
+    VirtualTexture(const VirtualTexture &);
+    VirtualTexture &operator=(const VirtualTexture &);
+
+    struct Level {
+        int width, height, ntx, nty, first_tile;
+    };
+
+    static bool build(const std::string &tgafile, const std::string &vtfile, int tile_size);
+    bool open(const std::string &vtfile);
+    // the texel at offset of a tile, if the tile is resident; lock-free
+    bool read_resident(int tile, size_t offset, TGAColor &c);
+    // makes the tile resident and returns its slot, -1 on a read error; called with the cache lock held,
+    // which it releases during the disk read
+    int acquire(int tile);
+
+    TileCache *cache_;
+    int fd_;
+    int bytespp_;
+    int tile_size_;
+    long data_offset_;
+    std::vector<Level> levels_;
+    std::vector<int> page_table_; // tile -> cache slot, -1 when not resident, -2 while being loaded
+    std::vector<unsigned char> feedback_; // set by any sampling thread, taken by prefetch_feedback()
+};
+
+#endif //__VTEXTURE_H__